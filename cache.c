@@ -0,0 +1,442 @@
+//
+// Created by Mic Pringle on 19/10/2026.
+//
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "compiler.h"
+#include "memory.h"
+#include "table.h"
+#include "translate.h"
+#include "vm.h"
+
+// Bump whenever the instruction set or this layout changes.
+#define CACHE_VERSION 6
+
+#define ALIGN(size) (((size) + 7) & ~(size_t) 7)
+
+typedef enum {
+    CONSTANT_NIL,
+    CONSTANT_FALSE,
+    CONSTANT_TRUE,
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION
+} ConstantType;
+
+// Every record is padded to eight bytes, so a mapped file can be used in place.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t hash;
+    uint32_t stringCount;
+    uint32_t functionCount;
+} CacheHeader;
+
+typedef struct {
+    int32_t arity;
+    int32_t upvalueCount;
+    int32_t slotCount;
+    int32_t name;
+    int32_t codeCount;
+    int32_t lineCount;
+    int32_t constantCount;
+    int32_t padding;
+} CacheFunction;
+
+typedef struct {
+    uint32_t type;
+    uint32_t index;
+    double number;
+} CacheConstant;
+
+typedef struct {
+    uint8_t *bytes;
+    size_t count;
+    size_t capacity;
+    Table strings;
+    int stringCount;
+    ObjFunction **functions;
+    int functionCount;
+    int functionCapacity;
+} Writer;
+
+static uint64_t hashString(uint64_t hash, const char *chars) {
+    for (const char *c = chars; *c != '\0'; c++) {
+        hash ^= (uint8_t) *c;
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+static uint64_t hashSource(const char *path, const char *source) {
+    uint64_t hash = hashString(14695981039346656037u, source);
+
+    // Imports are compiled to absolute paths, so a script that moves must be recompiled.
+    char script[PATH_MAX];
+    if (realpath(path, script) != NULL) hash = hashString(hash, script);
+
+    // Code compiled with other options is not interchangeable.
+    hash ^= ((uint64_t) compilerOptions.optimizationLevel << 1) | compilerOptions.isClosedWorld;
+    hash *= 1099511628211u;
+    return hash;
+}
+
+static char *cachePath(const char *path) {
+    size_t length = strlen(path);
+    char *result = malloc(length + 2);
+    if (result == NULL) exit(1);
+    memcpy(result, path, length);
+    result[length] = 'c';
+    result[length + 1] = '\0';
+    return result;
+}
+
+static void *reserve(Writer *writer, size_t size) {
+    size = ALIGN(size);
+    if (writer->capacity < writer->count + size) {
+        size_t oldCapacity = writer->capacity;
+        while (writer->capacity < writer->count + size) {
+            writer->capacity = GROW_CAPACITY(writer->capacity);
+        }
+        writer->bytes = GROW_ARRAY(uint8_t, writer->bytes, oldCapacity, writer->capacity);
+    }
+
+    void *result = writer->bytes + writer->count;
+    memset(result, 0, size);
+    writer->count += size;
+    return result;
+}
+
+static int functionIndex(Writer *writer, ObjFunction *function) {
+    for (int i = writer->functionCount - 1; i >= 0; i--) {
+        if (writer->functions[i] == function) return i;
+    }
+    return -1;
+}
+
+static int stringIndex(Writer *writer, ObjString *string) {
+    Value index;
+    if (tableGet(&writer->strings, string, &index)) return (int) AS_NUMBER(index);
+
+    uint32_t *length = reserve(writer, sizeof(uint32_t) + string->length);
+    *length = (uint32_t) string->length;
+    memcpy(length + 1, string->chars, string->length);
+    tableSet(&writer->strings, string, NUMBER_VAL(writer->stringCount));
+    return writer->stringCount++;
+}
+
+// Strings go out as they are first seen. Functions are numbered before the functions they reference, since a directly
+// bound recursive call makes a function one of its own constants. The script is always function 0.
+static bool collectStrings(Writer *writer, ObjFunction *function) {
+    if (functionIndex(writer, function) != -1) return true;
+    if (function->lazy != NULL) return false;
+
+    if (writer->functionCapacity < writer->functionCount + 1) {
+        int oldCapacity = writer->functionCapacity;
+        writer->functionCapacity = GROW_CAPACITY(oldCapacity);
+        writer->functions = GROW_ARRAY(ObjFunction *, writer->functions, oldCapacity, writer->functionCapacity);
+    }
+    writer->functions[writer->functionCount++] = function;
+
+    if (function->name != NULL) stringIndex(writer, function->name);
+    for (int i = 0; i < function->chunk.constants.count; i++) {
+        Value value = function->chunk.constants.values[i];
+        if (IS_STRING(value)) {
+            stringIndex(writer, AS_STRING(value));
+        } else if (IS_FUNCTION(value)) {
+            if (!collectStrings(writer, AS_FUNCTION(value))) return false;
+        } else if (IS_OBJ(value)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void writeFunction(Writer *writer, ObjFunction *function) {
+    Chunk *chunk = &function->chunk;
+    CacheFunction *record = reserve(writer, sizeof(CacheFunction));
+    record->arity = function->arity;
+    record->upvalueCount = function->upvalueCount;
+    record->slotCount = function->slotCount;
+    record->name = function->name != NULL ? stringIndex(writer, function->name) : -1;
+    record->codeCount = chunk->count;
+    record->lineCount = chunk->lineCount;
+    record->constantCount = chunk->constants.count;
+
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        CacheConstant *constant = reserve(writer, sizeof(CacheConstant));
+        if (IS_NIL(value)) {
+            constant->type = CONSTANT_NIL;
+        } else if (IS_BOOL(value)) {
+            constant->type = AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE;
+        } else if (IS_NUMBER(value)) {
+            constant->type = CONSTANT_NUMBER;
+            constant->number = AS_NUMBER(value);
+        } else if (IS_STRING(value)) {
+            constant->type = CONSTANT_STRING;
+            constant->index = stringIndex(writer, AS_STRING(value));
+        } else {
+            constant->type = CONSTANT_FUNCTION;
+            constant->index = functionIndex(writer, AS_FUNCTION(value));
+        }
+    }
+
+    if (chunk->lineCount > 0) {
+        memcpy(reserve(writer, sizeof(LineStart) * chunk->lineCount), chunk->lines, sizeof(LineStart) * chunk->lineCount);
+    }
+    if (chunk->count > 0) memcpy(reserve(writer, chunk->count), chunk->code, chunk->count);
+}
+
+static void initWriter(Writer *writer) {
+    writer->bytes = NULL;
+    writer->count = 0;
+    writer->capacity = 0;
+    initTable(&writer->strings);
+    writer->stringCount = 0;
+    writer->functions = NULL;
+    writer->functionCount = 0;
+    writer->functionCapacity = 0;
+}
+
+static void freeWriter(Writer *writer) {
+    FREE_ARRAY(uint8_t, writer->bytes, writer->capacity);
+    freeTable(&writer->strings);
+    FREE_ARRAY(ObjFunction *, writer->functions, writer->functionCapacity);
+}
+
+// Fails for code that can't be written out, such as a body that is still waiting to be compiled.
+static bool writeImage(Writer *writer, const char *path, const char *source, ObjFunction *function) {
+    reserve(writer, sizeof(CacheHeader));
+    if (!collectStrings(writer, function)) return false;
+
+    for (int i = 0; i < writer->functionCount; i++) {
+        writeFunction(writer, writer->functions[i]);
+    }
+
+    CacheHeader *header = (CacheHeader *) writer->bytes;
+    memcpy(header->magic, "LOXC", 4);
+    header->version = CACHE_VERSION;
+    header->hash = hashSource(path, source);
+    header->stringCount = writer->stringCount;
+    header->functionCount = writer->functionCount;
+    return true;
+}
+
+void writeCache(const char *path, const char *source, ObjFunction *function) {
+    Writer writer;
+    initWriter(&writer);
+    if (writeImage(&writer, path, source, function)) {
+        // Write to a temporary file first so another process never maps a partial cache.
+        char *finalPath = cachePath(path);
+        char *temporaryPath = malloc(strlen(finalPath) + 5);
+        if (temporaryPath == NULL) exit(1);
+        sprintf(temporaryPath, "%s.tmp", finalPath);
+
+        FILE *file = fopen(temporaryPath, "wb");
+        if (file != NULL) {
+            bool isWritten = fwrite(writer.bytes, 1, writer.count, file) == writer.count;
+            if (fclose(file) == 0 && isWritten) {
+                rename(temporaryPath, finalPath);
+            } else {
+                remove(temporaryPath);
+            }
+        }
+
+        free(temporaryPath);
+        free(finalPath);
+    }
+    freeWriter(&writer);
+}
+
+// Every function's chunk is translated to a C function, which runs against the same runtime as clox. The image still
+// goes into the file as an array: the constants, the line runs for runtime errors, and the functions the translated
+// bodies are attached to all come from it.
+bool writeNative(const char *output, const char *path, const char *source, ObjFunction *function) {
+    Writer writer;
+    initWriter(&writer);
+    bool isWritten = false;
+
+    FILE *file = writeImage(&writer, path, source, function) ? fopen(output, "w") : NULL;
+    if (file != NULL) {
+        fprintf(file, "// Compiled by clox from %s.\n\n#include \"runtime.h\"\n\n", path);
+        fprintf(file, "_Alignas(8) static const uint8_t image[%zu] = {", writer.count);
+        for (size_t i = 0; i < writer.count; i++) {
+            fprintf(file, i % 16 == 0 ? "\n    0x%02x," : " 0x%02x,", writer.bytes[i]);
+        }
+        fprintf(file, "\n};\n\n");
+
+        for (int i = 0; i < writer.functionCount; i++) {
+            translateFunction(file, writer.functions[i], i);
+        }
+        fprintf(file, "static const CompiledFn bodies[] = {");
+        for (int i = 0; i < writer.functionCount; i++) {
+            fprintf(file, i % 8 == 0 ? "\n    function%d," : " function%d,", i);
+        }
+        fprintf(file, "\n};\n\n"
+                      "int main() {\n"
+                      "    initVM();\n"
+                      "    InterpretResult result = interpretImage(image, sizeof(image), bodies);\n"
+                      "    freeVM();\n\n"
+                      "    if (result == INTERPRET_COMPILE_ERROR) return 65;\n"
+                      "    if (result == INTERPRET_RUNTIME_ERROR) return 70;\n"
+                      "    return 0;\n"
+                      "}\n");
+        isWritten = !ferror(file);
+        isWritten = fclose(file) == 0 && isWritten;
+    }
+
+    freeWriter(&writer);
+    return isWritten;
+}
+
+// Loaded objects are kept reachable as the constants of a scratch function on the stack.
+static void keep(ObjFunction *holder, Value value) {
+    push(value);
+    writeValueArray(&holder->chunk.constants, value);
+    pop();
+}
+
+static ObjFunction *readFunctions(uint8_t *memory, size_t size, ObjFunction *holder) {
+    CacheHeader *header = (CacheHeader *) memory;
+    size_t offset = ALIGN(sizeof(CacheHeader));
+
+    for (uint32_t i = 0; i < header->stringCount; i++) {
+        if (offset + sizeof(uint32_t) > size) return NULL;
+        uint32_t length = *(uint32_t *) (memory + offset);
+        if (length > size - offset - sizeof(uint32_t)) return NULL;
+
+        keep(holder, OBJ_VAL(copyString((char *) memory + offset + sizeof(uint32_t), (int) length)));
+        offset += ALIGN(sizeof(uint32_t) + length);
+    }
+
+    // Every function exists before any constants are read, so a constant can refer to any of them.
+    if (header->functionCount == 0 || header->functionCount > (size - offset) / sizeof(CacheFunction)) return NULL;
+    int functionStart = holder->chunk.constants.count;
+    for (uint32_t i = 0; i < header->functionCount; i++) {
+        keep(holder, OBJ_VAL(newFunction()));
+    }
+
+    for (uint32_t i = 0; i < header->functionCount; i++) {
+        if (offset + sizeof(CacheFunction) > size) return NULL;
+        CacheFunction *record = (CacheFunction *) (memory + offset);
+        offset += sizeof(CacheFunction);
+
+        if (record->name < -1 || record->name >= (int32_t) header->stringCount || record->codeCount < 0 || record->lineCount < 0 ||
+            record->constantCount < 0) {
+            return NULL;
+        }
+        size_t constantsSize = sizeof(CacheConstant) * record->constantCount;
+        size_t linesSize = sizeof(LineStart) * record->lineCount;
+        if (constantsSize + linesSize + ALIGN(record->codeCount) > size - offset) return NULL;
+
+        ObjFunction *function = AS_FUNCTION(holder->chunk.constants.values[functionStart + i]);
+        function->arity = record->arity;
+        function->upvalueCount = record->upvalueCount;
+        function->slotCount = record->slotCount;
+        function->name = record->name >= 0 ? AS_STRING(holder->chunk.constants.values[record->name]) : NULL;
+
+        Chunk *chunk = &function->chunk;
+        // The block is the chunk's from the start, so a function from a rejected image still releases it.
+        Value *constants = allocateFrozen(sizeof(Value) * record->constantCount);
+        chunk->constants.values = constants;
+        chunk->isFrozen = true;
+        CacheConstant *entries = (CacheConstant *) (memory + offset);
+        for (int j = 0; j < record->constantCount; j++) {
+            CacheConstant *entry = &entries[j];
+            switch (entry->type) {
+                case CONSTANT_NIL: constants[j] = NIL_VAL; break;
+                case CONSTANT_FALSE: constants[j] = FALSE_VAL; break;
+                case CONSTANT_TRUE: constants[j] = TRUE_VAL; break;
+                case CONSTANT_NUMBER: constants[j] = NUMBER_VAL(entry->number); break;
+                case CONSTANT_STRING:
+                    if (entry->index >= header->stringCount) return NULL;
+                    constants[j] = holder->chunk.constants.values[entry->index];
+                    break;
+                case CONSTANT_FUNCTION:
+                    if (entry->index >= header->functionCount) return NULL;
+                    constants[j] = holder->chunk.constants.values[functionStart + entry->index];
+                    break;
+                default:
+                    return NULL;
+            }
+        }
+        offset += constantsSize;
+
+        // Code and line runs are used straight from the mapping.
+        chunk->lines = (LineStart *) (memory + offset);
+        chunk->lineCount = record->lineCount;
+        chunk->lineCapacity = record->lineCount;
+        offset += linesSize;
+        chunk->code = memory + offset;
+        chunk->count = record->codeCount;
+        chunk->capacity = record->codeCount;
+        offset += ALIGN(record->codeCount);
+        chunk->constants.count = record->constantCount;
+        chunk->constants.capacity = record->constantCount;
+    }
+
+    if (offset != size) return NULL;
+    return AS_FUNCTION(holder->chunk.constants.values[functionStart]);
+}
+
+// Bodies translated to C, if there are any, are numbered like the image's functions.
+static ObjFunction *readImage(uint8_t *memory, size_t size, const CompiledFn *bodies) {
+    CacheHeader *header = (CacheHeader *) memory;
+    if (size < sizeof(CacheHeader) || memcmp(header->magic, "LOXC", 4) != 0 || header->version != CACHE_VERSION) return NULL;
+
+    ObjFunction *holder = newFunction();
+    push(OBJ_VAL(holder));
+    ObjFunction *function = readFunctions(memory, size, holder);
+    if (function != NULL && bodies != NULL) {
+        for (uint32_t i = 0; i < header->functionCount; i++) {
+            AS_FUNCTION(holder->chunk.constants.values[header->stringCount + i])->compiled = bodies[i];
+        }
+    }
+    pop();
+    return function;
+}
+
+ObjFunction *loadCache(const char *path, const char *source) {
+    char *fullPath = cachePath(path);
+    int descriptor = open(fullPath, O_RDONLY);
+    free(fullPath);
+    if (descriptor == -1) return NULL;
+
+    struct stat status;
+    if (fstat(descriptor, &status) == -1 || (size_t) status.st_size < sizeof(CacheHeader)) {
+        close(descriptor);
+        return NULL;
+    }
+
+    size_t size = (size_t) status.st_size;
+    void *memory = mmap(NULL, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    close(descriptor);
+    if (memory == MAP_FAILED) return NULL;
+
+    CacheHeader *header = memory;
+    ObjFunction *function = header->hash == hashSource(path, source) ? readImage(memory, size, NULL) : NULL;
+
+    // A rejected file only leaves unreachable functions behind, and freeing those never touches their code.
+    if (function == NULL) {
+        munmap(memory, size);
+        return NULL;
+    }
+
+    adoptFrozen(memory, size);
+    return function;
+}
+
+// An image compiled into an executable lives as long as the process, so it is used in place and never unmapped.
+ObjFunction *loadImage(const uint8_t *image, size_t size, const CompiledFn *bodies) {
+    return readImage((uint8_t *) image, size, bodies);
+}
@@ -0,0 +1,18 @@
+//
+// Created by Mic Pringle on 19/10/2026.
+//
+
+#ifndef CLOX_CACHE_H
+#define CLOX_CACHE_H
+
+#include "object.h"
+
+ObjFunction *loadCache(const char *path, const char *source);
+
+void writeCache(const char *path, const char *source, ObjFunction *function);
+
+bool writeNative(const char *output, const char *path, const char *source, ObjFunction *function);
+
+ObjFunction *loadImage(const uint8_t *image, size_t size, const CompiledFn *bodies);
+
+#endif
@@ -3,6 +3,7 @@
 //
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "memory.h"
@@ -13,13 +14,26 @@ void initChunk(Chunk *chunk) {
     chunk->count = 0;
     chunk->code = NULL;
     chunk->lines = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
     initValueArray(&chunk->constants);
+    chunk->constantIndex = NULL;
+    chunk->constantIndexCapacity = 0;
+    chunk->isFrozen = false;
 }
 
 void freeChunk(Chunk *chunk) {
+    // A frozen chunk's arrays share one block, which starts with the constants.
+    if (chunk->isFrozen) {
+        releaseFrozen(chunk->constants.values);
+        initChunk(chunk);
+        return;
+    }
+
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
     freeValueArray(&chunk->constants);
+    freeConstantIndex(chunk);
     initChunk(chunk);
 }
 
@@ -28,17 +42,243 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line) {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
         chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
     }
 
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
+
+    if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) return;
+
+    if (chunk->lineCapacity < chunk->lineCount + 1) {
+        int oldCapacity = chunk->lineCapacity;
+        chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->lines = GROW_ARRAY(LineStart, chunk->lines, oldCapacity, chunk->lineCapacity);
+    }
+
+    LineStart *lineStart = &chunk->lines[chunk->lineCount++];
+    lineStart->offset = chunk->count - 1;
+    lineStart->line = line;
+}
+
+void truncateChunk(Chunk *chunk, int count) {
+    chunk->count = count;
+    while (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].offset >= count) {
+        chunk->lineCount--;
+    }
+}
+
+int getLine(Chunk *chunk, int offset) {
+    int start = 0;
+    int end = chunk->lineCount - 1;
+
+    for (;;) {
+        int mid = (start + end) / 2;
+        LineStart *line = &chunk->lines[mid];
+        if (offset < line->offset) {
+            end = mid - 1;
+        } else if (mid == chunk->lineCount - 1 || offset < chunk->lines[mid + 1].offset) {
+            return line->line;
+        } else {
+            start = mid + 1;
+        }
+    }
+}
+
+// Unlike valuesEqual, keeps 0 and -0 apart so a shared constant never changes a printed sign.
+static bool isSameConstant(Value a, Value b) {
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        double left = AS_NUMBER(a);
+        double right = AS_NUMBER(b);
+        return memcmp(&left, &right, sizeof(double)) == 0;
+    }
+
+    return valuesEqual(a, b);
+}
+
+// The index is an open-addressed hash table of positions in the constant pool,
+// with -1 marking an empty entry.
+static int *findEntry(Chunk *chunk, Value value) {
+    uint32_t index = hashValue(value) & (chunk->constantIndexCapacity - 1);
+    for (;;) {
+        int *entry = &chunk->constantIndex[index];
+        if (*entry == -1 || isSameConstant(chunk->constants.values[*entry], value)) return entry;
+
+        index = (index + 1) & (chunk->constantIndexCapacity - 1);
+    }
+}
+
+static void rebuildConstantIndex(Chunk *chunk) {
+    FREE_ARRAY(int, chunk->constantIndex, chunk->constantIndexCapacity);
+
+    int capacity = 8;
+    while (capacity < chunk->constants.count * 2) capacity *= 2;
+    chunk->constantIndex = ALLOCATE(int, capacity);
+    chunk->constantIndexCapacity = capacity;
+    for (int i = 0; i < capacity; i++) {
+        chunk->constantIndex[i] = -1;
+    }
+
+    for (int i = 0; i < chunk->constants.count; i++) {
+        int *entry = findEntry(chunk, chunk->constants.values[i]);
+        if (*entry == -1) *entry = i;
+    }
 }
 
 int addConstant(Chunk *chunk, Value value) {
-    push(value);
+    if (chunk->constantIndexCapacity > 0) {
+        int *entry = findEntry(chunk, value);
+        if (*entry != -1) return *entry;
+    }
+
+    pushRoot(value);
     writeValueArray(&chunk->constants, value);
-    pop();
-    return chunk->constants.count - 1;
+    popRoot();
+
+    int constant = chunk->constants.count - 1;
+    if (chunk->constants.count * 2 > chunk->constantIndexCapacity) {
+        rebuildConstantIndex(chunk);
+    } else {
+        *findEntry(chunk, value) = constant;
+    }
+    return constant;
+}
+
+void freeConstantIndex(Chunk *chunk) {
+    FREE_ARRAY(int, chunk->constantIndex, chunk->constantIndexCapacity);
+    chunk->constantIndex = NULL;
+    chunk->constantIndexCapacity = 0;
+}
+
+// Packs the constants, code and line runs into one exactly sized block, in that order so the
+// end of the pool shares a cache line with the start of the code.
+void freezeChunk(Chunk *chunk) {
+    size_t constantsSize = sizeof(Value) * chunk->constants.count;
+    size_t linesStart = constantsSize + chunk->count;
+    linesStart = (linesStart + _Alignof(LineStart) - 1) & ~(_Alignof(LineStart) - 1);
+    size_t size = linesStart + sizeof(LineStart) * chunk->lineCount;
+
+    uint8_t *block = allocateFrozen(size);
+    Value *constants = (Value *) block;
+    uint8_t *code = block + constantsSize;
+    LineStart *lines = (LineStart *) (block + linesStart);
+    if (chunk->constants.count > 0) memcpy(constants, chunk->constants.values, constantsSize);
+    if (chunk->count > 0) memcpy(code, chunk->code, chunk->count);
+    if (chunk->lineCount > 0) memcpy(lines, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+    freeValueArray(&chunk->constants);
+    freeConstantIndex(chunk);
+
+    chunk->code = code;
+    chunk->capacity = chunk->count;
+    chunk->lines = lines;
+    chunk->lineCapacity = chunk->lineCount;
+    chunk->constants.values = constants;
+    chunk->constants.count = (int) (constantsSize / sizeof(Value));
+    chunk->constants.capacity = chunk->constants.count;
+    chunk->isFrozen = true;
+}
+
+int instructionLength(Chunk *chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_POP:
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_GREATER_NUMBER:
+        case OP_GREATER_EQUAL_NUMBER:
+        case OP_LESS_NUMBER:
+        case OP_LESS_EQUAL_NUMBER:
+        case OP_ADD_NUMBER:
+        case OP_SUBTRACT_NUMBER:
+        case OP_MULTIPLY_NUMBER:
+        case OP_DIVIDE_NUMBER:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+        case OP_INHERIT:
+            return 1;
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_CALL:
+        case OP_CALL_DIRECT:
+        case OP_CONCAT:
+        case OP_INTERPOLATE:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_IMPORT:
+        case OP_CHECK_TYPE:
+            return 2;
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_INVOKE_DIRECT:
+            return 3;
+        case OP_CONSTANT_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        case OP_GET_PROPERTY_LONG:
+        case OP_SET_PROPERTY_LONG:
+        case OP_GET_SUPER_LONG:
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_LOOP_LONG:
+        case OP_CLASS_LONG:
+        case OP_METHOD_LONG:
+        case OP_IMPORT_LONG:
+            return 4;
+        case OP_INVOKE_LONG:
+        case OP_SUPER_INVOKE_LONG:
+            return 5;
+        case OP_FOR_PREP:
+            return 5;
+        case OP_FOR_LOOP:
+            return 6;
+        case OP_SWITCH_TABLE: {
+            int count = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+            return 6 + count * 2;
+        }
+        case OP_SWITCH_HASH: {
+            int capacity = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+            return 5 + capacity * 3;
+        }
+        case OP_CLOSURE: {
+            ObjFunction *function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + function->upvalueCount * 2;
+        }
+        case OP_CLOSURE_LONG: {
+            int constant = (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+            ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+            return 4 + function->upvalueCount * 2;
+        }
+    }
+
+    return 1;
 }
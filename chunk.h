@@ -10,23 +10,35 @@
 
 typedef enum {
     OP_CONSTANT,
+    OP_CONSTANT_LONG,
     OP_NIL,
     OP_TRUE,
     OP_FALSE,
     OP_POP,
     OP_GET_LOCAL,
+    OP_GET_LOCAL_LONG,
     OP_SET_LOCAL,
+    OP_SET_LOCAL_LONG,
     OP_GET_GLOBAL,
+    OP_GET_GLOBAL_LONG,
     OP_DEFINE_GLOBAL,
+    OP_DEFINE_GLOBAL_LONG,
     OP_SET_GLOBAL,
+    OP_SET_GLOBAL_LONG,
     OP_EQUAL,
+    OP_NOT_EQUAL,
     OP_GET_UPVALUE,
     OP_SET_UPVALUE,
     OP_GET_PROPERTY,
+    OP_GET_PROPERTY_LONG,
     OP_SET_PROPERTY,
+    OP_SET_PROPERTY_LONG,
     OP_GET_SUPER,
+    OP_GET_SUPER_LONG,
     OP_GREATER,
+    OP_GREATER_EQUAL,
     OP_LESS,
+    OP_LESS_EQUAL,
     OP_ADD,
     OP_SUBTRACT,
     OP_MULTIPLY,
@@ -35,25 +47,71 @@ typedef enum {
     OP_NEGATE,
     OP_PRINT,
     OP_JUMP,
+    OP_JUMP_LONG,
     OP_JUMP_IF_FALSE,
+    OP_JUMP_IF_FALSE_LONG,
     OP_LOOP,
+    OP_LOOP_LONG,
+    OP_FOR_PREP,
+    OP_FOR_LOOP,
+    OP_SWITCH_TABLE,
+    OP_SWITCH_HASH,
     OP_CALL,
     OP_INVOKE,
+    OP_INVOKE_LONG,
     OP_SUPER_INVOKE,
+    OP_SUPER_INVOKE_LONG,
     OP_CLOSURE,
+    OP_CLOSURE_LONG,
     OP_CLOSE_UPVALUE,
     OP_RETURN,
     OP_CLASS,
+    OP_CLASS_LONG,
     OP_INHERIT,
-    OP_METHOD
+    OP_METHOD,
+    OP_METHOD_LONG,
+    OP_IMPORT,
+    OP_IMPORT_LONG,
+    OP_CHECK_TYPE,
+    OP_GREATER_NUMBER,
+    OP_GREATER_EQUAL_NUMBER,
+    OP_LESS_NUMBER,
+    OP_LESS_EQUAL_NUMBER,
+    OP_ADD_NUMBER,
+    OP_SUBTRACT_NUMBER,
+    OP_MULTIPLY_NUMBER,
+    OP_DIVIDE_NUMBER,
+    OP_CALL_DIRECT,
+    OP_INVOKE_DIRECT,
+    OP_CONCAT,
+    OP_INTERPOLATE
 } OpCode;
 
+// The operand of OP_CHECK_TYPE, from a type annotation.
+typedef enum {
+    KIND_ANY,
+    KIND_NUMBER,
+    KIND_STRING,
+    KIND_BOOL
+} TypeKind;
+
+// Lines are stored as runs: each entry covers the bytes from its offset up to the next entry's.
+typedef struct {
+    int offset;
+    int line;
+} LineStart;
+
 typedef struct {
     int capacity;
     int count;
     uint8_t *code;
-    int *lines;
+    LineStart *lines;
+    int lineCount;
+    int lineCapacity;
     ValueArray constants;
+    int *constantIndex;
+    int constantIndexCapacity;
+    bool isFrozen;
 } Chunk;
 
 void initChunk(Chunk *chunk);
@@ -62,6 +120,16 @@ void freeChunk(Chunk *chunk);
 
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
 
+void truncateChunk(Chunk *chunk, int count);
+
+int getLine(Chunk *chunk, int offset);
+
 int addConstant(Chunk *chunk, Value value);
 
+void freeConstantIndex(Chunk *chunk);
+
+void freezeChunk(Chunk *chunk);
+
+int instructionLength(Chunk *chunk, int offset);
+
 #endif
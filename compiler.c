@@ -2,19 +2,36 @@
 // Created by Mic Pringle on 05/12/2022.
 //
 
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "compiler.h"
+#include "loop.h"
 #include "memory.h"
+#include "optimizer.h"
 #include "scanner.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
+#define MAX_INLINE_LENGTH 32
+#define MAX_SCALAR_FIELDS 16
+
+#define BINDING_DECLARED 0x1
+#define BINDING_REDECLARED 0x2
+#define BINDING_ASSIGNED 0x4
+#define BINDING_SUBCLASSED 0x8
+#define BINDING_FIELD_ASSIGNED 0x10
+#define BINDING_CONSTANT 0x20
+
 typedef struct {
     Token current;
     Token previous;
@@ -48,11 +65,24 @@ typedef struct {
     Token name;
     int depth;
     bool isCaptured;
+    bool isScalar;
+    int fieldStart;
+    int fieldCount;
+    TypeKind kind;
+    bool isConstant;
+    bool hasValue;
+    Value value;
 } Local;
 
+typedef struct {
+    ObjString *name;
+    uint8_t slot;
+} ScalarField;
+
 typedef struct {
     uint8_t index;
     bool isLocal;
+    TypeKind kind;
 } Upvalue;
 
 typedef enum {
@@ -67,28 +97,82 @@ typedef struct Compiler {
     ObjFunction *function;
     FunctionType type;
 
-    Local locals[UINT8_COUNT];
+    Local *locals;
     int localCount;
+    int localCapacity;
     Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;
+    int lastGlobalGet;
+    int lastThisGet;
+    TypeKind lastKind;
+    int lastKindEnd;
+    TypeKind returnKind;
+    ScalarField fields[UINT8_COUNT];
+    int fieldCount;
+    int *farJumps;
+    int farJumpCount;
+    int farJumpCapacity;
+    int sharedConstantCount;
+    // Set while a deferred body is compiled only for its errors, so nothing is spent improving code that's dropped.
+    bool isChecking;
 } Compiler;
 
 typedef struct ClassCompiler {
     struct ClassCompiler *enclosing;
     bool hasSuperclass;
+    Token name;
+    Table methods;
+    ObjFunction *initializer;
 } ClassCompiler;
 
-Parser parser;
-Compiler *current = NULL;
-ClassCompiler *currentClass = NULL;
+typedef struct {
+    int arity;
+    int fieldCount;
+    int constantCount;
+    ObjString *names[MAX_SCALAR_FIELDS];
+    int starts[MAX_SCALAR_FIELDS];
+    int ends[MAX_SCALAR_FIELDS];
+} ScalarShape;
+
+typedef struct {
+    Value value;
+    int target;
+    // Index of the value in the constant table, or -1 until the dispatch needs it.
+    int constant;
+} SwitchCase;
+
+CompilerOptions compilerOptions = {1, false, false, false, false};
+
+// Everything one compilation works on. Each thread has its own innermost context, so compiles
+// can nest and separate sources can be compiled in parallel.
+typedef struct CompileContext {
+    struct CompileContext *enclosing;
+    const char *path;
+    Scanner scanner;
+    Parser parser;
+    Compiler *current;
+    ClassCompiler *currentClass;
+    // Whether the source holds every definition of the globals it uses, so calls can be bound to them.
+    bool isClosedWorld;
+    Table bindingUsage;
+    Table inlineFunctions;
+    Table directFunctions;
+    Table sealedMethods;
+    Table scalarClasses;
+    Table constants;
+} CompileContext;
+
+static _Thread_local CompileContext *context = NULL;
 
 static Chunk *currentChunk() {
-    return &current->function->chunk;
+    return &context->current->function->chunk;
 }
 
 static void errorAt(Token *token, const char *message) {
-    if (parser.panicMode) return;
-    parser.panicMode = true;
+    if (context->parser.panicMode) return;
+    context->parser.panicMode = true;
+    // Keeps a message in one piece when several sources are compiled at once.
+    flockfile(stderr);
     fprintf(stderr, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF) {
@@ -100,30 +184,31 @@ static void errorAt(Token *token, const char *message) {
     }
 
     fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
+    funlockfile(stderr);
+    context->parser.hadError = true;
 }
 
 static void error(const char *message) {
-    errorAt(&parser.previous, message);
+    errorAt(&context->parser.previous, message);
 }
 
 static void errorAtCurrent(const char *message) {
-    errorAt(&parser.current, message);
+    errorAt(&context->parser.current, message);
 }
 
 static void advance() {
-    parser.previous = parser.current;
+    context->parser.previous = context->parser.current;
 
     for (;;) {
-        parser.current = scanToken();
-        if (parser.current.type != TOKEN_ERROR) break;
+        context->parser.current = scanToken(&context->scanner);
+        if (context->parser.current.type != TOKEN_ERROR) break;
 
-        errorAtCurrent(parser.current.start);
+        errorAtCurrent(context->parser.current.start);
     }
 }
 
 static void consume(TokenType type, const char *message) {
-    if (parser.current.type == type) {
+    if (context->parser.current.type == type) {
         advance();
         return;
     }
@@ -132,7 +217,7 @@ static void consume(TokenType type, const char *message) {
 }
 
 static bool check(TokenType type) {
-    return parser.current.type == type;
+    return context->parser.current.type == type;
 }
 
 static bool match(TokenType type) {
@@ -142,7 +227,7 @@ static bool match(TokenType type) {
 }
 
 static void emitByte(uint8_t byte) {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+    writeChunk(currentChunk(), byte, context->parser.previous.line);
 }
 
 static void emitBytes(uint8_t byte1, uint8_t byte2) {
@@ -150,14 +235,37 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
     emitByte(byte2);
 }
 
+static void emitShort(int value) {
+    emitBytes((value >> 8) & 0xFF, value & 0xFF);
+}
+
+// Emits an instruction with a constant index or local slot operand, switching to
+// the long form only when the operand doesn't fit in a byte.
+static void emitOperand(uint8_t op, uint8_t longOp, int operand) {
+    if (operand <= UINT8_MAX) {
+        emitBytes(op, (uint8_t) operand);
+        return;
+    }
+
+    emitByte(longOp);
+    if (longOp != OP_GET_LOCAL_LONG && longOp != OP_SET_LOCAL_LONG) emitByte((operand >> 16) & 0xFF);
+    emitShort(operand);
+}
+
 static void emitLoop(int loopStart) {
-    emitByte(OP_LOOP);
+    int offset = currentChunk()->count - loopStart + 3;
+    if (offset <= UINT16_MAX) {
+        emitByte(OP_LOOP);
+        emitShort(offset);
+        return;
+    }
 
-    int offset = currentChunk()->count - loopStart + 2;
-    if (offset > UINT16_MAX) error("Loop body too large.");
+    offset++;
+    if (offset > UINT24_MAX) error("Loop body too large.");
 
-    emitByte((offset >> 8) & 0xFF);
-    emitByte(offset & 0xFF);
+    emitByte(OP_LOOP_LONG);
+    emitByte((offset >> 16) & 0xFF);
+    emitShort(offset);
 }
 
 static int emitJump(uint8_t instruction) {
@@ -168,56 +276,103 @@ static int emitJump(uint8_t instruction) {
 }
 
 static void emitReturn() {
-    if (current->type == TYPE_INITIALIZER) {
+    if (context->current->type == TYPE_INITIALIZER) {
         emitBytes(OP_GET_LOCAL, 0);
     } else {
         emitByte(OP_NIL);
+        if (context->current->returnKind != KIND_ANY) emitBytes(OP_CHECK_TYPE, context->current->returnKind);
     }
 
     emitByte(OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value) {
+static int makeConstant(Value value) {
+    int count = currentChunk()->constants.count;
     int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX) {
+    if (constant < count) context->current->sharedConstantCount++;
+    if (constant > UINT24_MAX) {
         error("Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t) constant;
+    return constant;
 }
 
 static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    emitOperand(OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(value));
+}
+
+static void addFarJump(int offset, int target) {
+    if (context->current->farJumpCapacity < context->current->farJumpCount + 2) {
+        int oldCapacity = context->current->farJumpCapacity;
+        context->current->farJumpCapacity = GROW_CAPACITY(oldCapacity);
+        context->current->farJumps = GROW_ARRAY(int, context->current->farJumps, oldCapacity, context->current->farJumpCapacity);
+    }
+
+    context->current->farJumps[context->current->farJumpCount++] = offset;
+    context->current->farJumps[context->current->farJumpCount++] = target;
 }
 
 static void patchJump(int offset) {
     int jump = currentChunk()->count - offset - 2;
 
-    if (jump > UINT16_MAX) {
+    if (jump > UINT24_MAX) {
         error("Jump distance is too large.");
+    } else if (jump > UINT16_MAX) {
+        // The jump is widened once the function is complete and nothing else holds an offset into it.
+        addFarJump(offset, currentChunk()->count);
+        jump = 0;
     }
 
     currentChunk()->code[offset] = (jump >> 8) & 0xFF;
     currentChunk()->code[offset + 1] = jump & 0xFF;
 }
 
-static void initCompiler(Compiler *compiler, FunctionType type) {
-    compiler->enclosing = current;
+static Local *pushLocal() {
+    if (context->current->localCapacity < context->current->localCount + 1) {
+        int oldCapacity = context->current->localCapacity;
+        context->current->localCapacity = GROW_CAPACITY(oldCapacity);
+        context->current->locals = GROW_ARRAY(Local, context->current->locals, oldCapacity, context->current->localCapacity);
+    }
+
+    Local *local = &context->current->locals[context->current->localCount++];
+    if (context->current->localCount > context->current->function->slotCount) context->current->function->slotCount = context->current->localCount;
+    local->kind = KIND_ANY;
+    local->isConstant = false;
+    local->hasValue = false;
+    return local;
+}
+
+static void initCompiler(Compiler *compiler, FunctionType type, ObjFunction *function) {
+    compiler->enclosing = context->current;
     compiler->function = NULL;
     compiler->type = type;
+    compiler->locals = NULL;
     compiler->localCount = 0;
+    compiler->localCapacity = 0;
     compiler->scopeDepth = 0;
-
-    compiler->function = newFunction();
-    current = compiler;
-    if (type != TYPE_SCRIPT) {
-        current->function->name = copyString(parser.previous.start, parser.previous.length);
+    compiler->lastGlobalGet = -1;
+    compiler->lastThisGet = -1;
+    compiler->lastKind = KIND_ANY;
+    compiler->lastKindEnd = -1;
+    compiler->returnKind = KIND_ANY;
+    compiler->fieldCount = 0;
+    compiler->farJumps = NULL;
+    compiler->farJumpCount = 0;
+    compiler->farJumpCapacity = 0;
+    compiler->sharedConstantCount = 0;
+    compiler->isChecking = false;
+
+    compiler->function = function != NULL ? function : newFunction();
+    context->current = compiler;
+    if (type != TYPE_SCRIPT && function == NULL) {
+        context->current->function->name = copyString(context->parser.previous.start, context->parser.previous.length);
     }
 
-    Local *local = &current->locals[current->localCount++];
+    Local *local = pushLocal();
     local->depth = 0;
     local->isCaptured = false;
+    local->isScalar = false;
     if (type != TYPE_FUNCTION) {
         local->name.start = "this";
         local->name.length = 4;
@@ -229,32 +384,45 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
 
 static ObjFunction *endCompiler() {
     emitReturn();
-    ObjFunction *function = current->function;
+    ObjFunction *function = context->current->function;
+    if (!context->parser.hadError) {
+        if (context->current->farJumpCount > 0) relaxChunk(&function->chunk, context->current->farJumps, context->current->farJumpCount);
+        optimizeFunction(function, compilerOptions.optimizationLevel);
+    }
+    if (compilerOptions.isReporting && context->current->sharedConstantCount > 0) {
+        int count = function->chunk.constants.count;
+        fprintf(stderr, "[line %d] Constant pool of %s: %d entries, %d before deduplication.\n", context->parser.previous.line,
+                function->name != NULL ? function->name->chars : "script", count, count + context->current->sharedConstantCount);
+    }
 
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError) {
+    if (!context->parser.hadError) {
         disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
     }
 #endif
 
-    current = current->enclosing;
+    freezeChunk(&function->chunk);
+
+    FREE_ARRAY(Local, context->current->locals, context->current->localCapacity);
+    FREE_ARRAY(int, context->current->farJumps, context->current->farJumpCapacity);
+    context->current = context->current->enclosing;
     return function;
 }
 
 static void beginScope() {
-    current->scopeDepth++;
+    context->current->scopeDepth++;
 }
 
 static void endScope() {
-    current->scopeDepth--;
+    context->current->scopeDepth--;
 
-    while (current->localCount > 0 && current->locals[current->localCount - 1].depth > current->scopeDepth) {
-        if (current->locals[current->localCount - 1].isCaptured) {
+    while (context->current->localCount > 0 && context->current->locals[context->current->localCount - 1].depth > context->current->scopeDepth) {
+        if (context->current->locals[context->current->localCount - 1].isCaptured) {
             emitByte(OP_CLOSE_UPVALUE);
         } else {
             emitByte(OP_POP);
         }
-        current->localCount--;
+        context->current->localCount--;
     }
 }
 
@@ -268,7 +436,15 @@ static ParseRule *getRule(TokenType type);
 
 static void parsePrecedence(Precedence precedence);
 
-static uint8_t identifierConstant(Token *name) {
+static Token syntheticToken(const char *text);
+
+static bool hasBinding(Token *name, int flag);
+
+static void recordBinding(Token *name, int flag);
+
+static void emitValue(Value value);
+
+static int identifierConstant(Token *name) {
     return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
@@ -291,7 +467,7 @@ static int resolveLocal(Compiler *compiler, Token *name) {
     return -1;
 }
 
-static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal, TypeKind kind) {
     int upvalueCount = compiler->function->upvalueCount;
 
     for (int i = 0; i < upvalueCount; i++) {
@@ -308,44 +484,80 @@ static int addUpvalue(Compiler *compiler, uint8_t index, bool isLocal) {
 
     compiler->upvalues[upvalueCount].isLocal = isLocal;
     compiler->upvalues[upvalueCount].index = index;
+    compiler->upvalues[upvalueCount].kind = kind;
     return compiler->function->upvalueCount++;
 }
 
+// A lazily compiled body has no enclosing compiler, only the names of the variables it captured.
+static int resolveLazyUpvalue(Compiler *compiler, Token *name) {
+    LazyFunction *lazy = compiler->function->lazy;
+    if (lazy == NULL) return -1;
+
+    for (int i = 0; i < compiler->function->upvalueCount; i++) {
+        SourceName *upvalue = &lazy->upvalueNames[i];
+        if (upvalue->length == name->length && memcmp(upvalue->start, name->start, name->length) == 0) {
+            compiler->upvalues[i].kind = (TypeKind) lazy->upvalueKinds[i];
+            return i;
+        }
+    }
+    return -1;
+}
+
 static int resolveUpvalue(Compiler *compiler, Token *name) {
-    if (compiler->enclosing == NULL) return -1;
+    if (compiler->enclosing == NULL) return resolveLazyUpvalue(compiler, name);
 
     int local = resolveLocal(compiler->enclosing, name);
     if (local != -1) {
+        if (local > UINT8_MAX) {
+            error("Can't capture a local variable beyond the first 256 in a function.");
+            return 0;
+        }
+
         compiler->enclosing->locals[local].isCaptured = true;
-        return addUpvalue(compiler, (uint8_t) local, true);
+        return addUpvalue(compiler, (uint8_t) local, true, compiler->enclosing->locals[local].kind);
     }
 
     int upvalue = resolveUpvalue(compiler->enclosing, name);
     if (upvalue != -1) {
-        return addUpvalue(compiler, (uint8_t) upvalue, false);
+        return addUpvalue(compiler, (uint8_t) upvalue, false, compiler->enclosing->upvalues[upvalue].kind);
     }
 
     return -1;
 }
 
+// The tables of classes and functions the compiler binds statically are keyed by name, so they only apply to a name
+// that no local or captured variable shadows.
+static bool isGlobalName(Token *name) {
+    return resolveLocal(context->current, name) == -1 && resolveUpvalue(context->current, name) == -1;
+}
+
 static void addLocal(Token name) {
-    if (current->localCount == UINT8_COUNT) {
+    if (context->current->localCount == UINT16_COUNT) {
         error("Too many local variables in function.");
+        return;
     }
 
-    Local *local = &current->locals[current->localCount++];
+    Local *local = pushLocal();
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
+    local->isScalar = false;
+}
+
+static bool isConstantGlobal(Token *name) {
+    return context->bindingUsage.count > 0 && hasBinding(name, BINDING_CONSTANT);
 }
 
 static void declareVariable() {
-    if (current->scopeDepth == 0) return;
+    Token *name = &context->parser.previous;
+    if (context->current->scopeDepth == 0) {
+        if (isConstantGlobal(name)) error("Already a constant with this name.");
+        return;
+    }
 
-    Token *name = &parser.previous;
-    for (int i = current->localCount - 1; i >= 0; i--) {
-        Local *local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scopeDepth) {
+    for (int i = context->current->localCount - 1; i >= 0; i--) {
+        Local *local = &context->current->locals[i];
+        if (local->depth != -1 && local->depth < context->current->scopeDepth) {
             break;
         }
 
@@ -357,27 +569,27 @@ static void declareVariable() {
     addLocal(*name);
 }
 
-static uint8_t parseVariable(const char *message) {
+static int parseVariable(const char *message) {
     consume(TOKEN_IDENTIFIER, message);
 
     declareVariable();
-    if (current->scopeDepth > 0) return 0;
+    if (context->current->scopeDepth > 0) return 0;
 
-    return identifierConstant(&parser.previous);
+    return identifierConstant(&context->parser.previous);
 }
 
 static void markInitialized() {
-    if (current->scopeDepth == 0) return;
-    current->locals[current->localCount - 1].depth = current->scopeDepth;
+    if (context->current->scopeDepth == 0) return;
+    context->current->locals[context->current->localCount - 1].depth = context->current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
-    if (current->scopeDepth > 0) {
+static void defineVariable(int global) {
+    if (context->current->scopeDepth > 0) {
         markInitialized();
         return;
     }
 
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitOperand(OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
 }
 
 static uint8_t argumentList() {
@@ -395,6 +607,456 @@ static uint8_t argumentList() {
     return argCount;
 }
 
+static TypeKind parseKind() {
+    consume(TOKEN_IDENTIFIER, "Expect type after ':'.");
+    Token *name = &context->parser.previous;
+    if (identifiersEqual(name, &(Token) {.start = "num", .length = 3})) return KIND_NUMBER;
+    if (identifiersEqual(name, &(Token) {.start = "str", .length = 3})) return KIND_STRING;
+    if (identifiersEqual(name, &(Token) {.start = "bool", .length = 4})) return KIND_BOOL;
+
+    error("Unknown type.");
+    return KIND_ANY;
+}
+
+// The kind of value the expression just compiled is known to produce, if nothing was emitted after it.
+static void noteKind(TypeKind kind) {
+    context->current->lastKind = kind;
+    context->current->lastKindEnd = currentChunk()->count;
+}
+
+static TypeKind expressionKind() {
+    return context->current->lastKindEnd == currentChunk()->count ? context->current->lastKind : KIND_ANY;
+}
+
+static void emitCheck(TypeKind kind) {
+    if (kind != KIND_ANY && expressionKind() != kind) emitBytes(OP_CHECK_TYPE, kind);
+}
+
+static bool hasBindingKey(ObjString *key, int flag) {
+    Value usage;
+    if (!tableGet(&context->bindingUsage, key, &usage)) return false;
+    return ((int) AS_NUMBER(usage) & flag) != 0;
+}
+
+static bool hasBinding(Token *name, int flag) {
+    return hasBindingKey(copyString(name->start, name->length), flag);
+}
+
+// Methods are recorded under "Class.method", apart from the globals.
+static ObjString *methodKey(Token *className, Token *name) {
+    int length = className->length + 1 + name->length;
+    char *chars = ALLOCATE(char, length + 1);
+    memcpy(chars, className->start, className->length);
+    chars[className->length] = '.';
+    memcpy(chars + className->length + 1, name->start, name->length);
+    chars[length] = '\0';
+    return takeString(chars, length);
+}
+
+// A later definition replaces the method at runtime, so no call can be bound to an earlier one.
+static bool isRedefinedMethod(Token *className, Token *name) {
+    return hasBindingKey(methodKey(className, name), BINDING_REDECLARED);
+}
+
+static bool isStableGlobal(Token *name) {
+    return context->isClosedWorld && !hasBinding(name, BINDING_REDECLARED | BINDING_ASSIGNED);
+}
+
+static bool isSealedClass(Token *name) {
+    return isStableGlobal(name) && !hasBinding(name, BINDING_SUBCLASSED);
+}
+
+static ObjFunction *inlineCandidate(Table *candidates, int nameConstant) {
+    if (compilerOptions.optimizationLevel < 1 || !context->isClosedWorld) return NULL;
+
+    Value function;
+    ObjString *name = AS_STRING(currentChunk()->constants.values[nameConstant]);
+    if (!tableGet(candidates, name, &function)) return NULL;
+    return AS_FUNCTION(function);
+}
+
+static bool isSingleLoad(uint8_t op) {
+    return op == OP_CONSTANT || op == OP_NIL || op == OP_TRUE || op == OP_FALSE || op == OP_GET_LOCAL ||
+           op == OP_GET_UPVALUE;
+}
+
+// Applies the stack effect of an instruction that has no side effects and only
+// reads the locals from lowestSlot up to the arity, or returns false.
+static bool isPureInstruction(Chunk *chunk, int offset, int lowestSlot, int arity, int *depth, int *constantCount) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_GET_GLOBAL:
+            (*constantCount)++;
+            (*depth)++;
+            return true;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            (*depth)++;
+            return true;
+        case OP_GET_LOCAL:
+            if (chunk->code[offset + 1] < lowestSlot || chunk->code[offset + 1] > arity) return false;
+            (*depth)++;
+            return true;
+        case OP_GET_PROPERTY:
+            (*constantCount)++;
+            return *depth >= 1;
+        case OP_NOT:
+        case OP_NEGATE:
+            return *depth >= 1;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            if (*depth < 2) return false;
+            (*depth)--;
+            return true;
+        case OP_CONCAT:
+        case OP_INTERPOLATE:
+            if (*depth < chunk->code[offset + 1]) return false;
+            *depth -= chunk->code[offset + 1] - 1;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// A function can be inlined when its body is a single side-effect-free
+// expression over its parameters, ending in OP_RETURN.
+static bool isInlineable(ObjFunction *function, int *constantCount) {
+    if (function->upvalueCount > 0) return false;
+
+    Chunk *chunk = &function->chunk;
+    int depth = 0;
+    *constantCount = 0;
+    for (int offset = 0; offset < chunk->count && offset <= MAX_INLINE_LENGTH; offset += instructionLength(chunk, offset)) {
+        if (chunk->code[offset] == OP_RETURN) return depth == 1;
+        if (!isPureInstruction(chunk, offset, 0, function->arity, &depth, constantCount)) return false;
+    }
+
+    return false;
+}
+
+// Replaces a call whose arguments are all single loads with the body of the
+// callee, repeating an argument's load wherever the body reads the parameter.
+static bool inlineCall(ObjFunction *callee, int start, bool hasReceiver, uint8_t argCount) {
+    int constantCount;
+    if (argCount != callee->arity || !isInlineable(callee, &constantCount)) return false;
+
+    Chunk *chunk = currentChunk();
+    if (chunk->constants.count + constantCount > UINT8_COUNT) return false;
+
+    uint8_t loads[UINT8_COUNT + 1][2];
+    int argument = 1;
+    if (hasReceiver) {
+        loads[0][0] = chunk->code[start];
+        loads[0][1] = chunk->code[start + 1];
+    }
+
+    for (int offset = start + 2; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        uint8_t op = chunk->code[offset];
+        if (!isSingleLoad(op) || argument > argCount) return false;
+        loads[argument][0] = op;
+        loads[argument][1] = instructionLength(chunk, offset) > 1 ? chunk->code[offset + 1] : 0;
+        argument++;
+    }
+    if (argument != argCount + 1) return false;
+
+    truncateChunk(chunk, start);
+    context->current->lastGlobalGet = -1;
+    context->current->lastThisGet = -1;
+    context->current->lastKindEnd = -1;
+
+    Chunk *body = &callee->chunk;
+    for (int offset = 0; body->code[offset] != OP_RETURN; offset += instructionLength(body, offset)) {
+        uint8_t op = body->code[offset];
+        switch (op) {
+            case OP_GET_LOCAL: {
+                uint8_t *load = loads[body->code[offset + 1]];
+                emitByte(load[0]);
+                if (load[0] == OP_CONSTANT || load[0] == OP_GET_LOCAL || load[0] == OP_GET_UPVALUE) emitByte(load[1]);
+                break;
+            }
+            case OP_CONSTANT:
+            case OP_GET_GLOBAL:
+            case OP_GET_PROPERTY:
+                emitBytes(op, makeConstant(body->constants.values[body->code[offset + 1]]));
+                break;
+            case OP_CONCAT:
+            case OP_INTERPOLATE:
+                emitBytes(op, body->code[offset + 1]);
+                break;
+            default:
+                emitByte(op);
+                break;
+        }
+    }
+
+    if (compilerOptions.isReporting) {
+        if (hasReceiver) {
+            fprintf(stderr, "[line %d] Inlined call to %.*s.%s().\n", context->parser.previous.line, context->currentClass->name.length,
+                    context->currentClass->name.start, callee->name->chars);
+        } else {
+            fprintf(stderr, "[line %d] Inlined call to %s().\n", context->parser.previous.line, callee->name->chars);
+        }
+    }
+    return true;
+}
+
+// An instance can be replaced by locals when its initializer only assigns
+// distinct fields of this from side-effect-free expressions over its parameters.
+static bool scalarShape(Value initializer, ScalarShape *shape) {
+    shape->arity = 0;
+    shape->fieldCount = 0;
+    shape->constantCount = 0;
+    if (IS_NIL(initializer)) return true;
+
+    ObjFunction *function = AS_FUNCTION(initializer);
+    if (function->upvalueCount > 0) return false;
+
+    Chunk *chunk = &function->chunk;
+    shape->arity = function->arity;
+    int offset = 0;
+    for (;;) {
+        if (chunk->code[offset] != OP_GET_LOCAL || chunk->code[offset + 1] != 0) return false;
+        offset += 2;
+        if (chunk->code[offset] == OP_RETURN) return offset + 1 == chunk->count;
+        if (shape->fieldCount == MAX_SCALAR_FIELDS) return false;
+
+        int start = offset;
+        int depth = 0;
+        while (chunk->code[offset] != OP_SET_PROPERTY) {
+            if (!isPureInstruction(chunk, offset, 1, shape->arity, &depth, &shape->constantCount)) return false;
+            offset += instructionLength(chunk, offset);
+        }
+        if (depth != 1 || chunk->code[offset + 2] != OP_POP) return false;
+
+        ObjString *name = AS_STRING(chunk->constants.values[chunk->code[offset + 1]]);
+        for (int i = 0; i < shape->fieldCount; i++) {
+            if (shape->names[i] == name) return false;
+        }
+
+        shape->names[shape->fieldCount] = name;
+        shape->starts[shape->fieldCount] = start;
+        shape->ends[shape->fieldCount] = offset;
+        shape->fieldCount++;
+        offset += 3;
+    }
+}
+
+static bool hasScalarField(ScalarShape *shape, Token *name) {
+    for (int i = 0; i < shape->fieldCount; i++) {
+        if (shape->names[i]->length == name->length && memcmp(shape->names[i]->chars, name->start, name->length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Scans ahead over "(arguments);" and the rest of the enclosing block, checking
+// that the variable is only ever used as "name.field" for a field the
+// initializer sets, and never from inside a nested function or class.
+static bool scanScalarUses(Token *name, ScalarShape *shape) {
+    if (scanToken(&context->scanner).type != TOKEN_LEFT_PAREN) return false;
+
+    int nesting = 1;
+    int argCount = 0;
+    Token token = scanToken(&context->scanner);
+    if (token.type != TOKEN_RIGHT_PAREN) argCount = 1;
+    while (nesting > 0) {
+        switch (token.type) {
+            case TOKEN_LEFT_PAREN:
+                nesting++;
+                break;
+            case TOKEN_RIGHT_PAREN:
+                nesting--;
+                break;
+            case TOKEN_COMMA:
+                if (nesting == 1) argCount++;
+                break;
+            case TOKEN_EOF:
+                return false;
+            default:
+                break;
+        }
+        if (nesting > 0) token = scanToken(&context->scanner);
+    }
+    if (argCount != shape->arity || scanToken(&context->scanner).type != TOKEN_SEMICOLON) return false;
+
+    int depth = 0;
+    int nestedDepth = -1;
+    TokenType previous = TOKEN_SEMICOLON;
+    token = scanToken(&context->scanner);
+    for (;;) {
+        switch (token.type) {
+            case TOKEN_EOF:
+                return true;
+            case TOKEN_LEFT_BRACE:
+                depth++;
+                break;
+            case TOKEN_RIGHT_BRACE:
+                if (--depth < 0) return true;
+                if (depth == nestedDepth) nestedDepth = -1;
+                break;
+            case TOKEN_FUN:
+            case TOKEN_CLASS:
+                if (nestedDepth == -1) nestedDepth = depth;
+                break;
+            case TOKEN_IDENTIFIER: {
+                if (previous == TOKEN_DOT || !identifiersEqual(&token, name)) break;
+                if (nestedDepth != -1 || scanToken(&context->scanner).type != TOKEN_DOT) return false;
+
+                Token field = scanToken(&context->scanner);
+                if (field.type != TOKEN_IDENTIFIER || !hasScalarField(shape, &field)) return false;
+
+                previous = TOKEN_IDENTIFIER;
+                token = scanToken(&context->scanner);
+                if (token.type == TOKEN_LEFT_PAREN) return false;
+                continue;
+            }
+            default:
+                break;
+        }
+
+        previous = token.type;
+        token = scanToken(&context->scanner);
+    }
+}
+
+static bool isScalarUse(Token *name, ScalarShape *shape) {
+    Scanner saved = context->scanner;
+    bool isScalar = scanScalarUses(name, shape);
+    context->scanner = saved;
+    return isScalar;
+}
+
+static void addScalarSlot(int *pushed) {
+    if ((*pushed)++ == 0) return;
+    addLocal(syntheticToken(""));
+    markInitialized();
+}
+
+static void emitScalarExpression(Chunk *body, int start, int end, int slot) {
+    for (int offset = start; offset < end; offset += instructionLength(body, offset)) {
+        uint8_t op = body->code[offset];
+        switch (op) {
+            case OP_GET_LOCAL:
+                emitBytes(OP_GET_LOCAL, slot + body->code[offset + 1] - 1);
+                break;
+            case OP_CONSTANT:
+            case OP_GET_GLOBAL:
+            case OP_GET_PROPERTY:
+                emitBytes(op, makeConstant(body->constants.values[body->code[offset + 1]]));
+                break;
+            case OP_CONCAT:
+            case OP_INTERPOLATE:
+                emitBytes(op, body->code[offset + 1]);
+                break;
+            default:
+                emitByte(op);
+                break;
+        }
+    }
+}
+
+// Compiles "var name = Class(arguments);" without allocating the instance when
+// it never escapes the enclosing block. The arguments and any computed fields
+// become hidden locals starting at the variable's own slot.
+static bool scalarDeclaration(Token *name) {
+    if (compilerOptions.optimizationLevel < 1 || !context->isClosedWorld || context->current->scopeDepth == 0 ||
+        !check(TOKEN_IDENTIFIER)) {
+        return false;
+    }
+
+    Value initializer;
+    if (!tableGet(&context->scalarClasses, copyString(context->parser.current.start, context->parser.current.length), &initializer) ||
+        !isGlobalName(&context->parser.current)) {
+        return false;
+    }
+
+    ScalarShape shape;
+    int slot = context->current->localCount - 1;
+    if (!scalarShape(initializer, &shape) || slot + shape.arity + shape.fieldCount >= UINT8_COUNT ||
+        context->current->fieldCount + shape.fieldCount > UINT8_COUNT ||
+        currentChunk()->constants.count + shape.constantCount > UINT8_COUNT || !isScalarUse(name, &shape)) {
+        return false;
+    }
+
+    Token className = context->parser.current;
+    advance();
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after class name.");
+
+    int pushed = 0;
+    if (!check(TOKEN_RIGHT_PAREN)) {
+        do {
+            expression();
+            addScalarSlot(&pushed);
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+
+    // A field assigned straight from a parameter reuses the argument's slot.
+    bool isAliased[UINT8_COUNT + 1] = {false};
+    int fieldStart = context->current->fieldCount;
+    for (int i = 0; i < shape.fieldCount; i++) {
+        Chunk *body = &AS_FUNCTION(initializer)->chunk;
+        int start = shape.starts[i];
+        uint8_t parameter = body->code[start + 1];
+        uint8_t fieldSlot;
+
+        if (shape.ends[i] - start == 2 && body->code[start] == OP_GET_LOCAL && !isAliased[parameter]) {
+            isAliased[parameter] = true;
+            fieldSlot = slot + parameter - 1;
+        } else {
+            emitScalarExpression(body, start, shape.ends[i], slot);
+            fieldSlot = slot + pushed;
+            addScalarSlot(&pushed);
+        }
+        context->current->fields[context->current->fieldCount++] = (ScalarField) {shape.names[i], fieldSlot};
+    }
+    if (pushed == 0) emitByte(OP_NIL);
+
+    Local *local = &context->current->locals[slot];
+    local->depth = context->current->scopeDepth;
+    local->isScalar = true;
+    local->fieldStart = fieldStart;
+    local->fieldCount = shape.fieldCount;
+
+    if (compilerOptions.isReporting) {
+        fprintf(stderr, "[line %d] Eliminated allocation of %.*s instance.\n", className.line, className.length,
+                className.start);
+    }
+    return true;
+}
+
+static void scalarField(Local *local, bool canAssign) {
+    consume(TOKEN_DOT, "Expect '.' after variable.");
+    consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
+
+    uint8_t slot = 0;
+    for (int i = 0; i < local->fieldCount; i++) {
+        ScalarField *field = &context->current->fields[local->fieldStart + i];
+        if (field->name->length == context->parser.previous.length &&
+            memcmp(field->name->chars, context->parser.previous.start, context->parser.previous.length) == 0) {
+            slot = field->slot;
+        }
+    }
+
+    if (canAssign && match(TOKEN_EQUAL)) {
+        expression();
+        emitBytes(OP_SET_LOCAL, slot);
+    } else {
+        emitBytes(OP_GET_LOCAL, slot);
+    }
+}
+
 static void and_(bool canAssign) {
     int endJump = emitJump(OP_JUMP_IF_FALSE);
 
@@ -402,80 +1064,201 @@ static void and_(bool canAssign) {
     parsePrecedence(PREC_AND);
 
     patchJump(endJump);
+    context->current->lastKindEnd = -1;
+}
+
+// Operands that are both known to be numbers get the unchecked _NUMBER instructions.
+// Once a chain of + is known to build a string, the rest of the chain is compiled as one OP_CONCAT, so the
+// result is allocated once rather than once per operator. A single + stays an OP_ADD.
+static void concatenation() {
+    int count = 2;
+    while (count < UINT8_MAX && match(TOKEN_PLUS)) {
+        parsePrecedence(PREC_FACTOR);
+        count++;
+    }
+
+    if (count == 2) {
+        emitByte(OP_ADD);
+    } else {
+        emitBytes(OP_CONCAT, count);
+    }
+    noteKind(KIND_STRING);
 }
 
 static void binary(bool canAssign) {
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = context->parser.previous.type;
+    TypeKind leftKind = expressionKind();
     ParseRule *rule = getRule(operatorType);
     parsePrecedence((Precedence) (rule->precedence + 1));
+    TypeKind rightKind = expressionKind();
+    bool isNumber = leftKind == KIND_NUMBER && rightKind == KIND_NUMBER;
 
     switch (operatorType) {
         case TOKEN_BANG_EQUAL:
-            emitBytes(OP_EQUAL, OP_NOT);
+            emitByte(OP_NOT_EQUAL);
             break;
         case TOKEN_EQUAL_EQUAL:
             emitByte(OP_EQUAL);
             break;
         case TOKEN_GREATER:
-            emitByte(OP_GREATER);
+            emitByte(isNumber ? OP_GREATER_NUMBER : OP_GREATER);
             break;
         case TOKEN_GREATER_EQUAL:
-            emitBytes(OP_LESS, OP_NOT);
+            emitByte(isNumber ? OP_GREATER_EQUAL_NUMBER : OP_GREATER_EQUAL);
             break;
         case TOKEN_LESS:
-            emitByte(OP_LESS);
+            emitByte(isNumber ? OP_LESS_NUMBER : OP_LESS);
             break;
         case TOKEN_LESS_EQUAL:
-            emitBytes(OP_GREATER, OP_NOT);
+            emitByte(isNumber ? OP_LESS_EQUAL_NUMBER : OP_LESS_EQUAL);
             break;
         case TOKEN_PLUS:
-            emitByte(OP_ADD);
-            break;
+            if (leftKind == KIND_STRING || rightKind == KIND_STRING) {
+                concatenation();
+                return;
+            }
+            emitByte(isNumber ? OP_ADD_NUMBER : OP_ADD);
+            if (leftKind == KIND_STRING && rightKind == KIND_STRING) noteKind(KIND_STRING);
+            if (isNumber) noteKind(KIND_NUMBER);
+            return;
         case TOKEN_MINUS:
-            emitByte(OP_SUBTRACT);
-            break;
+            emitByte(isNumber ? OP_SUBTRACT_NUMBER : OP_SUBTRACT);
+            noteKind(KIND_NUMBER);
+            return;
         case TOKEN_STAR:
-            emitByte(OP_MULTIPLY);
-            break;
+            emitByte(isNumber ? OP_MULTIPLY_NUMBER : OP_MULTIPLY);
+            noteKind(KIND_NUMBER);
+            return;
         case TOKEN_SLASH:
-            emitByte(OP_DIVIDE);
-            break;
+            emitByte(isNumber ? OP_DIVIDE_NUMBER : OP_DIVIDE);
+            noteKind(KIND_NUMBER);
+            return;
         default:
             return;
     }
+    noteKind(KIND_BOOL);
+}
+
+// Replaces the global load of a stable top-level function with its constant, which OP_CALL_DIRECT calls without
+// looking at its type or arity. A call with literal arguments to a function that turns out to be pure is replaced by
+// its result instead.
+static bool directCall(ObjFunction *callee, int start, uint8_t argCount) {
+    if (argCount != callee->arity || callee->upvalueCount > 0) return false;
+
+    Value value;
+    if (evaluateCall(callee, currentChunk(), start + 2, currentChunk()->count, &value)) {
+        pushRoot(value);
+        truncateChunk(currentChunk(), start);
+        context->current->lastGlobalGet = -1;
+        emitValue(value);
+        popRoot();
+
+        if (compilerOptions.isReporting) {
+            fprintf(stderr, "[line %d] Evaluated call to %s() at compile time.\n", context->parser.previous.line,
+                    callee->name->chars);
+        }
+        return true;
+    }
+
+    int constant = makeConstant(OBJ_VAL(callee));
+    if (constant > UINT8_MAX) return false;
+
+    currentChunk()->code[start] = OP_CONSTANT;
+    currentChunk()->code[start + 1] = constant;
+    emitBytes(OP_CALL_DIRECT, argCount);
+
+    if (compilerOptions.isReporting) {
+        fprintf(stderr, "[line %d] Bound call to %s() directly.\n", context->parser.previous.line, callee->name->chars);
+    }
+    return true;
+}
+
+// Records which method a name must resolve to: one declared by a single class, which is sealed, and which no field
+// assignment can shadow. A name declared by more than one class maps to nil.
+static void sealMethod(ObjFunction *method) {
+    Value existing;
+    bool isSealed = isSealedClass(&context->currentClass->name) && !hasBinding(&context->parser.previous, BINDING_FIELD_ASSIGNED) &&
+                    !isRedefinedMethod(&context->currentClass->name, &context->parser.previous);
+    if (tableGet(&context->sealedMethods, method->name, &existing) || !isSealed) {
+        tableSet(&context->sealedMethods, method->name, NIL_VAL);
+    } else {
+        tableSet(&context->sealedMethods, method->name, OBJ_VAL(method));
+    }
+}
+
+static bool directInvoke(int name, uint8_t argCount) {
+    if (compilerOptions.optimizationLevel < 1) return false;
+
+    Value method;
+    if (!tableGet(&context->sealedMethods, AS_STRING(currentChunk()->constants.values[name]), &method) || IS_NIL(method)) return false;
+
+    ObjFunction *function = AS_FUNCTION(method);
+    if (argCount != function->arity || function->upvalueCount > 0) return false;
+
+    int constant = makeConstant(method);
+    if (constant > UINT8_MAX) return false;
+    emitBytes(OP_INVOKE_DIRECT, constant);
+    emitByte(argCount);
+
+    if (compilerOptions.isReporting) {
+        fprintf(stderr, "[line %d] Devirtualized call to %s().\n", context->parser.previous.line, function->name->chars);
+    }
+    return true;
 }
 
 static void call(bool canAssign) {
+    int calleeStart = currentChunk()->count - 2;
+    ObjFunction *callee = NULL;
+    ObjFunction *direct = NULL;
+    if (context->current->lastGlobalGet == calleeStart && currentChunk()->code[calleeStart] == OP_GET_GLOBAL) {
+        callee = inlineCandidate(&context->inlineFunctions, currentChunk()->code[calleeStart + 1]);
+        direct = inlineCandidate(&context->directFunctions, currentChunk()->code[calleeStart + 1]);
+    }
+
     uint8_t argCount = argumentList();
+    if (callee != NULL && inlineCall(callee, calleeStart, false, argCount)) return;
+    if (direct != NULL && directCall(direct, calleeStart, argCount)) return;
     emitBytes(OP_CALL, argCount);
 }
 
 static void dot(bool canAssign) {
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant(&parser.previous);
+    Token property = context->parser.previous;
+    int name = identifierConstant(&context->parser.previous);
 
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(OP_SET_PROPERTY, name);
+        emitOperand(OP_SET_PROPERTY, OP_SET_PROPERTY_LONG, name);
     } else if (match(TOKEN_LEFT_PAREN)) {
+        int receiverStart = currentChunk()->count - 2;
+        ObjFunction *callee = NULL;
+        if (context->current->lastThisGet == receiverStart && isSealedClass(&context->currentClass->name) &&
+            !hasBinding(&property, BINDING_FIELD_ASSIGNED) && !isRedefinedMethod(&context->currentClass->name, &property)) {
+            callee = inlineCandidate(&context->currentClass->methods, name);
+        }
+
         uint8_t argCount = argumentList();
-        emitBytes(OP_INVOKE, name);
+        if (callee != NULL && inlineCall(callee, receiverStart, true, argCount)) return;
+        if (directInvoke(name, argCount)) return;
+        emitOperand(OP_INVOKE, OP_INVOKE_LONG, name);
         emitByte(argCount);
     } else {
-        emitBytes(OP_GET_PROPERTY, name);
+        emitOperand(OP_GET_PROPERTY, OP_GET_PROPERTY_LONG, name);
     }
 }
 
 static void literal(bool canAssign) {
-    switch (parser.previous.type) {
+    switch (context->parser.previous.type) {
         case TOKEN_FALSE:
             emitByte(OP_FALSE);
+            noteKind(KIND_BOOL);
             break;
         case TOKEN_NIL:
             emitByte(OP_NIL);
             break;
         case TOKEN_TRUE:
             emitByte(OP_TRUE);
+            noteKind(KIND_BOOL);
             break;
         default:
             return;
@@ -488,8 +1271,9 @@ static void grouping(bool canAssign) {
 }
 
 static void number(bool canAssign) {
-    double value = strtod(parser.previous.start, NULL);
+    double value = strtod(context->parser.previous.start, NULL);
     emitConstant(NUMBER_VAL(value));
+    noteKind(KIND_NUMBER);
 }
 
 static void or_(bool canAssign) {
@@ -501,37 +1285,124 @@ static void or_(bool canAssign) {
 
     parsePrecedence(PREC_OR);
     patchJump(endJump);
+    context->current->lastKindEnd = -1;
 }
 
 static void string(bool canAssign) {
-    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+    emitConstant(OBJ_VAL(copyString(context->parser.previous.start + 1, context->parser.previous.length - 2)));
+    noteKind(KIND_STRING);
+}
+
+// Each piece of "text ${expression} text" is pushed in turn, leaving out empty text, and OP_INTERPOLATE joins them.
+static void interpolation(bool canAssign) {
+    int count = 0;
+    do {
+        Token text = context->parser.previous;
+        if (text.length > 3) {
+            emitConstant(OBJ_VAL(copyString(text.start + 1, text.length - 3)));
+            count++;
+        }
+        expression();
+        count++;
+        if (count > UINT8_MAX - 2) error("Can't have more than 253 pieces in an interpolated string.");
+    } while (match(TOKEN_INTERPOLATION));
+
+    consume(TOKEN_STRING, "Expect end of string after interpolated expression.");
+    if (context->parser.previous.length > 2) {
+        emitConstant(OBJ_VAL(copyString(context->parser.previous.start + 1, context->parser.previous.length - 2)));
+        if (++count > UINT8_MAX - 2) error("Can't have more than 253 pieces in an interpolated string.");
+    }
+    emitBytes(OP_INTERPOLATE, count);
+    noteKind(KIND_STRING);
+}
+
+// Finds whether a name refers to a constant, looking through enclosing functions the way upvalues are resolved, and
+// the constant's value when its initializer could be evaluated.
+static bool resolveConstant(Token *name, bool *hasValue, Value *value) {
+    for (Compiler *compiler = context->current; compiler != NULL; compiler = compiler->enclosing) {
+        for (int i = compiler->localCount - 1; i >= 0; i--) {
+            Local *local = &compiler->locals[i];
+            if (!identifiersEqual(name, &local->name)) continue;
+
+            *hasValue = local->hasValue;
+            *value = local->value;
+            return local->isConstant;
+        }
+    }
+
+    if (!isConstantGlobal(name)) return false;
+    *hasValue = tableGet(&context->constants, copyString(name->start, name->length), value);
+    return true;
+}
+
+static void emitValue(Value value) {
+    if (IS_NIL(value)) {
+        emitByte(OP_NIL);
+    } else if (IS_BOOL(value)) {
+        emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+        noteKind(KIND_BOOL);
+    } else {
+        emitConstant(value);
+        noteKind(IS_NUMBER(value) ? KIND_NUMBER : IS_STRING(value) ? KIND_STRING : KIND_ANY);
+    }
+}
+
+// A deferred body is compiled again on its first call without its enclosing functions, so it captures their
+// constants like any other local instead of taking their values.
+static bool isDeferredCapture(Token *name) {
+    return context->current->isChecking && resolveLocal(context->current, name) == -1 &&
+           resolveUpvalue(context->current, name) != -1;
 }
 
 static void namedVariable(Token name, bool canAssign) {
-    uint8_t getOp, setOp;
-    int arg = resolveLocal(current, &name);
-    if (arg != -1) {
+    bool hasValue = false;
+    Value value;
+    bool isConstant = resolveConstant(&name, &hasValue, &value);
+    bool isAssignment = canAssign && check(TOKEN_EQUAL);
+    if (isConstant && isAssignment) {
+        error("Can't assign to a constant.");
+    } else if (hasValue && !isDeferredCapture(&name)) {
+        emitValue(value);
+        return;
+    }
+
+    uint8_t getOp, setOp, getLongOp, setLongOp;
+    TypeKind kind = KIND_ANY;
+    int arg = resolveLocal(context->current, &name);
+    if (arg != -1 && context->current->locals[arg].isScalar) {
+        scalarField(&context->current->locals[arg], canAssign);
+        return;
+    } else if (arg != -1) {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
-    } else if ((arg = resolveUpvalue(current, &name)) != -1) {
-        getOp = OP_GET_UPVALUE;
-        setOp = OP_SET_UPVALUE;
+        getLongOp = OP_GET_LOCAL_LONG;
+        setLongOp = OP_SET_LOCAL_LONG;
+        kind = context->current->locals[arg].kind;
+    } else if ((arg = resolveUpvalue(context->current, &name)) != -1) {
+        getOp = getLongOp = OP_GET_UPVALUE;
+        setOp = setLongOp = OP_SET_UPVALUE;
+        kind = context->current->upvalues[arg].kind;
     } else {
         arg = identifierConstant(&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
+        getLongOp = OP_GET_GLOBAL_LONG;
+        setLongOp = OP_SET_GLOBAL_LONG;
     }
 
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(setOp, (u_int8_t) arg);
+        emitCheck(kind);
+        emitOperand(setOp, setLongOp, arg);
     } else {
-        emitBytes(getOp, (u_int8_t) arg);
+        if (getOp == OP_GET_GLOBAL) context->current->lastGlobalGet = currentChunk()->count;
+        emitOperand(getOp, getLongOp, arg);
+        noteKind(kind);
     }
 }
 
 static void variable(bool canAssign) {
-    namedVariable(parser.previous, canAssign);
+    namedVariable(context->parser.previous, canAssign);
 }
 
 static Token syntheticToken(const char *text) {
@@ -542,48 +1413,51 @@ static Token syntheticToken(const char *text) {
 }
 
 static void super(bool canAssign) {
-    if (currentClass == NULL) {
+    if (context->currentClass == NULL) {
         error("Can't use 'super' outside of a class.");
-    } else if (!currentClass->hasSuperclass) {
+    } else if (!context->currentClass->hasSuperclass) {
         error("Can't use 'super' in a class with no superclass.");
     }
 
     consume(TOKEN_DOT, "Expect '.' after 'super'.");
     consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&context->parser.previous);
 
     namedVariable(syntheticToken("this"), false);
     if (match(TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList();
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_SUPER_INVOKE, name);
+        emitOperand(OP_SUPER_INVOKE, OP_SUPER_INVOKE_LONG, name);
         emitByte(argCount);
     } else {
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_GET_SUPER, name);
+        emitOperand(OP_GET_SUPER, OP_GET_SUPER_LONG, name);
     }
 }
 
 static void this(bool canAssign) {
-    if (currentClass == NULL) {
+    if (context->currentClass == NULL) {
         error("Can't use 'this' outside of a class.");
         return;
     }
 
+    context->current->lastThisGet = currentChunk()->count;
     variable(false);
 }
 
 static void unary(bool canAssign) {
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = context->parser.previous.type;
 
     parsePrecedence(PREC_UNARY);
 
     switch (operatorType) {
         case TOKEN_BANG:
             emitByte(OP_NOT);
+            noteKind(KIND_BOOL);
             break;
         case TOKEN_MINUS:
             emitByte(OP_NEGATE);
+            noteKind(KIND_NUMBER);
             break;
         default:
             return;
@@ -595,6 +1469,7 @@ ParseRule rules[] = {
         [TOKEN_RIGHT_PAREN]   = {NULL, NULL, PREC_NONE},
         [TOKEN_LEFT_BRACE]    = {NULL, NULL, PREC_NONE},
         [TOKEN_RIGHT_BRACE]   = {NULL, NULL, PREC_NONE},
+        [TOKEN_COLON]         = {NULL, NULL, PREC_NONE},
         [TOKEN_COMMA]         = {NULL, NULL, PREC_NONE},
         [TOKEN_DOT]           = {NULL, dot, PREC_CALL},
         [TOKEN_MINUS]         = {unary, binary, PREC_TERM},
@@ -612,19 +1487,25 @@ ParseRule rules[] = {
         [TOKEN_LESS_EQUAL]    = {NULL, binary, PREC_COMPARISON},
         [TOKEN_IDENTIFIER]    = {variable, NULL, PREC_NONE},
         [TOKEN_STRING]        = {string, NULL, PREC_NONE},
+        [TOKEN_INTERPOLATION] = {interpolation, NULL, PREC_NONE},
         [TOKEN_NUMBER]        = {number, NULL, PREC_NONE},
         [TOKEN_AND]           = {NULL, and_, PREC_AND},
+        [TOKEN_CASE]          = {NULL, NULL, PREC_NONE},
         [TOKEN_CLASS]         = {NULL, NULL, PREC_NONE},
+        [TOKEN_CONST]         = {NULL, NULL, PREC_NONE},
+        [TOKEN_DEFAULT]       = {NULL, NULL, PREC_NONE},
         [TOKEN_ELSE]          = {NULL, NULL, PREC_NONE},
         [TOKEN_FALSE]         = {literal, NULL, PREC_NONE},
         [TOKEN_FOR]           = {NULL, NULL, PREC_NONE},
         [TOKEN_FUN]           = {NULL, NULL, PREC_NONE},
         [TOKEN_IF]            = {NULL, NULL, PREC_NONE},
+        [TOKEN_IMPORT]        = {NULL, NULL, PREC_NONE},
         [TOKEN_NIL]           = {literal, NULL, PREC_NONE},
         [TOKEN_OR]            = {NULL, or_, PREC_OR},
         [TOKEN_PRINT]         = {NULL, NULL, PREC_NONE},
         [TOKEN_RETURN]        = {NULL, NULL, PREC_NONE},
         [TOKEN_SUPER]         = {super, NULL, PREC_NONE},
+        [TOKEN_SWITCH]        = {NULL, NULL, PREC_NONE},
         [TOKEN_THIS]          = {this, NULL, PREC_NONE},
         [TOKEN_TRUE]          = {literal, NULL, PREC_NONE},
         [TOKEN_VAR]           = {NULL, NULL, PREC_NONE},
@@ -635,7 +1516,7 @@ ParseRule rules[] = {
 
 static void parsePrecedence(Precedence precedence) {
     advance();
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+    ParseFn prefixRule = getRule(context->parser.previous.type)->prefix;
     if (prefixRule == NULL) {
         error("Expect expression.");
         return;
@@ -644,9 +1525,9 @@ static void parsePrecedence(Precedence precedence) {
     bool canAssign = precedence <= PREC_ASSIGNMENT;
     prefixRule(canAssign);
 
-    while (precedence <= getRule(parser.current.type)->precedence) {
+    while (precedence <= getRule(context->parser.current.type)->precedence) {
         advance();
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
+        ParseFn infixRule = getRule(context->parser.previous.type)->infix;
         infixRule(canAssign);
     }
 
@@ -671,67 +1552,151 @@ static void block() {
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type) {
-    Compiler compiler;
-    initCompiler(&compiler, type);
-    beginScope();
-
+static void functionBody() {
     consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
     if (!check(TOKEN_RIGHT_PAREN)) {
         do {
-            current->function->arity++;
-            if (current->function->arity > 255) {
+            context->current->function->arity++;
+            if (context->current->function->arity > 255) {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
+            int constant = parseVariable("Expect parameter name.");
+            if (match(TOKEN_COLON)) context->current->locals[context->current->localCount - 1].kind = parseKind();
             defineVariable(constant);
         } while (match(TOKEN_COMMA));
     }
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    if (match(TOKEN_COLON)) {
+        if (context->current->type == TYPE_INITIALIZER) error("Can't annotate the return type of an initializer.");
+        context->current->returnKind = parseKind();
+    }
     consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+
+    // Annotated parameters are checked once on entry, so the body can rely on them.
+    for (int slot = 1; slot <= context->current->function->arity; slot++) {
+        TypeKind kind = context->current->locals[slot].kind;
+        if (kind == KIND_ANY) continue;
+        emitBytes(OP_GET_LOCAL, slot);
+        emitBytes(OP_CHECK_TYPE, kind);
+        emitByte(OP_POP);
+    }
     block();
+}
 
-    ObjFunction *function = endCompiler();
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+// The name an upvalue was captured by, found through the compilers it was passed down from.
+static SourceName upvalueName(Compiler *compiler, int index) {
+    if (compiler->enclosing == NULL) return compiler->function->lazy->upvalueNames[index];
+
+    Upvalue *upvalue = &compiler->upvalues[index];
+    if (!upvalue->isLocal) return upvalueName(compiler->enclosing, upvalue->index);
+
+    Token *name = &compiler->enclosing->locals[upvalue->index].name;
+    return (SourceName) {name->start, name->length};
+}
+
+// Compiles the parameters and body only to report their errors and find what they capture, then drops
+// the code, so the closure can be created now and the body optimized and kept on its first call.
+static ObjFunction *deferFunction(FunctionType type) {
+    ObjFunction *function = context->current->function;
+    const char *source = context->parser.current.start;
+    int line = context->parser.current.line;
+
+    context->current->isChecking = true;
+    functionBody();
+    freeChunk(&function->chunk);
+
+    LazyFunction *lazy = ALLOCATE(LazyFunction, 1);
+    lazy->source = source;
+    lazy->line = line;
+    lazy->type = type;
+    lazy->isInClass = context->currentClass != NULL;
+    lazy->hasSuperclass = context->currentClass != NULL && context->currentClass->hasSuperclass;
+    if (context->currentClass != NULL) lazy->className = (SourceName) {context->currentClass->name.start, context->currentClass->name.length};
+    lazy->upvalueNames = ALLOCATE(SourceName, function->upvalueCount);
+    lazy->upvalueKinds = ALLOCATE(uint8_t, function->upvalueCount);
+    for (int i = 0; i < function->upvalueCount; i++) {
+        lazy->upvalueNames[i] = upvalueName(context->current, i);
+        lazy->upvalueKinds[i] = context->current->upvalues[i].kind;
+    }
+    function->lazy = lazy;
+
+    FREE_ARRAY(Local, context->current->locals, context->current->localCapacity);
+    FREE_ARRAY(int, context->current->farJumps, context->current->farJumpCapacity);
+    context->current = context->current->enclosing;
+    return function;
+}
+
+static ObjFunction *function(FunctionType type) {
+    Compiler compiler;
+    initCompiler(&compiler, type, NULL);
+    beginScope();
+
+    // Registered before the body is compiled, so recursive calls are bound directly too.
+    if (type == TYPE_FUNCTION && compiler.enclosing->type == TYPE_SCRIPT && compiler.enclosing->scopeDepth == 0 &&
+        isStableGlobal(&context->parser.previous)) {
+        tableSet(&context->directFunctions, compiler.function->name, OBJ_VAL(compiler.function));
+    } else if (type == TYPE_METHOD && compiler.enclosing->type == TYPE_SCRIPT && context->currentClass->enclosing == NULL &&
+               compiler.enclosing->scopeDepth == (context->currentClass->hasSuperclass ? 1 : 0)) {
+        sealMethod(compiler.function);
+    }
+
+    ObjFunction *function;
+    if (compilerOptions.isLazy && !compilerOptions.isClosedWorld) {
+        function = deferFunction(type);
+    } else {
+        functionBody();
+        function = endCompiler();
+    }
+    emitOperand(OP_CLOSURE, OP_CLOSURE_LONG, makeConstant(OBJ_VAL(function)));
 
     for (int i = 0; i < function->upvalueCount; i++) {
         emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
         emitByte(compiler.upvalues[i].index);
     }
+
+    return function;
 }
 
 static void method() {
     consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifierConstant(&parser.previous);
+    int constant = identifierConstant(&context->parser.previous);
 
     FunctionType type = TYPE_METHOD;
-    if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) {
+    if (context->parser.previous.length == 4 && memcmp(context->parser.previous.start, "init", 4) == 0) {
         type = TYPE_INITIALIZER;
     }
 
-    function(type);
-    emitBytes(OP_METHOD, constant);
+    ObjFunction *compiled = function(type);
+    if (type == TYPE_METHOD) {
+        tableSet(&context->currentClass->methods, AS_STRING(currentChunk()->constants.values[constant]), OBJ_VAL(compiled));
+    } else {
+        context->currentClass->initializer = compiled;
+    }
+    emitOperand(OP_METHOD, OP_METHOD_LONG, constant);
 }
 
 static void classDeclaration() {
     consume(TOKEN_IDENTIFIER, "Expect class name.");
-    Token className = parser.previous;
-    uint8_t nameConstant = identifierConstant(&parser.previous);
+    Token className = context->parser.previous;
+    int nameConstant = identifierConstant(&context->parser.previous);
     declareVariable();
 
-    emitBytes(OP_CLASS, nameConstant);
+    emitOperand(OP_CLASS, OP_CLASS_LONG, nameConstant);
     defineVariable(nameConstant);
 
     ClassCompiler classCompiler;
     classCompiler.hasSuperclass = false;
-    classCompiler.enclosing = currentClass;
-    currentClass = &classCompiler;
+    classCompiler.name = className;
+    initTable(&classCompiler.methods);
+    classCompiler.initializer = NULL;
+    classCompiler.enclosing = context->currentClass;
+    context->currentClass = &classCompiler;
 
     if (match(TOKEN_LESS)) {
         consume(TOKEN_IDENTIFIER, "Expect superclass name.");
         variable(false);
 
-        if (identifiersEqual(&className, &parser.previous)) {
+        if (identifiersEqual(&className, &context->parser.previous)) {
             error("A class can't inherit from itself.");
         }
 
@@ -754,23 +1719,41 @@ static void classDeclaration() {
 
     if (classCompiler.hasSuperclass) {
         endScope();
+    } else if (context->current->scopeDepth == 0 && isStableGlobal(&className)) {
+        Value initializer = classCompiler.initializer != NULL ? OBJ_VAL(classCompiler.initializer) : NIL_VAL;
+        tableSet(&context->scalarClasses, AS_STRING(currentChunk()->constants.values[nameConstant]), initializer);
     }
 
-    currentClass = currentClass->enclosing;
+    freeTable(&classCompiler.methods);
+    context->currentClass = context->currentClass->enclosing;
 }
 
 static void funDeclaration() {
-    uint8_t global = parseVariable("Expect function name.");
+    int global = parseVariable("Expect function name.");
+    Token name = context->parser.previous;
     markInitialized();
-    function(TYPE_FUNCTION);
+    ObjFunction *compiled = function(TYPE_FUNCTION);
+
+    if (context->current->scopeDepth == 0 && isStableGlobal(&name)) {
+        tableSet(&context->inlineFunctions, AS_STRING(currentChunk()->constants.values[global]), OBJ_VAL(compiled));
+    }
     defineVariable(global);
 }
 
 static void varDeclaration() {
-    uint8_t global = parseVariable("Expect variable name.");
+    int global = parseVariable("Expect variable name.");
+    Token name = context->parser.previous;
+
+    // Only locals are specialized on their annotation, since any code can assign a global.
+    TypeKind kind = match(TOKEN_COLON) ? parseKind() : KIND_ANY;
+    if (context->current->scopeDepth > 0) context->current->locals[context->current->localCount - 1].kind = kind;
 
     if (match(TOKEN_EQUAL)) {
+        if (kind == KIND_ANY && scalarDeclaration(&name)) return;
         expression();
+        emitCheck(kind);
+    } else if (kind != KIND_ANY) {
+        error("Expect initializer for a typed variable.");
     } else {
         emitByte(OP_NIL);
     }
@@ -779,38 +1762,239 @@ static void varDeclaration() {
     defineVariable(global);
 }
 
+// Calls through a constant that aliases a function or class the compiler already binds statically are bound the same way.
+static void aliasBinding(Token *name, int start) {
+    Chunk *chunk = currentChunk();
+    if (chunk->count != start + 2 || chunk->code[start] != OP_GET_GLOBAL || !isGlobalName(name)) return;
+
+    ObjString *target = AS_STRING(chunk->constants.values[chunk->code[start + 1]]);
+    ObjString *alias = copyString(name->start, name->length);
+    pushRoot(OBJ_VAL(alias));
+    Value binding;
+    if (tableGet(&context->inlineFunctions, target, &binding)) tableSet(&context->inlineFunctions, alias, binding);
+    if (tableGet(&context->directFunctions, target, &binding)) tableSet(&context->directFunctions, alias, binding);
+    if (tableGet(&context->scalarClasses, target, &binding)) tableSet(&context->scalarClasses, alias, binding);
+    popRoot();
+}
+
+// A constant whose initializer evaluates at compile time is substituted wherever it is read, so the slot or global
+// it still defines is only there for code the compiler can't see.
+static void constDeclaration() {
+    int global = parseVariable("Expect constant name.");
+    Token name = context->parser.previous;
+    int slot = context->current->localCount - 1;
+    if (context->current->scopeDepth > 0) context->current->locals[slot].isConstant = true;
+
+    consume(TOKEN_EQUAL, "Expect '=' after constant name.");
+    int start = currentChunk()->count;
+    expression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after constant declaration.");
+
+    Value value = NIL_VAL;
+    bool hasValue = evaluateConstant(currentChunk(), start, currentChunk()->count, &value);
+    if (hasValue) {
+        truncateChunk(currentChunk(), start);
+        context->current->lastGlobalGet = -1;
+        context->current->lastThisGet = -1;
+        emitValue(value);
+    } else if (context->current->scopeDepth == 0) {
+        aliasBinding(&name, start);
+    }
+
+    if (context->current->scopeDepth > 0) {
+        context->current->locals[slot].hasValue = hasValue;
+        context->current->locals[slot].value = value;
+    } else {
+        recordBinding(&name, BINDING_CONSTANT);
+        if (hasValue) {
+            ObjString *key = copyString(name.start, name.length);
+            pushRoot(OBJ_VAL(key));
+            tableSet(&context->constants, key, value);
+            popRoot();
+        }
+    }
+
+    defineVariable(global);
+}
+
 static void expressionStatement() {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
     emitByte(OP_POP);
 }
 
+static bool isNumberConstant(uint8_t constant) {
+    return IS_NUMBER(currentChunk()->constants.values[constant]);
+}
+
+static bool matchRangeCondition(int slot, int start, int end, int *limit) {
+    uint8_t *code = currentChunk()->code;
+    if (end - start != 5) return false;
+    if (code[start] != OP_GET_LOCAL || code[start + 1] != slot) return false;
+    if (code[start + 4] != OP_LESS && code[start + 4] != OP_LESS_NUMBER) return false;
+
+    if (code[start + 2] == OP_CONSTANT && isNumberConstant(code[start + 3])) {
+        *limit = -1 - code[start + 3];
+        return true;
+    }
+
+    if (code[start + 2] == OP_GET_LOCAL && code[start + 3] != slot) {
+        *limit = code[start + 3];
+        return true;
+    }
+
+    return false;
+}
+
+static bool matchRangeIncrement(int slot, int start, int end, uint8_t *step) {
+    uint8_t *code = currentChunk()->code;
+    if (end - start != 7) return false;
+    if (code[start] != OP_GET_LOCAL || code[start + 1] != slot) return false;
+    if (code[start + 2] != OP_CONSTANT || !isNumberConstant(code[start + 3])) return false;
+    if (code[start + 4] != OP_ADD && code[start + 4] != OP_ADD_NUMBER) return false;
+    if (code[start + 5] != OP_SET_LOCAL || code[start + 6] != slot) return false;
+
+    *step = code[start + 3];
+    return true;
+}
+
+// Bounds the magnitude a range loop's counter can reach, or 0 when it is not
+// known to stay an integer.
+static double rangeBound(int initializerStart, int initializerEnd, int limit, uint8_t step) {
+    Chunk *chunk = currentChunk();
+    if (initializerEnd - initializerStart != 2 || chunk->code[initializerStart] != OP_CONSTANT || limit >= 0) return 0;
+
+    if (!isNumberConstant(chunk->code[initializerStart + 1])) return 0;
+
+    double values[3] = {
+            AS_NUMBER(chunk->constants.values[chunk->code[initializerStart + 1]]),
+            AS_NUMBER(chunk->constants.values[-1 - limit]),
+            AS_NUMBER(chunk->constants.values[step])
+    };
+    if (values[2] <= 0) return 0;
+
+    double bound = 0;
+    for (int i = 0; i < 3; i++) {
+        double magnitude = values[i] < 0 ? -values[i] : values[i];
+        if (magnitude >= MAX_EXACT_INTEGER || values[i] != (double) (int64_t) values[i]) return 0;
+        if (i < 2 && magnitude > bound) bound = magnitude;
+    }
+    return bound + values[2];
+}
+
+static bool writesLocal(int start, int slot) {
+    Chunk *chunk = currentChunk();
+    for (int offset = start; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        if (chunk->code[offset] == OP_SET_LOCAL && chunk->code[offset + 1] == slot) return true;
+    }
+
+    return false;
+}
+
+static void optimizeLoopAt(int start, int slotCount, double counterBound) {
+    if (compilerOptions.optimizationLevel < 1 || context->parser.hadError || context->current->isChecking) return;
+
+    optimizeLoop(currentChunk(), start, slotCount, counterBound);
+    context->current->lastGlobalGet = -1;
+    context->current->lastThisGet = -1;
+}
+
+static void emitRangeLoop(int slot, int limit, uint8_t step, double counterBound, int conditionLine, int incrementLine) {
+    Chunk *chunk = currentChunk();
+
+    if (limit < 0) {
+        writeChunk(chunk, OP_CONSTANT, conditionLine);
+        writeChunk(chunk, (uint8_t) (-1 - limit), conditionLine);
+        addLocal(syntheticToken(""));
+        markInitialized();
+        limit = context->current->localCount - 1;
+    }
+
+    int loopStart = chunk->count;
+    writeChunk(chunk, OP_FOR_PREP, conditionLine);
+    writeChunk(chunk, slot, conditionLine);
+    writeChunk(chunk, limit, conditionLine);
+    writeChunk(chunk, 0xFF, conditionLine);
+    writeChunk(chunk, 0xFF, conditionLine);
+    int exitJump = chunk->count - 2;
+
+    int bodyStart = chunk->count;
+    statement();
+
+    int offset = chunk->count - bodyStart + 6;
+    bool isInvariant = !context->current->locals[slot].isCaptured && !context->current->locals[limit].isCaptured &&
+                       !writesLocal(bodyStart, slot) && !writesLocal(bodyStart, limit);
+
+    if (isInvariant && offset <= UINT16_MAX) {
+        writeChunk(chunk, OP_FOR_LOOP, incrementLine);
+        writeChunk(chunk, slot, incrementLine);
+        writeChunk(chunk, limit, incrementLine);
+        writeChunk(chunk, step, incrementLine);
+        writeChunk(chunk, (offset >> 8) & 0xFF, incrementLine);
+        writeChunk(chunk, offset & 0xFF, incrementLine);
+    } else {
+        // The body may retype the counter or the limit, or be too long for OP_FOR_LOOP's
+        // distance, so keep the checked instructions.
+        emitBytes(OP_GET_LOCAL, slot);
+        emitBytes(OP_CONSTANT, step);
+        emitByte(OP_ADD);
+        emitBytes(OP_SET_LOCAL, slot);
+        emitByte(OP_POP);
+        emitBytes(OP_GET_LOCAL, slot);
+        emitBytes(OP_GET_LOCAL, limit);
+        emitByte(OP_LESS);
+
+        int falseJump = emitJump(OP_JUMP_IF_FALSE);
+        emitByte(OP_POP);
+        emitLoop(bodyStart);
+        patchJump(falseJump);
+        emitByte(OP_POP);
+    }
+
+    patchJump(exitJump);
+    optimizeLoopAt(loopStart, context->current->localCount, counterBound);
+}
+
 static void forStatement() {
     beginScope();
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
 
+    int loopVariable = -1;
+    int initializerStart = -1;
+    int initializerEnd = -1;
     if (match(TOKEN_SEMICOLON)) {
         // Empty initializer
     } else if (match(TOKEN_VAR)) {
+        initializerStart = currentChunk()->count;
         varDeclaration();
+        initializerEnd = currentChunk()->count;
+        loopVariable = context->current->localCount - 1;
     } else {
         expressionStatement();
     }
 
+    int slotCount = context->current->localCount;
     int loopStart = currentChunk()->count;
+    int conditionStart = loopStart;
+    int conditionEnd = -1;
     int exitJump = -1;
 
     if (!match(TOKEN_SEMICOLON)) {
         expression();
+        conditionEnd = currentChunk()->count;
         consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
         exitJump = emitJump(OP_JUMP_IF_FALSE);
         emitByte(OP_POP);
     }
 
+    int incrementStart = -1;
+    int incrementEnd = -1;
+
     if (!match(TOKEN_RIGHT_PAREN)) {
         int bodyJump = emitJump(OP_JUMP);
-        int incrementStart = currentChunk()->count;
+        incrementStart = currentChunk()->count;
         expression();
+        incrementEnd = currentChunk()->count;
         emitByte(OP_POP);
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after 'for' clauses.");
 
@@ -819,6 +2003,23 @@ static void forStatement() {
         patchJump(bodyJump);
     }
 
+    // A counting loop "for (var i = a; i < n; i = i + k)" is rewritten to use the fused range instructions.
+    int limit;
+    uint8_t step;
+    if (loopVariable != -1 && conditionEnd != -1 && incrementStart != -1 &&
+        matchRangeCondition(loopVariable, conditionStart, conditionEnd, &limit) &&
+        matchRangeIncrement(loopVariable, incrementStart, incrementEnd, &step) &&
+        (limit >= 0 || context->current->localCount < UINT8_COUNT)) {
+        int conditionLine = getLine(currentChunk(), conditionEnd - 1);
+        int incrementLine = getLine(currentChunk(), incrementEnd - 1);
+        double counterBound = rangeBound(initializerStart, initializerEnd, limit, step);
+        truncateChunk(currentChunk(), conditionStart);
+
+        emitRangeLoop(loopVariable, limit, step, counterBound, conditionLine, incrementLine);
+        endScope();
+        return;
+    }
+
     statement();
     emitLoop(loopStart);
 
@@ -827,6 +2028,7 @@ static void forStatement() {
         emitByte(OP_POP);
     }
 
+    optimizeLoopAt(conditionStart, slotCount, 0);
     endScope();
 }
 
@@ -855,24 +2057,245 @@ static void printStatement() {
 }
 
 static void returnStatement() {
-    if (current->type == TYPE_SCRIPT) {
+    if (context->current->type == TYPE_SCRIPT) {
         error("Can't return from top-level code.");
     }
 
     if (match(TOKEN_SEMICOLON)) {
         emitReturn();
     } else {
-        if (current->type == TYPE_INITIALIZER) {
+        if (context->current->type == TYPE_INITIALIZER) {
             error("Can't return a value from an initializer.");
         }
 
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+        emitCheck(context->current->returnKind);
         emitByte(OP_RETURN);
     }
 }
 
+static Value caseValue(int *constant) {
+    *constant = -1;
+    if (match(TOKEN_NUMBER)) return NUMBER_VAL(strtod(context->parser.previous.start, NULL));
+    if (match(TOKEN_MINUS)) {
+        consume(TOKEN_NUMBER, "Expect number after '-'.");
+        return NUMBER_VAL(-strtod(context->parser.previous.start, NULL));
+    }
+    if (match(TOKEN_STRING)) {
+        Value string = OBJ_VAL(copyString(context->parser.previous.start + 1, context->parser.previous.length - 2));
+        *constant = makeConstant(string);
+        return string;
+    }
+    if (match(TOKEN_TRUE)) return BOOL_VAL(true);
+    if (match(TOKEN_FALSE)) return BOOL_VAL(false);
+    if (match(TOKEN_NIL)) return NIL_VAL;
+
+    errorAtCurrent("Expect constant case value.");
+    return NIL_VAL;
+}
+
+static int switchDistance(int dispatch, int target) {
+    if (target == -1) return 0;
+
+    int distance = dispatch - target;
+    if (distance > UINT16_MAX) error("Switch body too large.");
+    return distance;
+}
+
+static int caseConstant(SwitchCase *switchCase) {
+    if (switchCase->constant == -1) switchCase->constant = makeConstant(switchCase->value);
+    return switchCase->constant;
+}
+
+static bool isDenseSwitch(SwitchCase *cases, int caseCount, double *min, int *span) {
+    if (caseCount == 0) return false;
+
+    double max = 0;
+    for (int i = 0; i < caseCount; i++) {
+        if (!IS_NUMBER(cases[i].value)) return false;
+
+        double number = AS_NUMBER(cases[i].value);
+        if (number < INT32_MIN || number > INT32_MAX || number != (int32_t) number) return false;
+        if (i == 0 || number < *min) *min = number;
+        if (i == 0 || number > max) max = number;
+    }
+
+    // Labels at both ends of the int32 range span more than an int holds, so the span is checked before it's narrowed.
+    double range = max - *min + 1;
+    if (range > caseCount * 2) return false;
+    *span = (int) range;
+    return true;
+}
+
+static void emitSwitchTable(SwitchCase *cases, int caseCount, double min, int span, int defaultTarget) {
+    int dispatch = currentChunk()->count;
+    int defaultDistance = switchDistance(dispatch, defaultTarget);
+
+    uint16_t targets[UINT8_COUNT * 2];
+    for (int i = 0; i < span; i++) {
+        targets[i] = (uint16_t) defaultDistance;
+    }
+    for (int i = 0; i < caseCount; i++) {
+        int index = (int) (AS_NUMBER(cases[i].value) - min);
+        targets[index] = (uint16_t) switchDistance(dispatch, cases[i].target);
+    }
+
+    emitBytes(OP_SWITCH_TABLE, makeConstant(NUMBER_VAL(min)));
+    emitShort(span);
+    emitShort(defaultDistance);
+    for (int i = 0; i < span; i++) {
+        emitShort(targets[i]);
+    }
+}
+
+static void emitSwitchHash(SwitchCase *cases, int caseCount, int defaultTarget) {
+    int dispatch = currentChunk()->count;
+
+    int capacity = 2;
+    while (capacity < caseCount * 2) capacity *= 2;
+
+    uint8_t keys[UINT8_COUNT * 2];
+    uint16_t targets[UINT8_COUNT * 2];
+    for (int i = 0; i < capacity; i++) {
+        keys[i] = 0;
+        targets[i] = 0;
+    }
+
+    for (int i = 0; i < caseCount; i++) {
+        uint32_t index = hashValue(cases[i].value) & (capacity - 1);
+        while (targets[index] != 0) {
+            index = (index + 1) & (capacity - 1);
+        }
+        keys[index] = caseConstant(&cases[i]);
+        targets[index] = (uint16_t) switchDistance(dispatch, cases[i].target);
+    }
+
+    emitByte(OP_SWITCH_HASH);
+    emitShort(capacity);
+    emitShort(switchDistance(dispatch, defaultTarget));
+    for (int i = 0; i < capacity; i++) {
+        emitByte(keys[i]);
+        emitShort(targets[i]);
+    }
+}
+
+// The switch instructions only have room for one-byte constant indexes and 16-bit
+// distances, less a byte for each end jump that may still be widened.
+static bool fitsSwitchInstruction(SwitchCase *cases, int caseCount, int defaultTarget) {
+    int newConstants = 0;
+    for (int i = 0; i < caseCount; i++) {
+        if (cases[i].constant == -1) {
+            newConstants++;
+        } else if (cases[i].constant >= UINT8_COUNT) {
+            return false;
+        }
+    }
+    if (currentChunk()->constants.count + newConstants > UINT8_COUNT) return false;
+
+    int maxDistance = UINT16_MAX - caseCount - 1;
+    int dispatch = currentChunk()->count;
+    if (defaultTarget != -1 && dispatch - defaultTarget > maxDistance) return false;
+    for (int i = 0; i < caseCount; i++) {
+        if (dispatch - cases[i].target > maxDistance) return false;
+    }
+    return true;
+}
+
+// Compares the value, still sitting above the locals, against each case in turn.
+static void emitSwitchChain(SwitchCase *cases, int caseCount, int defaultTarget) {
+    int slot = context->current->localCount;
+    for (int i = 0; i < caseCount; i++) {
+        emitOperand(OP_GET_LOCAL, OP_GET_LOCAL_LONG, slot);
+        emitOperand(OP_CONSTANT, OP_CONSTANT_LONG, caseConstant(&cases[i]));
+        emitByte(OP_EQUAL);
+        int nextJump = emitJump(OP_JUMP_IF_FALSE);
+        emitByte(OP_POP);
+        emitByte(OP_POP);
+        emitLoop(cases[i].target);
+        patchJump(nextJump);
+        emitByte(OP_POP);
+    }
+
+    emitByte(OP_POP);
+    if (defaultTarget != -1) emitLoop(defaultTarget);
+}
+
+static void switchStatement() {
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'switch'.");
+    expression();
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after value.");
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before switch cases.");
+
+    // The bodies come first and the dispatch instruction last, once every case is known.
+    int dispatchJump = emitJump(OP_JUMP);
+
+    SwitchCase cases[UINT8_COUNT];
+    int caseCount = 0;
+    int defaultTarget = -1;
+    int endJumps[UINT8_COUNT + 1];
+    int bodyCount = 0;
+
+    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+        if (!check(TOKEN_CASE) && !check(TOKEN_DEFAULT)) {
+            errorAtCurrent("Expect 'case' or 'default'.");
+            return;
+        }
+
+        int target = currentChunk()->count;
+        while (check(TOKEN_CASE) || check(TOKEN_DEFAULT)) {
+            if (match(TOKEN_DEFAULT)) {
+                if (defaultTarget != -1) error("Can't have more than one default case.");
+                defaultTarget = target;
+            } else {
+                advance();
+                int constant;
+                Value value = caseValue(&constant);
+                for (int i = 0; i < caseCount; i++) {
+                    if (valuesEqual(cases[i].value, value)) error("Duplicate case value.");
+                }
+
+                if (caseCount == UINT8_COUNT) {
+                    error("Too many cases in switch statement.");
+                } else {
+                    cases[caseCount].value = value;
+                    cases[caseCount].target = target;
+                    cases[caseCount].constant = constant;
+                    caseCount++;
+                }
+            }
+            consume(TOKEN_COLON, "Expect ':' after case.");
+        }
+
+        beginScope();
+        while (!check(TOKEN_CASE) && !check(TOKEN_DEFAULT) && !check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+            declaration();
+        }
+        endScope();
+
+        endJumps[bodyCount++] = emitJump(OP_JUMP);
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after switch cases.");
+
+    patchJump(dispatchJump);
+
+    double min;
+    int span;
+    if (!fitsSwitchInstruction(cases, caseCount, defaultTarget)) {
+        emitSwitchChain(cases, caseCount, defaultTarget);
+    } else if (isDenseSwitch(cases, caseCount, &min, &span)) {
+        emitSwitchTable(cases, caseCount, min, span, defaultTarget);
+    } else {
+        emitSwitchHash(cases, caseCount, defaultTarget);
+    }
+
+    for (int i = 0; i < bodyCount; i++) {
+        patchJump(endJumps[i]);
+    }
+}
+
 static void  whileStatement() {
+    int slotCount = context->current->localCount;
     int loopStart = currentChunk()->count;
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
     expression();
@@ -885,22 +2308,26 @@ static void  whileStatement() {
 
     patchJump(exitJump);
     emitByte(OP_POP);
+    optimizeLoopAt(loopStart, slotCount, 0);
 }
 
 static void synchronize() {
-    parser.panicMode = false;
+    context->parser.panicMode = false;
 
-    while (parser.current.type != TOKEN_EOF) {
-        if (parser.previous.type == TOKEN_SEMICOLON) return;
-        switch (parser.current.type) {
+    while (context->parser.current.type != TOKEN_EOF) {
+        if (context->parser.previous.type == TOKEN_SEMICOLON) return;
+        switch (context->parser.current.type) {
             case TOKEN_CLASS:
+            case TOKEN_CONST:
             case TOKEN_FUN:
+            case TOKEN_IMPORT:
             case TOKEN_VAR:
             case TOKEN_FOR:
             case TOKEN_IF:
             case TOKEN_WHILE:
             case TOKEN_PRINT:
             case TOKEN_RETURN:
+            case TOKEN_SWITCH:
                 return;
             default:;
         }
@@ -909,18 +2336,51 @@ static void synchronize() {
     }
 }
 
+// Module paths are relative to the directory of the script that imports them. That directory is made absolute so the
+// compiled import doesn't depend on the working directory, which keeps cached bytecode valid.
+static ObjString *modulePath(Token *name) {
+    const char *chars = name->start + 1;
+    int length = name->length - 2;
+    char script[PATH_MAX];
+    if (context->path == NULL || chars[0] == '/' || realpath(context->path, script) == NULL) {
+        return copyString(chars, length);
+    }
+
+    int directoryLength = (int) (strrchr(script, '/') - script) + 1;
+    char *path = ALLOCATE(char, directoryLength + length + 1);
+    memcpy(path, script, directoryLength);
+    memcpy(path + directoryLength, chars, length);
+    path[directoryLength + length] = '\0';
+    return takeString(path, directoryLength + length);
+}
+
+static void importDeclaration() {
+    if (context->current->type != TYPE_SCRIPT || context->current->scopeDepth > 0) {
+        error("Can only import at the top level.");
+    }
+
+    consume(TOKEN_STRING, "Expect module path after 'import'.");
+    emitOperand(OP_IMPORT, OP_IMPORT_LONG, makeConstant(OBJ_VAL(modulePath(&context->parser.previous))));
+    emitByte(OP_POP);
+    consume(TOKEN_SEMICOLON, "Expect ';' after module path.");
+}
+
 static void declaration() {
-    if (match(TOKEN_CLASS)) {
+    if (match(TOKEN_IMPORT)) {
+        importDeclaration();
+    } else if (match(TOKEN_CLASS)) {
         classDeclaration();
     } else if (match(TOKEN_FUN)) {
         funDeclaration();
     } else if (match(TOKEN_VAR)) {
         varDeclaration();
+    } else if (match(TOKEN_CONST)) {
+        constDeclaration();
     } else {
         statement();
     }
 
-    if (parser.panicMode) synchronize();
+    if (context->parser.panicMode) synchronize();
 }
 
 static void statement() {
@@ -932,6 +2392,8 @@ static void statement() {
         ifStatement();
     } else if (match(TOKEN_RETURN)) {
         returnStatement();
+    } else if (match(TOKEN_SWITCH)) {
+        switchStatement();
     } else if (match(TOKEN_WHILE)) {
         whileStatement();
     } else if (match(TOKEN_LEFT_BRACE)) {
@@ -943,13 +2405,147 @@ static void statement() {
     }
 }
 
-ObjFunction *compile(const char *source) {
-    initScanner(source);
-    Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
+static void recordBindingKey(ObjString *key, int flag) {
+    pushRoot(OBJ_VAL(key));
+
+    Value usage = NUMBER_VAL(0);
+    tableGet(&context->bindingUsage, key, &usage);
+    int flags = (int) AS_NUMBER(usage);
+    if (flag == BINDING_DECLARED && (flags & BINDING_DECLARED)) flag = BINDING_REDECLARED;
+    tableSet(&context->bindingUsage, key, NUMBER_VAL(flags | flag));
+
+    popRoot();
+}
+
+static void recordBinding(Token *name, int flag) {
+    recordBindingKey(copyString(name->start, name->length), flag);
+}
+
+typedef struct {
+    Token name;
+    int depth;
+} ClassBody;
+
+// Scans the whole program up front to find which global names are declared
+// once and never assigned, which classes are inherited from, which names
+// are ever assigned as fields, and which methods a class defines twice. A
+// module it imports shares its globals and can redefine any of them, so a
+// program that imports isn't closed.
+static void findBindings(const char *source) {
+    initScanner(&context->scanner, source);
+
+    Token previous[3];
+    for (int i = 0; i < 3; i++) {
+        previous[i].type = TOKEN_EOF;
+    }
 
-    parser.hadError = false;
-    parser.panicMode = false;
+    ClassBody *classes = NULL;
+    int classCount = 0;
+    int classCapacity = 0;
+    bool isClassPending = false;
+    Token className;
+
+    int depth = 0;
+    for (;;) {
+        Token token = scanToken(&context->scanner);
+        if (token.type == TOKEN_EOF) break;
+
+        switch (token.type) {
+            case TOKEN_IMPORT:
+                context->isClosedWorld = false;
+                break;
+            case TOKEN_LEFT_BRACE:
+                depth++;
+                if (!isClassPending) break;
+
+                if (classCapacity < classCount + 1) {
+                    int oldCapacity = classCapacity;
+                    classCapacity = GROW_CAPACITY(oldCapacity);
+                    classes = GROW_ARRAY(ClassBody, classes, oldCapacity, classCapacity);
+                }
+                classes[classCount++] = (ClassBody) {className, depth};
+                isClassPending = false;
+                break;
+            case TOKEN_RIGHT_BRACE:
+                if (classCount > 0 && classes[classCount - 1].depth == depth) classCount--;
+                depth--;
+                break;
+            case TOKEN_IDENTIFIER:
+                if (previous[0].type == TOKEN_CLASS) {
+                    className = token;
+                    isClassPending = true;
+                }
+                // Directly inside a class body, a name that starts the body or follows a method's closing brace names a method.
+                if (classCount > 0 && classes[classCount - 1].depth == depth &&
+                    (previous[0].type == TOKEN_LEFT_BRACE || previous[0].type == TOKEN_RIGHT_BRACE)) {
+                    recordBindingKey(methodKey(&classes[classCount - 1].name, &token), BINDING_DECLARED);
+                }
+                if (depth == 0 && (previous[0].type == TOKEN_FUN || previous[0].type == TOKEN_CLASS ||
+                                   previous[0].type == TOKEN_VAR || previous[0].type == TOKEN_CONST)) {
+                    recordBinding(&token, BINDING_DECLARED);
+                }
+                if (previous[0].type == TOKEN_LESS && previous[2].type == TOKEN_CLASS) {
+                    recordBinding(&token, BINDING_SUBCLASSED);
+                }
+                break;
+            case TOKEN_EQUAL:
+                if (previous[0].type != TOKEN_IDENTIFIER) break;
+                if (previous[1].type == TOKEN_DOT) {
+                    recordBinding(&previous[0], BINDING_FIELD_ASSIGNED);
+                } else if (previous[1].type != TOKEN_VAR && previous[1].type != TOKEN_CONST) {
+                    recordBinding(&previous[0], BINDING_ASSIGNED);
+                }
+                break;
+            default:
+                break;
+        }
+
+        previous[2] = previous[1];
+        previous[1] = previous[0];
+        previous[0] = token;
+    }
+
+    FREE_ARRAY(ClassBody, classes, classCapacity);
+}
+
+static void beginContext(CompileContext *compileContext, const char *path) {
+    compileContext->enclosing = context;
+    compileContext->path = path;
+    compileContext->parser.hadError = false;
+    compileContext->parser.panicMode = false;
+    compileContext->current = NULL;
+    compileContext->currentClass = NULL;
+    compileContext->isClosedWorld = false;
+    initTable(&compileContext->bindingUsage);
+    initTable(&compileContext->inlineFunctions);
+    initTable(&compileContext->directFunctions);
+    initTable(&compileContext->sealedMethods);
+    initTable(&compileContext->scalarClasses);
+    initTable(&compileContext->constants);
+    context = compileContext;
+}
+
+static void endContext() {
+    freeTable(&context->bindingUsage);
+    freeTable(&context->inlineFunctions);
+    freeTable(&context->directFunctions);
+    freeTable(&context->sealedMethods);
+    freeTable(&context->scalarClasses);
+    freeTable(&context->constants);
+    context = context->enclosing;
+}
+
+static ObjFunction *compileSource(const char *path, const char *source) {
+    CompileContext compileContext;
+    beginContext(&compileContext, path);
+    if (compilerOptions.isClosedWorld) {
+        context->isClosedWorld = true;
+        findBindings(source);
+    }
+
+    initScanner(&context->scanner, source);
+    Compiler compiler;
+    initCompiler(&compiler, TYPE_SCRIPT, NULL);
 
     advance();
 
@@ -958,13 +2554,154 @@ ObjFunction *compile(const char *source) {
     }
 
     ObjFunction *function = endCompiler();
-    return parser.hadError ? NULL : function;
+    bool hadError = context->parser.hadError;
+    endContext();
+    return hadError ? NULL : function;
+}
+
+ObjFunction *compile(const char *path, const char *source) {
+    ObjFunction *function = compileSource(path, source);
+    protectFrozen();
+    return function;
+}
+
+typedef struct {
+    const char **paths;
+    const char **sources;
+    ObjFunction **functions;
+    int count;
+    atomic_int next;
+} CompileBatch;
+
+typedef struct {
+    CompileBatch *batch;
+    Heap heap;
+    pthread_t thread;
+    bool isStarted;
+} CompileWorker;
+
+static void *compileWorker(void *argument) {
+    CompileWorker *worker = (CompileWorker *) argument;
+    CompileBatch *batch = worker->batch;
+
+    beginLocalHeap(&worker->heap);
+    for (int i = atomic_fetch_add(&batch->next, 1); i < batch->count; i = atomic_fetch_add(&batch->next, 1)) {
+        batch->functions[i] = compileSource(batch->paths[i], batch->sources[i]);
+    }
+    endLocalHeap();
+    return NULL;
+}
+
+// Compiles each source on a pool of threads. Workers allocate into private heaps that never
+// collect, which are handed to the VM once every worker has finished.
+bool compileAll(const char **paths, const char **sources, int count, ObjFunction **functions) {
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    int workerCount = processors < 1 ? 1 : (count < processors ? count : (int) processors);
+
+    CompileBatch batch;
+    batch.paths = paths;
+    batch.sources = sources;
+    batch.functions = functions;
+    batch.count = count;
+    atomic_init(&batch.next, 0);
+
+    CompileWorker *workers = ALLOCATE(CompileWorker, workerCount);
+    for (int i = 0; i < workerCount; i++) {
+        workers[i].batch = &batch;
+        workers[i].heap.objects = NULL;
+        workers[i].heap.bytesAllocated = 0;
+        workers[i].isStarted = pthread_create(&workers[i].thread, NULL, compileWorker, &workers[i]) == 0;
+    }
+
+    // Whatever a worker that failed to start would have taken is picked up here.
+    CompileWorker self;
+    self.batch = &batch;
+    self.heap.objects = NULL;
+    self.heap.bytesAllocated = 0;
+    compileWorker(&self);
+
+    for (int i = 0; i < workerCount; i++) {
+        if (workers[i].isStarted) pthread_join(workers[i].thread, NULL);
+        adoptHeap(&workers[i].heap);
+    }
+    adoptHeap(&self.heap);
+    FREE_ARRAY(CompileWorker, workers, workerCount);
+    protectFrozen();
+
+    for (int i = 0; i < count; i++) {
+        if (functions[i] == NULL) return false;
+    }
+    return true;
+}
+
+bool compileLazy(ObjFunction *function) {
+    LazyFunction *lazy = function->lazy;
+    // Imports are only allowed at the top level, so a function body never needs its script's path.
+    CompileContext compileContext;
+    beginContext(&compileContext, NULL);
+    initScanner(&context->scanner, lazy->source);
+    context->scanner.line = lazy->line;
+
+    // Only the class facts that this, super and the method checks rely on are kept.
+    ClassCompiler classCompiler;
+    if (lazy->isInClass) {
+        classCompiler.enclosing = NULL;
+        classCompiler.hasSuperclass = lazy->hasSuperclass;
+        classCompiler.name.start = lazy->className.start;
+        classCompiler.name.length = lazy->className.length;
+        initTable(&classCompiler.methods);
+        classCompiler.initializer = NULL;
+        context->currentClass = &classCompiler;
+    }
+
+    function->arity = 0;
+    function->slotCount = 0;
+    Compiler compiler;
+    initCompiler(&compiler, (FunctionType) lazy->type, function);
+    beginScope();
+    advance();
+    functionBody();
+    endCompiler();
+
+    if (lazy->isInClass) freeTable(&classCompiler.methods);
+    bool hadError = context->parser.hadError;
+    endContext();
+
+    // A body with errors stays deferred, so every call reports them again.
+    if (hadError) {
+        freeChunk(&function->chunk);
+        return false;
+    }
+
+    if (compilerOptions.isReporting) {
+        fprintf(stderr, "[line %d] Compiled %s() on its first call.\n", lazy->line, function->name->chars);
+    }
+    FREE_ARRAY(SourceName, lazy->upvalueNames, function->upvalueCount);
+    FREE_ARRAY(uint8_t, lazy->upvalueKinds, function->upvalueCount);
+    FREE(LazyFunction, lazy);
+    function->lazy = NULL;
+    protectFrozen();
+    return true;
 }
 
 void markCompilerRoots() {
-    Compiler *compiler = current;
-    while (compiler != NULL) {
-        markObject((Obj *) compiler->function);
-        compiler = compiler->enclosing;
+    for (CompileContext *compileContext = context; compileContext != NULL; compileContext = compileContext->enclosing) {
+        Compiler *compiler = compileContext->current;
+        while (compiler != NULL) {
+            markObject((Obj *) compiler->function);
+            compiler = compiler->enclosing;
+        }
+
+        ClassCompiler *classCompiler = compileContext->currentClass;
+        while (classCompiler != NULL) {
+            markTable(&classCompiler->methods);
+            classCompiler = classCompiler->enclosing;
+        }
+        markTable(&compileContext->bindingUsage);
+        markTable(&compileContext->inlineFunctions);
+        markTable(&compileContext->directFunctions);
+        markTable(&compileContext->sealedMethods);
+        markTable(&compileContext->scalarClasses);
+        markTable(&compileContext->constants);
     }
 }
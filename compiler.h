@@ -8,7 +8,21 @@
 #include "object.h"
 #include "vm.h"
 
-ObjFunction *compile(const char *source);
+typedef struct {
+    int optimizationLevel;
+    bool isClosedWorld;
+    bool isReporting;
+    bool isCaching;
+    bool isLazy;
+} CompilerOptions;
+
+extern CompilerOptions compilerOptions;
+
+ObjFunction *compile(const char *path, const char *source);
+
+bool compileAll(const char **paths, const char **sources, int count, ObjFunction **functions);
+
+bool compileLazy(ObjFunction *function);
 
 void markCompilerRoots();
 
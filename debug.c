@@ -24,6 +24,18 @@ static int constantInstruction(const char *name, Chunk *chunk, int offset) {
     return offset + 2;
 }
 
+static int readLong(Chunk *chunk, int offset) {
+    return (chunk->code[offset] << 16) | (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+}
+
+static int constantLongInstruction(const char *name, Chunk *chunk, int offset) {
+    int constant = readLong(chunk, offset + 1);
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
 static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1];
     uint8_t argCount = chunk->code[offset + 2];
@@ -33,6 +45,15 @@ static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 3;
 }
 
+static int invokeLongInstruction(const char *name, Chunk *chunk, int offset) {
+    int constant = readLong(chunk, offset + 1);
+    uint8_t argCount = chunk->code[offset + 4];
+    printf("%-16s (%d args) %4d '", name, argCount, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 5;
+}
+
 static int simpleInstruction(const char *name, int offset) {
     printf("%s\n", name);
     return offset + 1;
@@ -44,6 +65,12 @@ static int byteInstruction(const char *name, Chunk *chunk, int offset) {
     return offset + 2;
 }
 
+static int shortInstruction(const char *name, Chunk *chunk, int offset) {
+    uint16_t slot = (uint16_t) ((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    printf("%-16s %4d\n", name, slot);
+    return offset + 3;
+}
+
 static int jumpInstruction(const char *name, int sign, Chunk *chunk, int offset) {
     uint16_t jump = (uint16_t) (chunk->code[offset + 1] << 8);
     jump |= chunk->code[offset + 2];
@@ -51,19 +78,96 @@ static int jumpInstruction(const char *name, int sign, Chunk *chunk, int offset)
     return offset + 3;
 }
 
+static int jumpLongInstruction(const char *name, int sign, Chunk *chunk, int offset) {
+    int jump = readLong(chunk, offset + 1);
+    printf("%-16s %4d -> %d\n", name, offset, offset + 4 + sign * jump);
+    return offset + 4;
+}
+
+static int closureInstruction(const char *name, Chunk *chunk, int offset, int constant, int length) {
+    printf("%-16s %4d ", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("\n");
+
+    offset += length;
+    ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+    for (int j = 0; j < function->upvalueCount; j++) {
+        int isLocal = chunk->code[offset++];
+        int index = chunk->code[offset++];
+        printf("%04d      |                     %s %d\n", offset - 2, isLocal ? "local" : "upvalue", index);
+    }
+
+    return offset;
+}
+
+static int forInstruction(const char *name, int sign, Chunk *chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t limit = chunk->code[offset + 2];
+    if (sign < 0) {
+        uint8_t step = chunk->code[offset + 3];
+        uint16_t jump = (uint16_t) (chunk->code[offset + 4] << 8);
+        jump |= chunk->code[offset + 5];
+        printf("%-16s %4d < %d += '", name, slot, limit);
+        printValue(chunk->constants.values[step]);
+        printf("' -> %d\n", offset + 6 - jump);
+        return offset + 6;
+    }
+
+    uint16_t jump = (uint16_t) (chunk->code[offset + 3] << 8);
+    jump |= chunk->code[offset + 4];
+    printf("%-16s %4d < %d -> %d\n", name, slot, limit, offset + 5 + jump);
+    return offset + 5;
+}
+
+static int switchTableInstruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    int count = (chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+    int fallback = (chunk->code[offset + 4] << 8) | chunk->code[offset + 5];
+    int end = offset + 6 + count * 2;
+    double min = AS_NUMBER(chunk->constants.values[constant]);
+
+    printf("%-16s %4d '%g' default -> %d\n", name, count, min, fallback == 0 ? end : offset - fallback);
+    for (int i = 0; i < count; i++) {
+        int distance = (chunk->code[offset + 6 + i * 2] << 8) | chunk->code[offset + 7 + i * 2];
+        if (distance == fallback) continue;
+        printf("%04d      |                     %g -> %d\n", offset + 6 + i * 2, min + i, offset - distance);
+    }
+    return end;
+}
+
+static int switchHashInstruction(const char *name, Chunk *chunk, int offset) {
+    int capacity = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    int fallback = (chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+    int end = offset + 5 + capacity * 3;
+
+    printf("%-16s %4d default -> %d\n", name, capacity, fallback == 0 ? end : offset - fallback);
+    for (int i = 0; i < capacity; i++) {
+        uint8_t *entry = &chunk->code[offset + 5 + i * 3];
+        int distance = (entry[1] << 8) | entry[2];
+        if (distance == 0) continue;
+        printf("%04d      |                     '", offset + 5 + i * 3);
+        printValue(chunk->constants.values[entry[0]]);
+        printf("' -> %d\n", offset - distance);
+    }
+    return end;
+}
+
 int disassembleInstruction(Chunk *chunk, int offset) {
     printf("%04d ", offset);
 
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1)) {
         printf("   | ");
     } else {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
     }
 
     uint8_t instruction = chunk->code[offset];
     switch (instruction) {
         case OP_CONSTANT:
             return constantInstruction("OP_CONSTANT", chunk, offset);
+        case OP_CONSTANT_LONG:
+            return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
         case OP_NIL:
             return simpleInstruction("OP_NIL", offset);
         case OP_TRUE:
@@ -74,30 +178,52 @@ int disassembleInstruction(Chunk *chunk, int offset) {
             return simpleInstruction("OP_POP", offset);
         case OP_GET_LOCAL:
             return byteInstruction("OP_GET_LOCAL", chunk, offset);
+        case OP_GET_LOCAL_LONG:
+            return shortInstruction("OP_GET_LOCAL_LONG", chunk, offset);
         case OP_SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL", chunk, offset);
+        case OP_SET_LOCAL_LONG:
+            return shortInstruction("OP_SET_LOCAL_LONG", chunk, offset);
         case OP_GET_GLOBAL:
             return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+        case OP_GET_GLOBAL_LONG:
+            return constantLongInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
         case OP_DEFINE_GLOBAL:
             return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+        case OP_DEFINE_GLOBAL_LONG:
+            return constantLongInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
         case OP_SET_GLOBAL:
             return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+        case OP_SET_GLOBAL_LONG:
+            return constantLongInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
         case OP_GET_UPVALUE:
             return byteInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
             return byteInstruction("OP_SET_UPVALUE", chunk, offset);
         case OP_GET_PROPERTY:
             return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+        case OP_GET_PROPERTY_LONG:
+            return constantLongInstruction("OP_GET_PROPERTY_LONG", chunk, offset);
         case OP_SET_PROPERTY:
             return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+        case OP_SET_PROPERTY_LONG:
+            return constantLongInstruction("OP_SET_PROPERTY_LONG", chunk, offset);
         case OP_GET_SUPER:
             return constantInstruction("OP_GET_SUPER", chunk, offset);
+        case OP_GET_SUPER_LONG:
+            return constantLongInstruction("OP_GET_SUPER_LONG", chunk, offset);
         case OP_EQUAL:
             return simpleInstruction("OP_EQUAL", offset);
+        case OP_NOT_EQUAL:
+            return simpleInstruction("OP_NOT_EQUAL", offset);
         case OP_GREATER:
             return simpleInstruction("OP_GREATER", offset);
+        case OP_GREATER_EQUAL:
+            return simpleInstruction("OP_GREATER_EQUAL", offset);
         case OP_LESS:
             return simpleInstruction("OP_LESS", offset);
+        case OP_LESS_EQUAL:
+            return simpleInstruction("OP_LESS_EQUAL", offset);
         case OP_ADD:
             return simpleInstruction("OP_ADD", offset);
         case OP_SUBTRACT:
@@ -114,42 +240,82 @@ int disassembleInstruction(Chunk *chunk, int offset) {
             return simpleInstruction("OP_PRINT", offset);
         case OP_JUMP:
             return jumpInstruction("OP_JUMP", 1, chunk, offset);
+        case OP_JUMP_LONG:
+            return jumpLongInstruction("OP_JUMP_LONG", 1, chunk, offset);
         case OP_JUMP_IF_FALSE:
             return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_JUMP_IF_FALSE_LONG:
+            return jumpLongInstruction("OP_JUMP_IF_FALSE_LONG", 1, chunk, offset);
         case OP_LOOP:
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
+        case OP_LOOP_LONG:
+            return jumpLongInstruction("OP_LOOP_LONG", -1, chunk, offset);
+        case OP_FOR_PREP:
+            return forInstruction("OP_FOR_PREP", 1, chunk, offset);
+        case OP_FOR_LOOP:
+            return forInstruction("OP_FOR_LOOP", -1, chunk, offset);
+        case OP_SWITCH_TABLE:
+            return switchTableInstruction("OP_SWITCH_TABLE", chunk, offset);
+        case OP_SWITCH_HASH:
+            return switchHashInstruction("OP_SWITCH_HASH", chunk, offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
+        case OP_CONCAT:
+            return byteInstruction("OP_CONCAT", chunk, offset);
+        case OP_INTERPOLATE:
+            return byteInstruction("OP_INTERPOLATE", chunk, offset);
         case OP_INVOKE:
             return invokeInstruction("OP_INVOKE", chunk, offset);
+        case OP_INVOKE_LONG:
+            return invokeLongInstruction("OP_INVOKE_LONG", chunk, offset);
+        case OP_INVOKE_DIRECT:
+            return invokeInstruction("OP_INVOKE_DIRECT", chunk, offset);
         case OP_SUPER_INVOKE:
             return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
-        case OP_CLOSURE: {
-            offset++;
-            uint8_t constant = chunk->code[offset++];
-            printf("%-16s %4d ", "OP_CLOSURE", constant);
-            printValue(chunk->constants.values[constant]);
-            printf("\n");
-
-            ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
-            for (int j = 0; j < function->upvalueCount; j++) {
-                int isLocal = chunk->code[offset++];
-                int index = chunk->code[offset++];
-                printf("%04d      |                     %s %d\n", offset - 2, isLocal ? "local" : "upvalue", index);
-            }
-
-            return offset;
-        }
+        case OP_SUPER_INVOKE_LONG:
+            return invokeLongInstruction("OP_SUPER_INVOKE_LONG", chunk, offset);
+        case OP_CLOSURE:
+            return closureInstruction("OP_CLOSURE", chunk, offset, chunk->code[offset + 1], 2);
+        case OP_CLOSURE_LONG:
+            return closureInstruction("OP_CLOSURE_LONG", chunk, offset, readLong(chunk, offset + 1), 4);
         case OP_CLOSE_UPVALUE:
             return simpleInstruction("OP_CLOSE_UPVALUE", offset);
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
         case OP_CLASS:
             return constantInstruction("OP_CLASS", chunk, offset);
+        case OP_CLASS_LONG:
+            return constantLongInstruction("OP_CLASS_LONG", chunk, offset);
         case OP_INHERIT:
             return simpleInstruction("OP_INHERIT", offset);
         case OP_METHOD:
             return constantInstruction("OP_METHOD", chunk, offset);
+        case OP_METHOD_LONG:
+            return constantLongInstruction("OP_METHOD_LONG", chunk, offset);
+        case OP_IMPORT:
+            return constantInstruction("OP_IMPORT", chunk, offset);
+        case OP_IMPORT_LONG:
+            return constantLongInstruction("OP_IMPORT_LONG", chunk, offset);
+        case OP_CALL_DIRECT:
+            return byteInstruction("OP_CALL_DIRECT", chunk, offset);
+        case OP_CHECK_TYPE:
+            return byteInstruction("OP_CHECK_TYPE", chunk, offset);
+        case OP_GREATER_NUMBER:
+            return simpleInstruction("OP_GREATER_NUMBER", offset);
+        case OP_GREATER_EQUAL_NUMBER:
+            return simpleInstruction("OP_GREATER_EQUAL_NUMBER", offset);
+        case OP_LESS_NUMBER:
+            return simpleInstruction("OP_LESS_NUMBER", offset);
+        case OP_LESS_EQUAL_NUMBER:
+            return simpleInstruction("OP_LESS_EQUAL_NUMBER", offset);
+        case OP_ADD_NUMBER:
+            return simpleInstruction("OP_ADD_NUMBER", offset);
+        case OP_SUBTRACT_NUMBER:
+            return simpleInstruction("OP_SUBTRACT_NUMBER", offset);
+        case OP_MULTIPLY_NUMBER:
+            return simpleInstruction("OP_MULTIPLY_NUMBER", offset);
+        case OP_DIVIDE_NUMBER:
+            return simpleInstruction("OP_DIVIDE_NUMBER", offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
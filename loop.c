@@ -0,0 +1,723 @@
+//
+// Created by Mic Pringle on 19/10/2026.
+//
+
+#include <stdio.h>
+
+#include "compiler.h"
+#include "loop.h"
+#include "memory.h"
+#include "optimizer.h"
+
+#define MAX_HOISTED 8
+#define MIN_REDUCED_USES 3
+
+#define NO_TREE (-1)
+
+#define TREE_INVARIANT 0x1
+#define TREE_SAFE 0x2
+#define TREE_READS 0x4
+
+typedef struct {
+    int start;
+    int end;
+    int flags;
+} Tree;
+
+typedef struct {
+    int start;
+    int length;
+    uint8_t counter;
+    uint8_t factor;
+    uint8_t increment;
+} Hoisted;
+
+typedef struct {
+    Code code;
+    Chunk *chunk;
+    int slotCount;
+    int maxSlot;
+    int entry;
+    int entryEnd;
+    int condition;
+    int bodyEnd;
+    bool hasCall;
+    bool hasFieldWrite;
+    bool hasLongGlobalWrite;
+    bool isSlotWritten[UINT8_COUNT];
+    bool isUpvalueWritten[UINT8_COUNT];
+    bool isGlobalWritten[UINT8_COUNT];
+    Tree *trees;
+    int *replacement;
+    int *positions;
+    int positionCount;
+    Hoisted hoisted[MAX_HOISTED];
+    int hoistedCount;
+    int reducedCount;
+} Loop;
+
+static Instruction *at(Loop *loop, int index) {
+    return &loop->code.instructions[index];
+}
+
+static uint8_t operand(Loop *loop, int index, int operandIndex) {
+    return instructionOperand(&loop->code, at(loop, index), operandIndex);
+}
+
+static Value constant(Loop *loop, uint8_t index) {
+    return loop->chunk->constants.values[index];
+}
+
+// The index of the first captured-variable operand, after the function's constant.
+static int closureSlots(Instruction *instruction) {
+    return instruction->op == OP_CLOSURE ? 1 : 3;
+}
+
+static void noteSlot(Loop *loop, int slot) {
+    if (slot > loop->maxSlot) loop->maxSlot = slot;
+}
+
+static void scanEffects(Loop *loop) {
+    for (int i = 0; i < loop->code.count; i++) {
+        Instruction *instruction = at(loop, i);
+
+        switch (instruction->op) {
+            case OP_GET_LOCAL:
+                noteSlot(loop, operand(loop, i, 0));
+                break;
+            case OP_SET_LOCAL:
+                noteSlot(loop, operand(loop, i, 0));
+                loop->isSlotWritten[operand(loop, i, 0)] = true;
+                break;
+            case OP_FOR_PREP:
+            case OP_FOR_LOOP:
+                noteSlot(loop, operand(loop, i, 0));
+                noteSlot(loop, operand(loop, i, 1));
+                loop->isSlotWritten[operand(loop, i, 0)] = true;
+                break;
+            case OP_CLOSURE:
+            case OP_CLOSURE_LONG:
+                for (int j = closureSlots(instruction); j < instruction->operandCount; j += 2) {
+                    if (operand(loop, i, j)) noteSlot(loop, operand(loop, i, j + 1));
+                }
+                break;
+            case OP_SET_UPVALUE:
+                loop->isUpvalueWritten[operand(loop, i, 0)] = true;
+                break;
+            case OP_DEFINE_GLOBAL:
+            case OP_SET_GLOBAL:
+                loop->isGlobalWritten[operand(loop, i, 0)] = true;
+                break;
+            case OP_DEFINE_GLOBAL_LONG:
+            case OP_SET_GLOBAL_LONG:
+                loop->hasLongGlobalWrite = true;
+                break;
+            case OP_SET_PROPERTY:
+            case OP_SET_PROPERTY_LONG:
+                loop->hasFieldWrite = true;
+                break;
+            case OP_CALL:
+            case OP_CALL_DIRECT:
+            case OP_INVOKE:
+            case OP_INVOKE_LONG:
+            case OP_INVOKE_DIRECT:
+            case OP_SUPER_INVOKE:
+            case OP_SUPER_INVOKE_LONG:
+            case OP_IMPORT:
+            case OP_IMPORT_LONG:
+                loop->hasCall = true;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static bool isGlobalWritten(Loop *loop, uint8_t name) {
+    if (loop->hasLongGlobalWrite) return true;
+    for (int i = 0; i < UINT8_COUNT; i++) {
+        if (loop->isGlobalWritten[i] && valuesEqual(constant(loop, i), constant(loop, name))) return true;
+    }
+    return false;
+}
+
+// A closure created after the loop may still capture a local and be called from a
+// later iteration of an enclosing loop, so any call makes every variable suspect.
+static int instructionFlags(Loop *loop, int index) {
+    Instruction *instruction = at(loop, index);
+
+    switch (instruction->op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NOT:
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+            return TREE_INVARIANT | TREE_SAFE;
+        case OP_NEGATE:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_CONCAT:
+            return TREE_INVARIANT;
+        case OP_INTERPOLATE:
+            // Formatting a value never fails.
+            return TREE_INVARIANT | TREE_SAFE;
+        case OP_GREATER_NUMBER:
+        case OP_GREATER_EQUAL_NUMBER:
+        case OP_LESS_NUMBER:
+        case OP_LESS_EQUAL_NUMBER:
+        case OP_ADD_NUMBER:
+        case OP_SUBTRACT_NUMBER:
+        case OP_MULTIPLY_NUMBER:
+        case OP_DIVIDE_NUMBER:
+            // The operands were proven numbers when they were compiled, so these can't fail.
+            return TREE_INVARIANT | TREE_SAFE;
+        case OP_GET_LOCAL: {
+            uint8_t slot = operand(loop, index, 0);
+            bool isInvariant = !loop->hasCall && slot < loop->slotCount && !loop->isSlotWritten[slot];
+            return (isInvariant ? TREE_INVARIANT : 0) | TREE_SAFE | TREE_READS;
+        }
+        case OP_GET_UPVALUE: {
+            bool isInvariant = !loop->hasCall && !loop->isUpvalueWritten[operand(loop, index, 0)];
+            return (isInvariant ? TREE_INVARIANT : 0) | TREE_SAFE | TREE_READS;
+        }
+        case OP_GET_GLOBAL: {
+            bool isInvariant = !loop->hasCall && !isGlobalWritten(loop, operand(loop, index, 0));
+            return (isInvariant ? TREE_INVARIANT : 0) | TREE_READS;
+        }
+        case OP_GET_PROPERTY:
+            return !loop->hasCall && !loop->hasFieldWrite ? TREE_INVARIANT | TREE_READS : TREE_READS;
+        default:
+            return 0;
+    }
+}
+
+// Simulates the stack of each basic block to find the contiguous expression tree
+// that produces every pushed value.
+static bool findTrees(Loop *loop) {
+    Code *code = &loop->code;
+    Tree *stack = ALLOCATE(Tree, code->count);
+    int depth = 0;
+    bool isValid = true;
+
+    for (int i = 0; i < code->count; i++) {
+        if (code->isTarget[i] || (i > 0 && instructionEndsBlock(at(loop, i - 1)->op))) depth = 0;
+
+        int pops, pushes;
+        if (!instructionStackEffect(code, at(loop, i), &pops, &pushes)) {
+            isValid = false;
+            break;
+        }
+
+        int start = i;
+        int operandFlags = TREE_INVARIANT | TREE_SAFE;
+        int reads = 0;
+        for (int j = 0; j < pops; j++) {
+            if (depth == 0) {
+                start = NO_TREE;
+                continue;
+            }
+
+            Tree operandTree = stack[--depth];
+            if (start == NO_TREE || operandTree.start == NO_TREE || operandTree.end != start - 1) {
+                start = NO_TREE;
+                continue;
+            }
+            start = operandTree.start;
+            operandFlags &= operandTree.flags;
+            reads |= operandTree.flags;
+        }
+
+        int flags = instructionFlags(loop, i);
+        Tree tree = {start, i, 0};
+        if (start != NO_TREE) {
+            tree.flags = (flags & operandFlags & (TREE_INVARIANT | TREE_SAFE)) | ((flags | reads) & TREE_READS);
+        }
+
+        loop->trees[i] = pushes > 0 ? tree : (Tree) {NO_TREE, i, 0};
+        if (pushes > 0) stack[depth++] = tree;
+    }
+
+    FREE_ARRAY(Tree, stack, code->count);
+    return isValid;
+}
+
+static bool isHoistable(Loop *loop, int end) {
+    Tree *tree = &loop->trees[end];
+    if (tree->start == NO_TREE || tree->start < loop->entry) return false;
+    if ((tree->flags & (TREE_INVARIANT | TREE_READS)) != (TREE_INVARIANT | TREE_READS)) return false;
+
+    // A property read may bind a fresh method each time, so it is only hoisted as
+    // part of a larger expression.
+    uint8_t op = at(loop, end)->op;
+    if (op == OP_GET_PROPERTY) return false;
+    return tree->start < end || op == OP_GET_GLOBAL || op == OP_GET_UPVALUE;
+}
+
+static bool sameTree(Loop *loop, int a, int b, int length) {
+    for (int i = 0; i < length; i++) {
+        Instruction *left = at(loop, a + i);
+        Instruction *right = at(loop, b + i);
+        if (left->op != right->op || left->operandCount != right->operandCount) return false;
+        for (int j = 0; j < left->operandCount; j++) {
+            if (operand(loop, a + i, j) != operand(loop, b + i, j)) return false;
+        }
+    }
+    return true;
+}
+
+static bool hoistTree(Loop *loop, int start, int end) {
+    int length = end - start + 1;
+    for (int i = 0; i < loop->hoistedCount; i++) {
+        Hoisted *hoisted = &loop->hoisted[i];
+        if (hoisted->length == length && sameTree(loop, hoisted->start, start, length)) {
+            loop->replacement[start] = i;
+            return true;
+        }
+    }
+
+    if (loop->hoistedCount == MAX_HOISTED) return false;
+
+    loop->hoisted[loop->hoistedCount] = (Hoisted) {start, length, 0, 0, 0};
+    loop->replacement[start] = loop->hoistedCount++;
+    return true;
+}
+
+static int blockEnd(Loop *loop, int start) {
+    Code *code = &loop->code;
+    int end = start;
+    while (end < code->count - 1 && !instructionEndsBlock(at(loop, end)->op) && !code->isTarget[end + 1]) {
+        end++;
+    }
+    return end;
+}
+
+static bool isInside(int target, int start, int end) {
+    return target != NO_TARGET && target != EMPTY_ENTRY && target >= start && target <= end;
+}
+
+// A while loop is laid out as its condition, a conditional exit and a body that
+// loops back to the condition. Those are the only loops that can be rotated.
+static int findCondition(Loop *loop) {
+    Code *code = &loop->code;
+    int exit = code->count - 1;
+    int back = code->count - 2;
+    if (loop->entry != 0 || back < 2) return NO_TREE;
+    if (at(loop, exit)->op != OP_POP || at(loop, back)->op != OP_LOOP || at(loop, back)->target != 0) return NO_TREE;
+
+    int condition = 0;
+    while (condition < back && !(at(loop, condition)->op == OP_JUMP_IF_FALSE && at(loop, condition)->target == exit)) {
+        condition++;
+    }
+    if (condition == back || at(loop, condition + 1)->op != OP_POP) return NO_TREE;
+
+    for (int i = 0; i < code->count; i++) {
+        Instruction *instruction = at(loop, i);
+        if (i == condition || i == back) continue;
+
+        if (i < condition) {
+            if (instruction->target != NO_TARGET && !isInside(instruction->target, 0, condition)) return NO_TREE;
+        } else if (isInside(instruction->target, 0, condition + 1)) {
+            return NO_TREE;
+        }
+        for (int j = 0; j < instruction->targetCount; j++) {
+            if (isInside(code->targets[instruction->targetStart + j], 0, condition + 1)) return NO_TREE;
+        }
+    }
+
+    return condition;
+}
+
+// Trees that can raise an error are only hoisted from a block every iteration
+// starts with, and only while nothing observable runs ahead of them. A rotated
+// loop evaluates its hoisted trees after the first test of the condition, which
+// has already evaluated every tree in its leading block once.
+static void selectTrees(Loop *loop) {
+    Code *code = &loop->code;
+    int *ends = ALLOCATE(int, code->count);
+
+    for (int i = 0; i < code->count; i++) {
+        ends[i] = NO_TREE;
+    }
+    for (int i = code->count - 1; i >= loop->entry; i--) {
+        if (isHoistable(loop, i)) {
+            ends[loop->trees[i].start] = i;
+            i = loop->trees[i].start;
+        }
+    }
+
+    bool isRotated = loop->condition != NO_TREE;
+    int bodyStart = isRotated ? loop->condition + 2 : NO_TREE;
+    bool isClean = true;
+    for (int i = loop->entry; i < code->count; i++) {
+        if (i == bodyStart) isClean = true;
+
+        int end = ends[i];
+        if (end != NO_TREE) {
+            bool isSafe = (loop->trees[end].flags & TREE_SAFE) != 0;
+            bool isEntered = end <= loop->entryEnd && (isClean || isRotated);
+            bool isBodyEntered = isRotated && i >= bodyStart && end <= loop->bodyEnd && isClean;
+            if ((isSafe || isEntered || isBodyEntered) && hoistTree(loop, i, end)) {
+                i = end;
+                continue;
+            }
+        }
+
+        if (!(instructionFlags(loop, i) & TREE_SAFE)) isClean = false;
+    }
+
+    FREE_ARRAY(int, ends, code->count);
+}
+
+static double magnitude(double number) {
+    return number < 0 ? -number : number;
+}
+
+static bool isIntegral(Value value) {
+    if (!IS_NUMBER(value) || magnitude(AS_NUMBER(value)) >= MAX_EXACT_INTEGER) return false;
+    return AS_NUMBER(value) == (double) (int64_t) AS_NUMBER(value);
+}
+
+static int findConstant(Loop *loop, double number) {
+    ValueArray *constants = &loop->chunk->constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (IS_NUMBER(constants->values[i]) && AS_NUMBER(constants->values[i]) == number) return i;
+    }
+
+    if (constants->count == UINT8_COUNT) return -1;
+    return addConstant(loop->chunk, NUMBER_VAL(number));
+}
+
+static int reducedFactor(Loop *loop, int index, uint8_t counter) {
+    Code *code = &loop->code;
+    if (index + 2 >= code->count || code->isTarget[index + 1] || code->isTarget[index + 2]) return -1;
+    if (at(loop, index + 2)->op != OP_MULTIPLY) return -1;
+
+    int factor;
+    if (at(loop, index)->op == OP_GET_LOCAL && at(loop, index + 1)->op == OP_CONSTANT) {
+        if (operand(loop, index, 0) != counter) return -1;
+        factor = operand(loop, index + 1, 0);
+    } else if (at(loop, index)->op == OP_CONSTANT && at(loop, index + 1)->op == OP_GET_LOCAL) {
+        if (operand(loop, index + 1, 0) != counter) return -1;
+        factor = operand(loop, index, 0);
+    } else {
+        return -1;
+    }
+
+    return isIntegral(constant(loop, factor)) ? factor : -1;
+}
+
+// Multiplications of a fused range loop's counter by a constant become a second
+// induction variable that is advanced by addition. The compiler only supplies a
+// bound when every product is an exactly representable integer.
+static void reduceStrength(Loop *loop, double counterBound) {
+    Code *code = &loop->code;
+    if (counterBound <= 0 || at(loop, 0)->op != OP_FOR_PREP) return;
+
+    int last = code->count - 1;
+    if (at(loop, last)->op != OP_FOR_LOOP || at(loop, last)->target != loop->entry) return;
+
+    uint8_t counter = operand(loop, last, 0);
+    Value step = constant(loop, operand(loop, last, 2));
+    if (!isIntegral(step) || AS_NUMBER(step) <= 0) return;
+
+    int *candidates = ALLOCATE(int, code->count);
+    Hoisted reduced[MAX_HOISTED];
+    int uses[MAX_HOISTED];
+    int reducedCount = 0;
+
+    for (int i = loop->entry; i < last; i++) {
+        candidates[i] = NO_TREE;
+        int factor = reducedFactor(loop, i, counter);
+        if (factor == -1) continue;
+
+        double number = AS_NUMBER(constant(loop, factor));
+        if (number == 0 || magnitude(number) * counterBound >= MAX_EXACT_INTEGER) continue;
+
+        int candidate = 0;
+        while (candidate < reducedCount && AS_NUMBER(constant(loop, reduced[candidate].factor)) != number) {
+            candidate++;
+        }
+        if (candidate == reducedCount) {
+            if (reducedCount == MAX_HOISTED) continue;
+            reduced[reducedCount] = (Hoisted) {NO_TREE, 3, counter, factor, 0};
+            uses[reducedCount++] = 0;
+        }
+
+        candidates[i] = candidate;
+        uses[candidate]++;
+        candidates[i + 1] = NO_TREE;
+        candidates[i + 2] = NO_TREE;
+        i += 2;
+    }
+
+    int slots[MAX_HOISTED];
+    for (int i = 0; i < reducedCount; i++) {
+        slots[i] = NO_TREE;
+        if (uses[i] < MIN_REDUCED_USES || loop->hoistedCount == MAX_HOISTED) continue;
+
+        int increment = findConstant(loop, AS_NUMBER(step) * AS_NUMBER(constant(loop, reduced[i].factor)));
+        if (increment == -1) continue;
+
+        reduced[i].increment = (uint8_t) increment;
+        slots[i] = loop->hoistedCount;
+        loop->hoisted[loop->hoistedCount++] = reduced[i];
+        loop->reducedCount++;
+    }
+
+    for (int i = loop->entry; i < last; i++) {
+        if (candidates[i] != NO_TREE && slots[candidates[i]] != NO_TREE) loop->replacement[i] = slots[candidates[i]];
+    }
+
+    FREE_ARRAY(int, candidates, code->count);
+}
+
+static void shiftSlot(Loop *loop, Instruction *instruction, int index) {
+    uint8_t *slot = &loop->code.operands[instruction->operandStart + index];
+    if (*slot >= loop->slotCount) *slot += loop->hoistedCount;
+}
+
+static void shiftSlots(Loop *loop) {
+    for (int i = 0; i < loop->code.count; i++) {
+        Instruction *instruction = at(loop, i);
+
+        switch (instruction->op) {
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+                shiftSlot(loop, instruction, 0);
+                break;
+            case OP_FOR_PREP:
+            case OP_FOR_LOOP:
+                shiftSlot(loop, instruction, 0);
+                shiftSlot(loop, instruction, 1);
+                break;
+            case OP_CLOSURE:
+            case OP_CLOSURE_LONG:
+                for (int j = closureSlots(instruction); j < instruction->operandCount; j += 2) {
+                    if (operand(loop, i, j)) shiftSlot(loop, instruction, j + 1);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+// Keeps the position of every original instruction, and of the rotated copy of the
+// condition, up to date as instructions are inserted.
+static void insertWithOperand(Loop *loop, int index, uint8_t op, int line, int value, bool isJumpedOver) {
+    for (int i = 0; i < loop->positionCount; i++) {
+        if (loop->positions[i] >= index) loop->positions[i]++;
+    }
+
+    Instruction *instruction = insertInstruction(&loop->code, index, op, line, isJumpedOver);
+    if (value != -1) {
+        instruction->operandStart = addCodeOperand(&loop->code, (uint8_t) value);
+        instruction->operandCount = 1;
+    }
+}
+
+static void insertCopy(Loop *loop, int index, int source) {
+    Instruction copy = *at(loop, source);
+    int value = copy.operandCount > 0 ? instructionOperand(&loop->code, &copy, 0) : -1;
+    insertWithOperand(loop, index, copy.op, copy.line, value, true);
+}
+
+// Copies the condition to the bottom of the loop so the back edge skips the
+// preheader that now sits between the first test and the body.
+static void rotateLoop(Loop *loop, int originalCount) {
+    int condition = loop->condition;
+    int *copies = &loop->positions[originalCount];
+
+    for (int i = 0; i <= condition + 1; i++) {
+        int back = loop->positions[originalCount - 2];
+        Instruction copy = *at(loop, loop->positions[i]);
+        int value = copy.operandCount > 0 ? instructionOperand(&loop->code, &copy, 0) : -1;
+        insertWithOperand(loop, back, copy.op, copy.line, value, false);
+        copies[i] = back;
+        loop->positionCount++;
+    }
+
+    for (int i = 0; i <= condition; i++) {
+        int target = at(loop, loop->positions[i])->target;
+        if (target == NO_TARGET) continue;
+        at(loop, copies[i])->target = target > condition + 1 ? loop->positions[originalCount - 1] : copies[target];
+    }
+
+    int body = condition + 2 == originalCount - 2 ? copies[0] : loop->positions[condition + 2];
+    at(loop, loop->positions[originalCount - 2])->target = body;
+}
+
+static void replaceTree(Loop *loop, int index, int slot) {
+    Instruction *instruction = at(loop, loop->positions[index]);
+    instruction->op = OP_GET_LOCAL;
+    instruction->operandStart = addCodeOperand(&loop->code, (uint8_t) (loop->slotCount + slot));
+    instruction->operandCount = 1;
+    for (int j = 1; j < loop->hoisted[slot].length; j++) {
+        removeInstruction(&loop->code, loop->positions[index + j]);
+    }
+}
+
+static void rewriteLoop(Loop *loop) {
+    Code *code = &loop->code;
+    int originalCount = code->count;
+    int line = at(loop, loop->entry)->line;
+    bool isRotated = loop->condition != NO_TREE;
+
+    loop->positions = ALLOCATE(int, originalCount * 2);
+    for (int i = 0; i < originalCount; i++) {
+        loop->positions[i] = i;
+    }
+    loop->positionCount = originalCount;
+
+    shiftSlots(loop);
+
+    // Each hoisted value gets a stack slot just above the loop's live locals. A
+    // rotated loop reserves the slots up front so both of its exits pop them.
+    int preheader = loop->positions[loop->entry];
+    if (isRotated) {
+        rotateLoop(loop, originalCount);
+        for (int i = 0; i < loop->hoistedCount; i++) {
+            insertWithOperand(loop, 0, OP_NIL, line, -1, true);
+        }
+        preheader = loop->positions[loop->condition + 1] + 1;
+    }
+
+    for (int i = 0; i < loop->hoistedCount; i++) {
+        Hoisted *hoisted = &loop->hoisted[i];
+
+        if (hoisted->start == NO_TREE) {
+            insertWithOperand(loop, preheader++, OP_GET_LOCAL, line, hoisted->counter, true);
+            insertWithOperand(loop, preheader++, OP_CONSTANT, line, hoisted->factor, true);
+            insertWithOperand(loop, preheader++, OP_MULTIPLY, line, -1, true);
+            continue;
+        }
+
+        for (int j = 0; j < hoisted->length; j++) {
+            insertCopy(loop, preheader++, loop->positions[hoisted->start + j]);
+        }
+        if (isRotated) {
+            insertWithOperand(loop, preheader++, OP_SET_LOCAL, line, loop->slotCount + i, true);
+            insertWithOperand(loop, preheader++, OP_POP, line, -1, true);
+        }
+    }
+
+    // The first test of a rotated loop's condition keeps its original code.
+    for (int i = loop->entry; i < originalCount; i++) {
+        int slot = loop->replacement[i];
+        if (slot == NO_TREE) continue;
+
+        replaceTree(loop, isRotated && i <= loop->condition ? originalCount + i : i, slot);
+        i += loop->hoisted[slot].length - 1;
+    }
+
+    for (int i = 0; i < loop->hoistedCount; i++) {
+        Hoisted *hoisted = &loop->hoisted[i];
+        if (hoisted->start != NO_TREE) continue;
+
+        int forLoop = loop->positions[originalCount - 1];
+        int forLine = at(loop, forLoop)->line;
+        int slot = loop->slotCount + i;
+        insertWithOperand(loop, forLoop, OP_GET_LOCAL, forLine, slot, false);
+        insertWithOperand(loop, forLoop + 1, OP_CONSTANT, forLine, hoisted->increment, false);
+        insertWithOperand(loop, forLoop + 2, OP_ADD, forLine, -1, false);
+        insertWithOperand(loop, forLoop + 3, OP_SET_LOCAL, forLine, slot, false);
+        insertWithOperand(loop, forLoop + 4, OP_POP, forLine, -1, false);
+    }
+
+    int endLine = at(loop, code->count - 1)->line;
+    for (int i = 0; i < loop->hoistedCount; i++) {
+        insertWithOperand(loop, code->count, OP_POP, endLine, -1, true);
+    }
+
+    FREE_ARRAY(int, loop->positions, originalCount * 2);
+}
+
+void optimizeLoop(Chunk *chunk, int start, int slotCount, double counterBound) {
+    // Too long for the short jumps the rewrite assumes.
+    if (chunk->count - start > UINT16_MAX) return;
+
+    Chunk region;
+    initChunk(&region);
+    for (int offset = start; offset < chunk->count; offset++) {
+        writeChunk(&region, chunk->code[offset], getLine(chunk, offset));
+    }
+
+    Loop loop;
+    loop.chunk = chunk;
+    loop.slotCount = slotCount;
+    loop.maxSlot = slotCount - 1;
+    loop.hasCall = false;
+    loop.hasFieldWrite = false;
+    loop.hasLongGlobalWrite = false;
+    loop.hoistedCount = 0;
+    loop.reducedCount = 0;
+    for (int i = 0; i < UINT8_COUNT; i++) {
+        loop.isSlotWritten[i] = false;
+        loop.isUpvalueWritten[i] = false;
+        loop.isGlobalWritten[i] = false;
+    }
+
+    // Decoding needs the constants to size closures, so borrow the function's.
+    region.constants = chunk->constants;
+    initCode(&loop.code, &region);
+    decodeChunk(&loop.code);
+    initValueArray(&region.constants);
+    findJumpTargets(&loop.code);
+
+    Code *code = &loop.code;
+    loop.trees = ALLOCATE(Tree, code->count);
+    loop.replacement = ALLOCATE(int, code->count);
+    for (int i = 0; i < code->count; i++) {
+        loop.replacement[i] = NO_TREE;
+    }
+
+    loop.entry = code->count > 0 && at(&loop, 0)->op == OP_FOR_PREP ? 1 : 0;
+    loop.entryEnd = blockEnd(&loop, loop.entry);
+    loop.condition = findCondition(&loop);
+    loop.bodyEnd = loop.condition != NO_TREE ? blockEnd(&loop, loop.condition + 2) : NO_TREE;
+
+    int originalCount = code->count;
+    scanEffects(&loop);
+    if (loop.entry < code->count && findTrees(&loop)) {
+        selectTrees(&loop);
+        reduceStrength(&loop, counterBound);
+    }
+
+    if (loop.hoistedCount > 0 && loop.maxSlot + loop.hoistedCount < UINT8_COUNT) {
+        rewriteLoop(&loop);
+        encodeChunk(code);
+
+        if (region.count <= UINT16_MAX) {
+            truncateChunk(chunk, start);
+            for (int offset = 0; offset < region.count; offset++) {
+                writeChunk(chunk, region.code[offset], getLine(&region, offset));
+            }
+
+            if (compilerOptions.isReporting) {
+                int hoisted = loop.hoistedCount - loop.reducedCount;
+                int line = getLine(&region, 0);
+                if (hoisted > 0) {
+                    fprintf(stderr, "[line %d] Hoisted %d loop-invariant expression%s.\n", line, hoisted,
+                            hoisted == 1 ? "" : "s");
+                }
+                if (loop.reducedCount > 0) {
+                    fprintf(stderr, "[line %d] Strength-reduced %d loop counter multiplication%s.\n", line,
+                            loop.reducedCount, loop.reducedCount == 1 ? "" : "s");
+                }
+            }
+        }
+    }
+
+    FREE_ARRAY(Tree, loop.trees, originalCount);
+    FREE_ARRAY(int, loop.replacement, originalCount);
+    freeCode(code);
+    freeChunk(&region);
+}
@@ -0,0 +1,14 @@
+//
+// Created by Mic Pringle on 19/10/2026.
+//
+
+#ifndef CLOX_LOOP_H
+#define CLOX_LOOP_H
+
+#include "chunk.h"
+
+#define MAX_EXACT_INTEGER 9007199254740992.0
+
+void optimizeLoop(Chunk *chunk, int start, int slotCount, double counterBound);
+
+#endif
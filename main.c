@@ -7,8 +7,11 @@
 #include <string.h>
 
 #include "common.h"
+#include "cache.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "memory.h"
 #include "vm.h"
 
 static void repl() {
@@ -25,53 +28,92 @@ static void repl() {
     }
 }
 
-static char *readFile(const char *path) {
-    FILE *file = fopen(path, "rb");
-    if (file == NULL) {
+static const char *readFile(const char *path) {
+    const char *source = mapSource(path);
+    if (source == NULL) {
         fprintf(stderr, "Couldn't open file \"%s\".\n", path);
         exit(74);
     }
+    return source;
+}
 
-    fseek(file, 0L, SEEK_END);
-    size_t fileSize = ftell(file);
-    rewind(file);
-
-    char *buffer = (char *) malloc(fileSize + 1);
-    if (buffer == NULL) {
-        fprintf(stderr, "Not enough memory to read file \"%s\".\n", path);
-        exit(74);
+static void runFiles(const char **paths, int count) {
+    const char **sources = malloc(sizeof(char *) * count);
+    if (sources == NULL) exit(74);
+    for (int i = 0; i < count; i++) {
+        sources[i] = readFile(paths[i]);
     }
 
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-    if (bytesRead < fileSize) {
-        fprintf(stderr, "Couldn't read file \"%s\".\n", path);
-        exit(74);
+    InterpretResult result;
+    if (count == 1) {
+        result = interpretFile(paths[0], sources[0]);
+    } else {
+        result = interpretFiles(paths, sources, count);
     }
-    buffer[bytesRead] = '\0';
+    free(sources);
 
-    fclose(file);
-    return buffer;
+    if (result == INTERPRET_COMPILE_ERROR) exit(65);
+    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
-static void runFile(const char *path) {
-    char *source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
+static void emitNative(const char *path, const char *output) {
+    const char *source = readFile(path);
+    ObjFunction *function = compile(path, source);
+    if (function == NULL) exit(65);
 
-    if (result == INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+    push(OBJ_VAL(function));
+    bool isWritten = writeNative(output, path, source, function);
+    pop();
+
+    if (!isWritten) {
+        fprintf(stderr, "Couldn't write file \"%s\".\n", output);
+        exit(74);
+    }
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: clox [-O0|-O1|-O2] [--closed-world] [--report] [--cache] [--lazy] [--emit-c output] [path...]\n");
+    exit(64);
 }
 
 int main(int argc, const char *argv[]) {
+    const char *output = NULL;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        if (strcmp(argv[arg], "-O0") == 0) {
+            compilerOptions.optimizationLevel = 0;
+        } else if (strcmp(argv[arg], "-O1") == 0) {
+            compilerOptions.optimizationLevel = 1;
+        } else if (strcmp(argv[arg], "-O2") == 0) {
+            compilerOptions.optimizationLevel = 2;
+        } else if (strcmp(argv[arg], "--closed-world") == 0) {
+            compilerOptions.isClosedWorld = true;
+        } else if (strcmp(argv[arg], "--report") == 0) {
+            compilerOptions.isReporting = true;
+        } else if (strcmp(argv[arg], "--cache") == 0) {
+            compilerOptions.isCaching = true;
+        } else if (strcmp(argv[arg], "--lazy") == 0) {
+            compilerOptions.isLazy = true;
+        } else if (strcmp(argv[arg], "--emit-c") == 0 && arg + 1 < argc) {
+            output = argv[++arg];
+        } else {
+            usage();
+        }
+    }
+
     initVM();
 
-    if (argc == 1) {
+    if (output != NULL) {
+        if (argc - arg != 1) usage();
+        // Every body has to be compiled before it can be written out.
+        compilerOptions.isLazy = false;
+        emitNative(argv[arg], output);
+    } else if (arg == argc) {
+        // Each REPL line reuses the same buffer, so bodies can't be left to compile later.
+        compilerOptions.isLazy = false;
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        runFiles(&argv[arg], argc - arg);
     }
 
     freeVM();
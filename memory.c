@@ -2,7 +2,12 @@
 // Created by Mic Pringle on 03/12/2022.
 //
 
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "compiler.h"
 #include "memory.h"
@@ -14,11 +19,40 @@
 #endif
 
 #define GC_HEAP_GROW_FACTOR 2
+#define FROZEN_REGION_SIZE (64 * 1024)
+
+// Frozen chunks are bump-allocated from page-aligned regions so finished code can be made read-only. A region is
+// unmapped once every block in it has been released and it can't take new ones.
+typedef struct FrozenRegion {
+    struct FrozenRegion *next;
+    uint8_t *memory;
+    size_t size;
+    size_t used;
+    size_t protectedSize;
+    int blockCount;
+} FrozenRegion;
+
+// Each block starts with its region and size, so releasing it needs no search.
+typedef struct {
+    FrozenRegion *region;
+    size_t size;
+} FrozenBlock;
+
+static FrozenRegion *frozenRegions = NULL;
+static FrozenRegion *adoptedRegions = NULL;
+static size_t frozenTotal = 0;
+
+_Thread_local Heap *localHeap = NULL;
+static pthread_mutex_t heapLock = PTHREAD_MUTEX_INITIALIZER;
 
 void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
-    vm.bytesAllocated += newSize - oldSize;
+    if (localHeap != NULL) {
+        localHeap->bytesAllocated += newSize - oldSize;
+    } else {
+        vm.bytesAllocated += newSize - oldSize;
+    }
 
-    if (newSize > oldSize) {
+    if (newSize > oldSize && localHeap == NULL) {
 #ifdef DEBUG_STRESS_GC
         collectGarbage();
 #endif
@@ -37,6 +71,194 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
     return result;
 }
 
+void beginLocalHeap(Heap *heap) {
+    localHeap = heap;
+}
+
+void endLocalHeap() {
+    localHeap = NULL;
+}
+
+// Must only be called once the thread that filled the heap has finished with it.
+void adoptHeap(Heap *heap) {
+    if (heap->objects != NULL) {
+        Obj *last = heap->objects;
+        while (last->next != NULL) last = last->next;
+        last->next = vm.objects;
+        vm.objects = heap->objects;
+    }
+
+    vm.bytesAllocated += heap->bytesAllocated;
+    heap->objects = NULL;
+    heap->bytesAllocated = 0;
+}
+
+// Guards the state every thread shares while compiling: the interned strings and the frozen regions.
+void lockHeap() {
+    if (localHeap != NULL) pthread_mutex_lock(&heapLock);
+}
+
+void unlockHeap() {
+    if (localHeap != NULL) pthread_mutex_unlock(&heapLock);
+}
+
+// Roots a value that is not reachable yet. A thread with a local heap never collects, and
+// leaves the VM's stack alone.
+void pushRoot(Value value) {
+    if (localHeap == NULL) push(value);
+}
+
+void popRoot() {
+    if (localHeap == NULL) pop();
+}
+
+static void freeRegion(FrozenRegion *region) {
+    FrozenRegion **link = &frozenRegions;
+    while (*link != region) link = &(*link)->next;
+    *link = region->next;
+    munmap(region->memory, region->size);
+    free(region);
+}
+
+void *allocateFrozen(size_t size) {
+    size = sizeof(FrozenBlock) + ((size + sizeof(Value) - 1) & ~(sizeof(Value) - 1));
+    lockHeap();
+
+    FrozenRegion *region = frozenRegions;
+    if (region == NULL || region->used + size > region->size) {
+        size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+        size_t regionSize = size > FROZEN_REGION_SIZE ? size : FROZEN_REGION_SIZE;
+        regionSize = (regionSize + pageSize - 1) & ~(pageSize - 1);
+
+        void *memory = mmap(NULL, regionSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        region = malloc(sizeof(FrozenRegion));
+        if (memory == MAP_FAILED || region == NULL) exit(1);
+
+        region->next = frozenRegions;
+        region->memory = memory;
+        region->size = regionSize;
+        region->used = 0;
+        region->protectedSize = 0;
+        region->blockCount = 0;
+        frozenRegions = region;
+        if (region->next != NULL && region->next->blockCount == 0) freeRegion(region->next);
+    }
+
+    FrozenBlock *block = (FrozenBlock *) (region->memory + region->used);
+    block->region = region;
+    block->size = size;
+    region->used += size;
+    region->blockCount++;
+    frozenTotal += size;
+
+    // Frozen blocks count towards the next collection like the arrays they replace.
+    if (localHeap != NULL) {
+        localHeap->bytesAllocated += size;
+    } else {
+        vm.bytesAllocated += size;
+    }
+    unlockHeap();
+    return block + 1;
+}
+
+// Every byte ever frozen, so the difference across a compile is what that compile froze.
+size_t frozenAllocated() {
+    return frozenTotal;
+}
+
+void releaseFrozen(void *memory) {
+    FrozenBlock *block = (FrozenBlock *) memory - 1;
+    FrozenRegion *region = block->region;
+    lockHeap();
+
+    if (localHeap != NULL) {
+        localHeap->bytesAllocated -= block->size;
+    } else {
+        vm.bytesAllocated -= block->size;
+    }
+
+    // The newest region is kept while it can still take blocks, and goes when it fills up if it's empty by then.
+    if (--region->blockCount == 0 && region != frozenRegions) freeRegion(region);
+    unlockHeap();
+}
+
+// Takes ownership of an already read-only mapping, such as a bytecode cache, for the life of the VM.
+void adoptFrozen(void *memory, size_t size) {
+    FrozenRegion *region = malloc(sizeof(FrozenRegion));
+    if (region == NULL) exit(1);
+
+    region->next = adoptedRegions;
+    region->memory = memory;
+    region->size = size;
+    region->used = size;
+    region->protectedSize = size;
+    region->blockCount = 0;
+    adoptedRegions = region;
+}
+
+// Maps a source file in place of reading it into a copy. A spare page is reserved behind the file, so the byte after its
+// end is always a zero the scanner can stop at. The mapping is adopted for the life of the VM, since lazily compiled
+// bodies and interned literals are taken straight from it.
+const char *mapSource(const char *path) {
+    int descriptor = open(path, O_RDONLY);
+    if (descriptor == -1) return NULL;
+
+    struct stat status;
+    if (fstat(descriptor, &status) == -1 || !S_ISREG(status.st_mode)) {
+        close(descriptor);
+        return NULL;
+    }
+
+    size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    size_t fileSize = (size_t) status.st_size;
+    size_t size = (fileSize / pageSize + 1) * pageSize;
+    char *memory = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        close(descriptor);
+        return NULL;
+    }
+
+    // The kernel zero-fills the tail of the file's last page, and the reserved page covers a file that ends on a boundary.
+    if (fileSize > 0 && mmap(memory, fileSize, PROT_READ, MAP_PRIVATE | MAP_FIXED, descriptor, 0) == MAP_FAILED) {
+        munmap(memory, size);
+        close(descriptor);
+        return NULL;
+    }
+    close(descriptor);
+
+    madvise(memory, size, MADV_SEQUENTIAL);
+    adoptFrozen(memory, size);
+    return memory;
+}
+
+void protectFrozen() {
+    size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    for (FrozenRegion *region = frozenRegions; region != NULL; region = region->next) {
+        // Only the newest region can still gain chunks, so its partly filled last page stays writable.
+        size_t end = region == frozenRegions ? region->used & ~(pageSize - 1) : region->size;
+        if (end <= region->protectedSize) continue;
+
+        mprotect(region->memory + region->protectedSize, end - region->protectedSize, PROT_READ);
+        region->protectedSize = end;
+    }
+}
+
+static void freeRegions(FrozenRegion *region) {
+    while (region != NULL) {
+        FrozenRegion *next = region->next;
+        munmap(region->memory, region->size);
+        free(region);
+        region = next;
+    }
+}
+
+void freeFrozen() {
+    freeRegions(frozenRegions);
+    freeRegions(adoptedRegions);
+    frozenRegions = NULL;
+    adoptedRegions = NULL;
+}
+
 void markObject(Obj *object) {
     if (object == NULL) return;
     if (object->isMarked) return;
@@ -100,6 +322,8 @@ static void blackenObject(Obj *object) {
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction *) object;
             markObject((Obj *) function->name);
+            markObject((Obj *) function->closure);
+            markObject((Obj *) function->klass);
             markArray(&function->chunk.constants);
             break;
         }
@@ -142,6 +366,11 @@ static void freeObject(Obj *object) {
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction *) object;
             freeChunk(&function->chunk);
+            if (function->lazy != NULL) {
+                FREE_ARRAY(SourceName, function->lazy->upvalueNames, function->upvalueCount);
+                FREE_ARRAY(uint8_t, function->lazy->upvalueKinds, function->upvalueCount);
+                FREE(LazyFunction, function->lazy);
+            }
             FREE(ObjFunction, object);
             break;
         }
@@ -180,6 +409,10 @@ static void markRoots() {
     }
 
     markTable(&vm.globals);
+    markTable(&vm.modules);
+    for (int i = 0; i < vm.scriptCount; i++) {
+        markObject((Obj *) vm.scripts[i].function);
+    }
     markCompilerRoots();
     markObject((Obj *) vm.initString);
 }
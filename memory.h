@@ -16,8 +16,44 @@
 #define GROW_ARRAY(type, pointer, oldCount, newCount) (type *) reallocate(pointer, sizeof(type) * oldCount, sizeof(type) * newCount)
 #define FREE_ARRAY(type, pointer, oldCount) reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// Objects allocated by a compiler worker thread, kept apart from the VM's until it finishes.
+typedef struct {
+    Obj *objects;
+    size_t bytesAllocated;
+} Heap;
+
+extern _Thread_local Heap *localHeap;
+
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
 
+void beginLocalHeap(Heap *heap);
+
+void endLocalHeap();
+
+void adoptHeap(Heap *heap);
+
+void lockHeap();
+
+void unlockHeap();
+
+void pushRoot(Value value);
+
+void popRoot();
+
+void *allocateFrozen(size_t size);
+
+size_t frozenAllocated();
+
+void releaseFrozen(void *memory);
+
+void adoptFrozen(void *memory, size_t size);
+
+const char *mapSource(const char *path);
+
+void protectFrozen();
+
+void freeFrozen();
+
 void markObject(Obj *object);
 
 void markValue(Value value);
@@ -17,8 +17,13 @@ static Obj *allocateObject(size_t size, ObjType type) {
     Obj *object = (Obj *) reallocate(NULL, 0, size);
     object->type = type;
     object->isMarked = false;
-    object->next = vm.objects;
-    vm.objects = object;
+    if (localHeap != NULL) {
+        object->next = localHeap->objects;
+        localHeap->objects = object;
+    } else {
+        object->next = vm.objects;
+        vm.objects = object;
+    }
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %d\n", (void *) object, size, type);
@@ -58,8 +63,13 @@ ObjFunction *newFunction() {
     ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
+    function->slotCount = 0;
     function->name = NULL;
     initChunk(&function->chunk);
+    function->lazy = NULL;
+    function->closure = NULL;
+    function->klass = NULL;
+    function->compiled = NULL;
     return function;
 }
 
@@ -82,9 +92,9 @@ static ObjString *allocateString(char *chars, int length, uint32_t hash) {
     string->chars = chars;
     string->hash = hash;
 
-    push(OBJ_VAL(string));
+    pushRoot(OBJ_VAL(string));
     tableSet(&vm.strings, string, NIL_VAL);
-    pop();
+    popRoot();
 
     return string;
 }
@@ -100,23 +110,29 @@ static uint32_t hashString(const char *key, int length) {
 
 ObjString *takeString(char *chars, int length) {
     uint32_t hash = hashString(chars, length);
-    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
-    if (interned != NULL) {
+    lockHeap();
+    ObjString *string = tableFindString(&vm.strings, chars, length, hash);
+    if (string != NULL) {
         FREE_ARRAY(char, chars, length + 1);
-        return interned;
+    } else {
+        string = allocateString(chars, length, hash);
     }
-    return allocateString(chars, length, hash);
+    unlockHeap();
+    return string;
 }
 
 ObjString *copyString(const char *chars, int length) {
     uint32_t hash = hashString(chars, length);
-    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
-    if (interned != NULL) return interned;
-
-    char *heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    lockHeap();
+    ObjString *string = tableFindString(&vm.strings, chars, length, hash);
+    if (string == NULL) {
+        char *heapChars = ALLOCATE(char, length + 1);
+        memcpy(heapChars, chars, length);
+        heapChars[length] = '\0';
+        string = allocateString(heapChars, length, hash);
+    }
+    unlockHeap();
+    return string;
 }
 
 ObjUpvalue *newUpvalue(Value *slot) {
@@ -163,3 +179,52 @@ void printObject(Value value) {
             break;
     }
 }
+
+static int formatFunction(char *buffer, size_t size, ObjFunction *function) {
+    if (function->name == NULL) return snprintf(buffer, size, "<script>");
+    return snprintf(buffer, size, "<fn %s>", function->name->chars);
+}
+
+int formatObject(char *buffer, size_t size, Value value) {
+    switch (OBJ_TYPE(value)) {
+        case OBJ_BOUND_METHOD:
+            return formatFunction(buffer, size, AS_BOUND_METHOD(value)->method->function);
+        case OBJ_CLASS:
+            return snprintf(buffer, size, "%s", AS_CLASS(value)->name->chars);
+        case OBJ_CLOSURE:
+            return formatFunction(buffer, size, AS_CLOSURE(value)->function);
+        case OBJ_FUNCTION:
+            return formatFunction(buffer, size, AS_FUNCTION(value));
+        case OBJ_INSTANCE:
+            return snprintf(buffer, size, "%s instance", AS_INSTANCE(value)->klass->name->chars);
+        case OBJ_NATIVE:
+            return snprintf(buffer, size, "<native fn>");
+        case OBJ_STRING:
+            return snprintf(buffer, size, "%s", AS_CSTRING(value));
+        case OBJ_UPVALUE:
+            return snprintf(buffer, size, "upvalue");
+    }
+    return 0;
+}
+
+// Joins values into one string that is allocated and interned once, however many there are. A value that isn't a
+// string appears the way print shows it. The values must stay reachable while the result is allocated.
+ObjString *joinValues(Value *values, int count) {
+    int length = 0;
+    for (int i = 0; i < count; i++) {
+        length += IS_STRING(values[i]) ? AS_STRING(values[i])->length : formatValue(NULL, 0, values[i]);
+    }
+
+    char *chars = ALLOCATE(char, length + 1);
+    int offset = 0;
+    for (int i = 0; i < count; i++) {
+        if (IS_STRING(values[i])) {
+            memcpy(chars + offset, AS_STRING(values[i])->chars, AS_STRING(values[i])->length);
+            offset += AS_STRING(values[i])->length;
+        } else {
+            offset += formatValue(chars + offset, length + 1 - offset, values[i]);
+        }
+    }
+    chars[length] = '\0';
+    return takeString(chars, length);
+}
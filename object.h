@@ -46,12 +46,39 @@ struct Obj {
     struct Obj *next;
 };
 
+typedef struct {
+    const char *start;
+    int length;
+} SourceName;
+
+// What the compiler needs to compile a deferred function body on its first call.
+typedef struct {
+    const char *source;
+    int line;
+    int type;
+    bool isInClass;
+    bool hasSuperclass;
+    SourceName className;
+    SourceName *upvalueNames;
+    uint8_t *upvalueKinds;
+} LazyFunction;
+
+// A function body translated to C by --emit-c. It runs the frame on top of the VM's stack until that frame returns.
+typedef bool (*CompiledFn)();
+
 typedef struct {
     Obj obj;
     int arity;
     int upvalueCount;
+    int slotCount;
     Chunk chunk;
     ObjString *name;
+    LazyFunction *lazy;
+    // The closure made when the declaration of a function without upvalues last ran, for calls bound directly to it.
+    struct ObjClosure *closure;
+    // The class a method was last defined on, which a devirtualized invocation checks the receiver against.
+    struct ObjClass *klass;
+    CompiledFn compiled;
 } ObjFunction;
 
 typedef Value (* NativeFn)(int argCount, Value *args);
@@ -75,14 +102,14 @@ typedef struct ObjUpvalue {
     struct ObjUpvalue *next;
 } ObjUpvalue;
 
-typedef struct {
+typedef struct ObjClosure {
     Obj obj;
     ObjFunction *function;
     ObjUpvalue **upvalues;
     int upvalueCount;
 } ObjClosure;
 
-typedef struct {
+typedef struct ObjClass {
     Obj obj;
     ObjString *name;
     Table methods;
@@ -120,6 +147,10 @@ ObjUpvalue *newUpvalue(Value *slot);
 
 void printObject(Value value);
 
+int formatObject(char *buffer, size_t size, Value value);
+
+ObjString *joinValues(Value *values, int count);
+
 static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
@@ -0,0 +1,1234 @@
+//
+// Created by Mic Pringle on 19/10/2026.
+//
+
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "optimizer.h"
+#include "ssa.h"
+#include "vm.h"
+
+#define MAX_PASSES 8
+#define MAX_JUMP_HOPS 16
+#define MAX_SSA_ROUNDS 4
+#define MAX_CONSTANT_DEPTH 16
+#define MAX_EVALUATION_STEPS 100000
+#define MAX_EVALUATION_FRAMES 64
+#define MAX_EVALUATION_STACK 1024
+#define MAX_EVALUATION_ROOTS 1024
+
+void initCode(Code *code, Chunk *chunk) {
+    code->chunk = chunk;
+    code->instructions = NULL;
+    code->count = 0;
+    code->capacity = 0;
+    code->operands = NULL;
+    code->operandCount = 0;
+    code->operandCapacity = 0;
+    code->targets = NULL;
+    code->targetCount = 0;
+    code->targetCapacity = 0;
+    code->isTarget = NULL;
+}
+
+void freeCode(Code *code) {
+    FREE_ARRAY(Instruction, code->instructions, code->capacity);
+    FREE_ARRAY(uint8_t, code->operands, code->operandCapacity);
+    FREE_ARRAY(int, code->targets, code->targetCapacity);
+    FREE_ARRAY(bool, code->isTarget, code->count + 1);
+    initCode(code, NULL);
+}
+
+int addCodeOperand(Code *code, uint8_t operand) {
+    if (code->operandCapacity < code->operandCount + 1) {
+        int oldCapacity = code->operandCapacity;
+        code->operandCapacity = GROW_CAPACITY(oldCapacity);
+        code->operands = GROW_ARRAY(uint8_t, code->operands, oldCapacity, code->operandCapacity);
+    }
+
+    code->operands[code->operandCount] = operand;
+    return code->operandCount++;
+}
+
+static int addTarget(Code *code, int target) {
+    if (code->targetCapacity < code->targetCount + 1) {
+        int oldCapacity = code->targetCapacity;
+        code->targetCapacity = GROW_CAPACITY(oldCapacity);
+        code->targets = GROW_ARRAY(int, code->targets, oldCapacity, code->targetCapacity);
+    }
+
+    code->targets[code->targetCount] = target;
+    return code->targetCount++;
+}
+
+static Instruction *addInstruction(Code *code, uint8_t op, int line) {
+    if (code->capacity < code->count + 1) {
+        int oldCapacity = code->capacity;
+        code->capacity = GROW_CAPACITY(oldCapacity);
+        code->instructions = GROW_ARRAY(Instruction, code->instructions, oldCapacity, code->capacity);
+    }
+
+    Instruction *instruction = &code->instructions[code->count++];
+    instruction->op = op;
+    instruction->line = line;
+    instruction->operandStart = code->operandCount;
+    instruction->operandCount = 0;
+    instruction->target = NO_TARGET;
+    instruction->targetStart = code->targetCount;
+    instruction->targetCount = 0;
+    instruction->isRemoved = false;
+    return instruction;
+}
+
+uint8_t instructionOperand(Code *code, Instruction *instruction, int index) {
+    return code->operands[instruction->operandStart + index];
+}
+
+static int readShort(Chunk *chunk, int offset) {
+    return (chunk->code[offset] << 8) | chunk->code[offset + 1];
+}
+
+static int readLong(Chunk *chunk, int offset) {
+    return (chunk->code[offset] << 16) | readShort(chunk, offset + 1);
+}
+
+static int longOperand(Code *code, Instruction *instruction) {
+    return (instructionOperand(code, instruction, 0) << 16) | (instructionOperand(code, instruction, 1) << 8) |
+           instructionOperand(code, instruction, 2);
+}
+
+static void copyOperands(Code *code, Instruction *instruction, int from, int count) {
+    instruction->operandStart = code->operandCount;
+    instruction->operandCount = count;
+    for (int i = 0; i < count; i++) {
+        addCodeOperand(code, code->chunk->code[from + i]);
+    }
+}
+
+static void decodeSwitch(Code *code, Instruction *instruction, int offset, int *indexOf) {
+    Chunk *chunk = code->chunk;
+    int length = instructionLength(chunk, offset);
+    int end = indexOf[offset + length];
+
+    instruction->targetStart = code->targetCount;
+    if (instruction->op == OP_SWITCH_TABLE) {
+        int count = readShort(chunk, offset + 2);
+        copyOperands(code, instruction, offset + 1, 3);
+        for (int i = -1; i < count; i++) {
+            int distance = readShort(chunk, offset + 6 + i * 2);
+            addTarget(code, distance == 0 ? end : indexOf[offset - distance]);
+        }
+        instruction->targetCount = count + 1;
+    } else {
+        int capacity = readShort(chunk, offset + 1);
+        instruction->operandStart = code->operandCount;
+        instruction->operandCount = 2 + capacity;
+        addCodeOperand(code, chunk->code[offset + 1]);
+        addCodeOperand(code, chunk->code[offset + 2]);
+        for (int i = 0; i < capacity; i++) {
+            addCodeOperand(code, chunk->code[offset + 5 + i * 3]);
+        }
+
+        int fallback = readShort(chunk, offset + 3);
+        addTarget(code, fallback == 0 ? end : indexOf[offset - fallback]);
+        for (int i = 0; i < capacity; i++) {
+            int distance = readShort(chunk, offset + 6 + i * 3);
+            addTarget(code, distance == 0 ? EMPTY_ENTRY : indexOf[offset - distance]);
+        }
+        instruction->targetCount = capacity + 1;
+    }
+}
+
+// Maps the offset of every instruction, and of every operand byte when
+// isEveryByte is set, to the index of the instruction.
+static int *indexInstructions(Chunk *chunk, bool isEveryByte) {
+    int *indexOf = ALLOCATE(int, chunk->count + 1);
+
+    int count = 0;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        int end = isEveryByte ? offset + instructionLength(chunk, offset) : offset + 1;
+        for (int i = offset; i < end; i++) {
+            indexOf[i] = count;
+        }
+        count++;
+    }
+    indexOf[chunk->count] = count;
+    return indexOf;
+}
+
+void decodeChunk(Code *code) {
+    Chunk *chunk = code->chunk;
+    int *indexOf = indexInstructions(chunk, false);
+    int run = 0;
+
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        // Instructions are visited in order, so walk the line runs alongside them.
+        while (run + 1 < chunk->lineCount && chunk->lines[run + 1].offset <= offset) run++;
+
+        uint8_t op = chunk->code[offset];
+        Instruction *instruction = addInstruction(code, op, chunk->lines[run].line);
+
+        switch (op) {
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+                instruction->target = indexOf[offset + 3 + readShort(chunk, offset + 1)];
+                break;
+            case OP_LOOP:
+                instruction->target = indexOf[offset + 3 - readShort(chunk, offset + 1)];
+                break;
+            // Long jumps decode to the short ones, and encodeChunk picks the width again.
+            case OP_JUMP_LONG:
+            case OP_JUMP_IF_FALSE_LONG:
+                instruction->op = op == OP_JUMP_LONG ? OP_JUMP : OP_JUMP_IF_FALSE;
+                instruction->target = indexOf[offset + 4 + readLong(chunk, offset + 1)];
+                break;
+            case OP_LOOP_LONG:
+                instruction->op = OP_LOOP;
+                instruction->target = indexOf[offset + 4 - readLong(chunk, offset + 1)];
+                break;
+            case OP_FOR_PREP:
+                copyOperands(code, instruction, offset + 1, 2);
+                instruction->target = indexOf[offset + 5 + readShort(chunk, offset + 3)];
+                break;
+            case OP_FOR_LOOP:
+                copyOperands(code, instruction, offset + 1, 3);
+                instruction->target = indexOf[offset + 6 - readShort(chunk, offset + 4)];
+                break;
+            case OP_SWITCH_TABLE:
+            case OP_SWITCH_HASH:
+                decodeSwitch(code, instruction, offset, indexOf);
+                break;
+            default:
+                copyOperands(code, instruction, offset + 1, instructionLength(chunk, offset) - 1);
+                break;
+        }
+    }
+
+    FREE_ARRAY(int, indexOf, chunk->count + 1);
+    code->isTarget = ALLOCATE(bool, code->count + 1);
+}
+
+int resolveInstruction(Code *code, int index) {
+    while (index < code->count && code->instructions[index].isRemoved) index++;
+    return index;
+}
+
+int nextInstruction(Code *code, int index) {
+    return resolveInstruction(code, index + 1);
+}
+
+static bool isLive(Code *code, int index) {
+    return index < code->count && !code->instructions[index].isRemoved;
+}
+
+static Instruction *at(Code *code, int index) {
+    return &code->instructions[index];
+}
+
+void findJumpTargets(Code *code) {
+    for (int i = 0; i <= code->count; i++) {
+        code->isTarget[i] = false;
+    }
+
+    for (int i = 0; i < code->count; i++) {
+        Instruction *instruction = at(code, i);
+        if (instruction->isRemoved) continue;
+
+        if (instruction->target != NO_TARGET) {
+            code->isTarget[resolveInstruction(code, instruction->target)] = true;
+        }
+        for (int j = 0; j < instruction->targetCount; j++) {
+            int target = code->targets[instruction->targetStart + j];
+            if (target != EMPTY_ENTRY) code->isTarget[resolveInstruction(code, target)] = true;
+        }
+    }
+}
+
+void removeInstruction(Code *code, int index) {
+    at(code, index)->isRemoved = true;
+}
+
+bool instructionStackEffect(Code *code, Instruction *instruction, int *pops, int *pushes) {
+    *pops = 0;
+    *pushes = 0;
+
+    // The long local instructions are left unknown: slots past 255 aren't tracked.
+    switch (instruction->op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG:
+        case OP_CLASS:
+        case OP_CLASS_LONG:
+        case OP_IMPORT:
+        case OP_IMPORT_LONG:
+            *pushes = 1;
+            return true;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_PRINT:
+        case OP_SWITCH_TABLE:
+        case OP_SWITCH_HASH:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+        case OP_INHERIT:
+        case OP_METHOD:
+        case OP_METHOD_LONG:
+            *pops = 1;
+            return true;
+        case OP_SET_LOCAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:
+        case OP_SET_UPVALUE:
+        case OP_JUMP_IF_FALSE:
+        case OP_GET_PROPERTY:
+        case OP_GET_PROPERTY_LONG:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_CHECK_TYPE:
+            *pops = 1;
+            *pushes = 1;
+            return true;
+        case OP_SET_PROPERTY:
+        case OP_SET_PROPERTY_LONG:
+        case OP_GET_SUPER:
+        case OP_GET_SUPER_LONG:
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_GREATER_NUMBER:
+        case OP_GREATER_EQUAL_NUMBER:
+        case OP_LESS_NUMBER:
+        case OP_LESS_EQUAL_NUMBER:
+        case OP_ADD_NUMBER:
+        case OP_SUBTRACT_NUMBER:
+        case OP_MULTIPLY_NUMBER:
+        case OP_DIVIDE_NUMBER:
+            *pops = 2;
+            *pushes = 1;
+            return true;
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_FOR_PREP:
+        case OP_FOR_LOOP:
+            return true;
+        case OP_CALL:
+        case OP_CALL_DIRECT:
+            *pops = instructionOperand(code, instruction, 0) + 1;
+            *pushes = 1;
+            return true;
+        case OP_CONCAT:
+        case OP_INTERPOLATE:
+            *pops = instructionOperand(code, instruction, 0);
+            *pushes = 1;
+            return true;
+        case OP_INVOKE:
+        case OP_INVOKE_DIRECT:
+            *pops = instructionOperand(code, instruction, 1) + 1;
+            *pushes = 1;
+            return true;
+        case OP_SUPER_INVOKE:
+            *pops = instructionOperand(code, instruction, 1) + 2;
+            *pushes = 1;
+            return true;
+        case OP_INVOKE_LONG:
+            *pops = instructionOperand(code, instruction, 3) + 1;
+            *pushes = 1;
+            return true;
+        case OP_SUPER_INVOKE_LONG:
+            *pops = instructionOperand(code, instruction, 3) + 2;
+            *pushes = 1;
+            return true;
+        default:
+            return false;
+    }
+}
+
+Instruction *insertInstruction(Code *code, int index, uint8_t op, int line, bool isJumpedOver) {
+    addInstruction(code, op, line);
+    Instruction inserted = code->instructions[code->count - 1];
+    memmove(&code->instructions[index + 1], &code->instructions[index],
+            sizeof(Instruction) * (code->count - 1 - index));
+    code->instructions[index] = inserted;
+
+    // Jumps to the insertion point either land on the new instruction or keep
+    // landing on the one it was inserted before.
+    int first = isJumpedOver ? index : index + 1;
+    for (int i = 0; i < code->count; i++) {
+        Instruction *instruction = at(code, i);
+        if (instruction->target >= first) instruction->target++;
+    }
+    for (int i = 0; i < code->targetCount; i++) {
+        if (code->targets[i] >= first) code->targets[i]++;
+    }
+
+    FREE_ARRAY(bool, code->isTarget, code->count);
+    code->isTarget = ALLOCATE(bool, code->count + 1);
+    return &code->instructions[index];
+}
+
+static bool constantValue(Code *code, int index, Value *value) {
+    if (!isLive(code, index)) return false;
+
+    Instruction *instruction = at(code, index);
+    switch (instruction->op) {
+        case OP_CONSTANT:
+            *value = code->chunk->constants.values[instructionOperand(code, instruction, 0)];
+            return true;
+        case OP_CONSTANT_LONG:
+            *value = code->chunk->constants.values[longOperand(code, instruction)];
+            return true;
+        case OP_NIL:
+            *value = NIL_VAL;
+            return true;
+        case OP_TRUE:
+            *value = BOOL_VAL(true);
+            return true;
+        case OP_FALSE:
+            *value = BOOL_VAL(false);
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool setConstant(Code *code, int index, Value value) {
+    Instruction *instruction = at(code, index);
+
+    if (IS_NIL(value)) {
+        instruction->op = OP_NIL;
+        instruction->operandCount = 0;
+    } else if (IS_BOOL(value)) {
+        instruction->op = AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+        instruction->operandCount = 0;
+    } else {
+        int constant = addConstant(code->chunk, value);
+        if (constant > UINT24_MAX) return false;
+
+        if (constant <= UINT8_MAX) {
+            instruction->op = OP_CONSTANT;
+            instruction->operandStart = addCodeOperand(code, (uint8_t) constant);
+            instruction->operandCount = 1;
+            return true;
+        }
+
+        instruction->op = OP_CONSTANT_LONG;
+        instruction->operandStart = addCodeOperand(code, (constant >> 16) & 0xFF);
+        addCodeOperand(code, (constant >> 8) & 0xFF);
+        addCodeOperand(code, constant & 0xFF);
+        instruction->operandCount = 3;
+    }
+
+    return true;
+}
+
+static bool isFalsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static bool foldUnary(uint8_t op, Value a, Value *result) {
+    switch (op) {
+        case OP_NOT:
+            *result = BOOL_VAL(isFalsey(a));
+            return true;
+        case OP_NEGATE:
+            if (!IS_NUMBER(a)) return false;
+            *result = NUMBER_VAL(-AS_NUMBER(a));
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool foldBinary(uint8_t op, Value a, Value b, Value *result) {
+    if (op == OP_EQUAL || op == OP_NOT_EQUAL) {
+        *result = BOOL_VAL(valuesEqual(a, b) == (op == OP_EQUAL));
+        return true;
+    }
+
+    if (op == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+        ObjString *left = AS_STRING(a);
+        ObjString *right = AS_STRING(b);
+        int length = left->length + right->length;
+        char *chars = ALLOCATE(char, length + 1);
+        memcpy(chars, left->chars, left->length);
+        memcpy(chars + left->length, right->chars, right->length);
+        chars[length] = '\0';
+        *result = OBJ_VAL(takeString(chars, length));
+        return true;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+
+    double left = AS_NUMBER(a);
+    double right = AS_NUMBER(b);
+    switch (op) {
+        case OP_ADD:
+        case OP_ADD_NUMBER:
+            *result = NUMBER_VAL(left + right);
+            return true;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUMBER:
+            *result = NUMBER_VAL(left - right);
+            return true;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUMBER:
+            *result = NUMBER_VAL(left * right);
+            return true;
+        case OP_DIVIDE:
+        case OP_DIVIDE_NUMBER:
+            *result = NUMBER_VAL(left / right);
+            return true;
+        case OP_GREATER:
+        case OP_GREATER_NUMBER:
+            *result = BOOL_VAL(left > right);
+            return true;
+        case OP_GREATER_EQUAL:
+        case OP_GREATER_EQUAL_NUMBER:
+            *result = BOOL_VAL(!(left < right));
+            return true;
+        case OP_LESS:
+        case OP_LESS_NUMBER:
+            *result = BOOL_VAL(left < right);
+            return true;
+        case OP_LESS_EQUAL:
+        case OP_LESS_EQUAL_NUMBER:
+            *result = BOOL_VAL(!(left > right));
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Folds an OP_CONCAT or OP_INTERPOLATE whose pieces are all known the way the VM would run it.
+static bool foldJoin(uint8_t op, Value *pieces, int count, Value *result) {
+    if (op != OP_CONCAT && op != OP_INTERPOLATE) return false;
+
+    bool isStrings = true;
+    bool isNumbers = true;
+    for (int i = 0; i < count; i++) {
+        isStrings = isStrings && IS_STRING(pieces[i]);
+        isNumbers = isNumbers && IS_NUMBER(pieces[i]);
+    }
+
+    if (op == OP_INTERPOLATE || isStrings) {
+        *result = OBJ_VAL(joinValues(pieces, count));
+        return true;
+    }
+    if (!isNumbers) return false;
+
+    double sum = AS_NUMBER(pieces[0]);
+    for (int i = 1; i < count; i++) {
+        sum += AS_NUMBER(pieces[i]);
+    }
+    *result = NUMBER_VAL(sum);
+    return true;
+}
+
+// Evaluates straight-line code made only of literals and operators the folder understands onto the stack. Intermediate
+// strings are rooted while later operators allocate, and stay rooted until the caller pops them.
+static bool evaluateRange(Chunk *chunk, int start, int end, Value *stack, int *depth, int capacity, int *rooted) {
+    for (int offset = start; offset < end; offset += instructionLength(chunk, offset)) {
+        uint8_t *code = &chunk->code[offset];
+        Value value;
+        switch (code[0]) {
+            case OP_CONSTANT:
+                value = chunk->constants.values[code[1]];
+                break;
+            case OP_CONSTANT_LONG:
+                value = chunk->constants.values[(code[1] << 16) | (code[2] << 8) | code[3]];
+                break;
+            case OP_NIL:
+                value = NIL_VAL;
+                break;
+            case OP_TRUE:
+                value = BOOL_VAL(true);
+                break;
+            case OP_FALSE:
+                value = BOOL_VAL(false);
+                break;
+            case OP_CONCAT:
+            case OP_INTERPOLATE:
+                if (*depth < code[1] || !foldJoin(code[0], &stack[*depth - code[1]], code[1], &value)) return false;
+                *depth -= code[1];
+                pushRoot(value);
+                (*rooted)++;
+                break;
+            default:
+                if (*depth >= 1 && foldUnary(code[0], stack[*depth - 1], &value)) {
+                    (*depth)--;
+                } else if (*depth >= 2 && foldBinary(code[0], stack[*depth - 2], stack[*depth - 1], &value)) {
+                    *depth -= 2;
+                    pushRoot(value);
+                    (*rooted)++;
+                } else {
+                    return false;
+                }
+                break;
+        }
+
+        if (*depth == capacity) return false;
+        stack[(*depth)++] = value;
+    }
+    return true;
+}
+
+// Evaluates the code of a constant's initializer.
+bool evaluateConstant(Chunk *chunk, int start, int end, Value *result) {
+    Value stack[MAX_CONSTANT_DEPTH];
+    int depth = 0;
+    int rooted = 0;
+    bool isConstant = evaluateRange(chunk, start, end, stack, &depth, MAX_CONSTANT_DEPTH, &rooted) && depth == 1;
+
+    for (int i = 0; i < rooted; i++) {
+        popRoot();
+    }
+    if (!isConstant) return false;
+    *result = stack[0];
+    return true;
+}
+
+typedef struct {
+    ObjFunction *function;
+    uint8_t *ip;
+    int slots;
+} EvaluationFrame;
+
+// Runs a call to a finished function on its own stack, giving up on the first instruction that could touch anything
+// outside it, such as a global, an upvalue, an object or output, or that would raise an error. What is left is a pure
+// computation, which is cut off once it runs past the budget.
+static bool evaluateFrames(EvaluationFrame *frames, Value *stack, int depth, int *rooted, Value *result) {
+    int frameCount = 1;
+    EvaluationFrame *frame = &frames[0];
+
+    for (int steps = 0; steps < MAX_EVALUATION_STEPS; steps++) {
+        // No instruction pushes more than one value, so a full stack leaves the call to run at runtime.
+        if (depth == MAX_EVALUATION_STACK) return false;
+
+        uint8_t *ip = frame->ip;
+        Value *slots = &stack[frame->slots];
+        Value *constants = frame->function->chunk.constants.values;
+        frame->ip += instructionLength(&frame->function->chunk, (int) (ip - frame->function->chunk.code));
+
+        Value value;
+        switch (ip[0]) {
+            case OP_CONSTANT: stack[depth++] = constants[ip[1]]; break;
+            case OP_CONSTANT_LONG: stack[depth++] = constants[(ip[1] << 16) | (ip[2] << 8) | ip[3]]; break;
+            case OP_NIL: stack[depth++] = NIL_VAL; break;
+            case OP_TRUE: stack[depth++] = BOOL_VAL(true); break;
+            case OP_FALSE: stack[depth++] = BOOL_VAL(false); break;
+            case OP_POP: depth--; break;
+            case OP_GET_LOCAL: stack[depth++] = slots[ip[1]]; break;
+            case OP_GET_LOCAL_LONG: stack[depth++] = slots[(ip[1] << 8) | ip[2]]; break;
+            case OP_SET_LOCAL: slots[ip[1]] = stack[depth - 1]; break;
+            case OP_SET_LOCAL_LONG: slots[(ip[1] << 8) | ip[2]] = stack[depth - 1]; break;
+            case OP_NOT:
+            case OP_NEGATE:
+                if (!foldUnary(ip[0], stack[depth - 1], &stack[depth - 1])) return false;
+                break;
+            case OP_EQUAL:
+            case OP_NOT_EQUAL:
+            case OP_GREATER:
+            case OP_GREATER_EQUAL:
+            case OP_LESS:
+            case OP_LESS_EQUAL:
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_GREATER_NUMBER:
+            case OP_GREATER_EQUAL_NUMBER:
+            case OP_LESS_NUMBER:
+            case OP_LESS_EQUAL_NUMBER:
+            case OP_ADD_NUMBER:
+            case OP_SUBTRACT_NUMBER:
+            case OP_MULTIPLY_NUMBER:
+            case OP_DIVIDE_NUMBER:
+                if (!foldBinary(ip[0], stack[depth - 2], stack[depth - 1], &value)) return false;
+                if (IS_OBJ(value)) {
+                    if (*rooted == MAX_EVALUATION_ROOTS) return false;
+                    pushRoot(value);
+                    (*rooted)++;
+                }
+                stack[--depth - 1] = value;
+                break;
+            case OP_CONCAT:
+            case OP_INTERPOLATE:
+                if (*rooted == MAX_EVALUATION_ROOTS || !foldJoin(ip[0], &stack[depth - ip[1]], ip[1], &value)) return false;
+                pushRoot(value);
+                (*rooted)++;
+                depth -= ip[1];
+                stack[depth++] = value;
+                break;
+            case OP_CHECK_TYPE:
+                value = stack[depth - 1];
+                if ((ip[1] == KIND_NUMBER && !IS_NUMBER(value)) || (ip[1] == KIND_STRING && !IS_STRING(value)) ||
+                    (ip[1] == KIND_BOOL && !IS_BOOL(value))) {
+                    return false;
+                }
+                break;
+            case OP_JUMP: frame->ip += (ip[1] << 8) | ip[2]; break;
+            case OP_JUMP_LONG: frame->ip += (ip[1] << 16) | (ip[2] << 8) | ip[3]; break;
+            case OP_JUMP_IF_FALSE:
+                if (isFalsey(stack[depth - 1])) frame->ip += (ip[1] << 8) | ip[2];
+                break;
+            case OP_JUMP_IF_FALSE_LONG:
+                if (isFalsey(stack[depth - 1])) frame->ip += (ip[1] << 16) | (ip[2] << 8) | ip[3];
+                break;
+            case OP_LOOP: frame->ip -= (ip[1] << 8) | ip[2]; break;
+            case OP_LOOP_LONG: frame->ip -= (ip[1] << 16) | (ip[2] << 8) | ip[3]; break;
+            case OP_FOR_PREP:
+                if (!IS_NUMBER(slots[ip[1]]) || !IS_NUMBER(slots[ip[2]])) return false;
+                if (!(AS_NUMBER(slots[ip[1]]) < AS_NUMBER(slots[ip[2]]))) frame->ip += (ip[3] << 8) | ip[4];
+                break;
+            case OP_FOR_LOOP: {
+                double counter = AS_NUMBER(slots[ip[1]]) + AS_NUMBER(constants[ip[3]]);
+                slots[ip[1]] = NUMBER_VAL(counter);
+                if (counter < AS_NUMBER(slots[ip[2]])) frame->ip -= (ip[4] << 8) | ip[5];
+                break;
+            }
+            case OP_CALL_DIRECT: {
+                ObjFunction *callee = AS_FUNCTION(stack[depth - ip[1] - 1]);
+                if (!callee->chunk.isFrozen || frameCount == MAX_EVALUATION_FRAMES ||
+                    depth + callee->slotCount > MAX_EVALUATION_STACK) {
+                    return false;
+                }
+                frame = &frames[frameCount++];
+                frame->function = callee;
+                frame->ip = callee->chunk.code;
+                frame->slots = depth - ip[1] - 1;
+                break;
+            }
+            case OP_RETURN:
+                value = stack[depth - 1];
+                depth = frame->slots;
+                if (--frameCount == 0) {
+                    *result = value;
+                    return true;
+                }
+                stack[depth++] = value;
+                frame = &frames[frameCount - 1];
+                break;
+            default:
+                return false;
+        }
+    }
+    return false;
+}
+
+// Evaluates a call to a finished function with the arguments compiled between start and end. Only a literal result is
+// given back, so no object the call creates can escape into the program apart from strings.
+bool evaluateCall(ObjFunction *function, Chunk *chunk, int start, int end, Value *result) {
+    Value stack[MAX_EVALUATION_STACK];
+    stack[0] = OBJ_VAL(function);
+    int depth = 1;
+    int rooted = 0;
+    EvaluationFrame frames[MAX_EVALUATION_FRAMES];
+    frames[0] = (EvaluationFrame) {function, function->chunk.code, 0};
+
+    bool isEvaluated = function->chunk.isFrozen && function->slotCount <= MAX_EVALUATION_STACK &&
+                       evaluateRange(chunk, start, end, stack, &depth, MAX_EVALUATION_STACK, &rooted) &&
+                       depth == function->arity + 1 && evaluateFrames(frames, stack, depth, &rooted, result) &&
+                       (!IS_OBJ(*result) || IS_STRING(*result));
+
+    for (int i = 0; i < rooted; i++) {
+        popRoot();
+    }
+    return isEvaluated;
+}
+
+// Replaces literal operands followed by an operator with the result, and
+// resolves branches and pops whose operand is a literal.
+static bool foldConstants(Code *code) {
+    bool changed = false;
+
+    for (int i = resolveInstruction(code, 0); i < code->count; i = nextInstruction(code, i)) {
+        Value a, b, result;
+        if (!constantValue(code, i, &a)) continue;
+
+        int j = nextInstruction(code, i);
+        if (j >= code->count || code->isTarget[j]) continue;
+        Instruction *second = at(code, j);
+
+        if (second->op == OP_POP) {
+            removeInstruction(code, i);
+            removeInstruction(code, j);
+            changed = true;
+        } else if (second->op == OP_JUMP_IF_FALSE) {
+            if (isFalsey(a)) {
+                second->op = OP_JUMP;
+            } else {
+                removeInstruction(code, j);
+            }
+            changed = true;
+        } else if (foldUnary(second->op, a, &result)) {
+            if (setConstant(code, i, result)) {
+                removeInstruction(code, j);
+                changed = true;
+            }
+        } else if (constantValue(code, j, &b)) {
+            int k = nextInstruction(code, j);
+            if (k >= code->count || code->isTarget[k]) continue;
+
+            if (foldBinary(at(code, k)->op, a, b, &result) && setConstant(code, i, result)) {
+                removeInstruction(code, j);
+                removeInstruction(code, k);
+                changed = true;
+            }
+        }
+    }
+
+    return changed;
+}
+
+// Replaces an OP_CONCAT or OP_INTERPOLATE whose pieces are all literals with the string it builds.
+static bool foldJoins(Code *code) {
+    bool changed = false;
+    Value pieces[UINT8_MAX];
+    int indexes[UINT8_MAX];
+    int count = 0;
+
+    for (int i = resolveInstruction(code, 0); i < code->count; i = nextInstruction(code, i)) {
+        if (code->isTarget[i]) count = 0;
+
+        Instruction *instruction = at(code, i);
+        if (count < UINT8_MAX && constantValue(code, i, &pieces[count])) {
+            indexes[count++] = i;
+            continue;
+        }
+
+        Value result;
+        int pieceCount = instruction->op == OP_CONCAT || instruction->op == OP_INTERPOLATE ? instructionOperand(code, instruction, 0) : 0;
+        int first = count - pieceCount;
+        if (pieceCount > 0 && first >= 0 && foldJoin(instruction->op, &pieces[first], pieceCount, &result)) {
+            pushRoot(result);
+            if (setConstant(code, indexes[first], result)) {
+                for (int j = first + 1; j < count; j++) {
+                    removeInstruction(code, indexes[j]);
+                }
+                removeInstruction(code, i);
+                changed = true;
+            }
+            popRoot();
+        }
+        count = 0;
+    }
+
+    return changed;
+}
+
+static int negatedComparison(uint8_t op) {
+    switch (op) {
+        case OP_EQUAL:
+            return OP_NOT_EQUAL;
+        case OP_NOT_EQUAL:
+            return OP_EQUAL;
+        case OP_GREATER:
+            return OP_LESS_EQUAL;
+        case OP_GREATER_EQUAL:
+            return OP_LESS;
+        case OP_LESS:
+            return OP_GREATER_EQUAL;
+        case OP_LESS_EQUAL:
+            return OP_GREATER;
+        default:
+            return -1;
+    }
+}
+
+static bool producesBool(uint8_t op) {
+    return negatedComparison(op) != -1 || op == OP_NOT || op == OP_TRUE || op == OP_FALSE;
+}
+
+// Merges a comparison with a following OP_NOT, and drops OP_NOT pairs
+// applied to a value that is already a Boolean.
+static bool simplifyNegations(Code *code) {
+    bool changed = false;
+
+    for (int i = resolveInstruction(code, 0); i < code->count; i = nextInstruction(code, i)) {
+        Instruction *instruction = at(code, i);
+        int j = nextInstruction(code, i);
+        if (j >= code->count || code->isTarget[j] || at(code, j)->op != OP_NOT) continue;
+
+        int negated = negatedComparison(instruction->op);
+        if (negated != -1) {
+            instruction->op = (uint8_t) negated;
+            removeInstruction(code, j);
+            changed = true;
+            continue;
+        }
+
+        int k = nextInstruction(code, j);
+        if (producesBool(instruction->op) && k < code->count && !code->isTarget[k] && at(code, k)->op == OP_NOT) {
+            removeInstruction(code, j);
+            removeInstruction(code, k);
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+static bool isUnconditionalJump(uint8_t op) {
+    return op == OP_JUMP || op == OP_LOOP;
+}
+
+// Points jumps that land on other jumps straight at the final destination.
+static bool threadJumps(Code *code) {
+    bool changed = false;
+
+    for (int i = resolveInstruction(code, 0); i < code->count; i = nextInstruction(code, i)) {
+        Instruction *instruction = at(code, i);
+        if (instruction->op != OP_JUMP && instruction->op != OP_LOOP && instruction->op != OP_JUMP_IF_FALSE) continue;
+
+        int target = resolveInstruction(code, instruction->target);
+        for (int hops = 0; hops < MAX_JUMP_HOPS && target < code->count; hops++) {
+            Instruction *landing = at(code, target);
+            bool follows = isUnconditionalJump(landing->op) ||
+                           (instruction->op == OP_JUMP_IF_FALSE && landing->op == OP_JUMP_IF_FALSE);
+            if (!follows) break;
+
+            int destination = resolveInstruction(code, landing->target);
+            // Conditional jumps can only go forwards.
+            if (instruction->op == OP_JUMP_IF_FALSE && destination <= i) break;
+            if (destination == target) break;
+            target = destination;
+        }
+
+        if (target != instruction->target) {
+            instruction->target = target;
+            changed = true;
+        }
+
+        // A jump to the next instruction does nothing.
+        if (target == nextInstruction(code, i)) {
+            removeInstruction(code, i);
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+bool instructionEndsBlock(uint8_t op) {
+    switch (op) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_FOR_PREP:
+        case OP_FOR_LOOP:
+        case OP_SWITCH_TABLE:
+        case OP_SWITCH_HASH:
+        case OP_RETURN:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool instructionFallsThrough(uint8_t op) {
+    switch (op) {
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_RETURN:
+        case OP_SWITCH_TABLE:
+        case OP_SWITCH_HASH:
+            return false;
+        default:
+            return true;
+    }
+}
+
+// Removes every instruction that can't be reached from the start of the chunk.
+static bool removeDeadCode(Code *code) {
+    bool *isReachable = ALLOCATE(bool, code->count + 1);
+    int *worklist = ALLOCATE(int, code->count + 1);
+    for (int i = 0; i <= code->count; i++) {
+        isReachable[i] = false;
+    }
+
+    int pending = 0;
+    worklist[pending++] = resolveInstruction(code, 0);
+    isReachable[worklist[0]] = true;
+
+    while (pending > 0) {
+        int index = worklist[--pending];
+        if (index >= code->count) continue;
+
+        Instruction *instruction = at(code, index);
+        int successors[2] = {-1, -1};
+        if (instructionFallsThrough(instruction->op)) successors[0] = nextInstruction(code, index);
+        if (instruction->target != NO_TARGET) successors[1] = resolveInstruction(code, instruction->target);
+
+        for (int i = 0; i < 2; i++) {
+            if (successors[i] != -1 && !isReachable[successors[i]]) {
+                isReachable[successors[i]] = true;
+                worklist[pending++] = successors[i];
+            }
+        }
+
+        for (int i = 0; i < instruction->targetCount; i++) {
+            int target = code->targets[instruction->targetStart + i];
+            if (target == EMPTY_ENTRY) continue;
+
+            target = resolveInstruction(code, target);
+            if (!isReachable[target]) {
+                isReachable[target] = true;
+                worklist[pending++] = target;
+            }
+        }
+    }
+
+    bool changed = false;
+    for (int i = 0; i < code->count; i++) {
+        if (!at(code, i)->isRemoved && !isReachable[i]) {
+            removeInstruction(code, i);
+            changed = true;
+        }
+    }
+
+    FREE_ARRAY(bool, isReachable, code->count + 1);
+    FREE_ARRAY(int, worklist, code->count + 1);
+    return changed;
+}
+
+static int encodedLength(Instruction *instruction, bool isLong) {
+    switch (instruction->op) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+            return isLong ? 4 : 3;
+        case OP_FOR_PREP:
+            return 5;
+        case OP_FOR_LOOP:
+            return 6;
+        case OP_SWITCH_TABLE:
+            return 6 + (instruction->targetCount - 1) * 2;
+        case OP_SWITCH_HASH:
+            return 5 + (instruction->targetCount - 1) * 3;
+        default:
+            return 1 + instruction->operandCount;
+    }
+}
+
+static void writeShort(Chunk *chunk, int value, int line) {
+    writeChunk(chunk, (value >> 8) & 0xFF, line);
+    writeChunk(chunk, value & 0xFF, line);
+}
+
+static void writeLong(Chunk *chunk, int value, int line) {
+    writeChunk(chunk, (value >> 16) & 0xFF, line);
+    writeShort(chunk, value, line);
+}
+
+static bool isJump(uint8_t op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP;
+}
+
+static void layoutCode(Code *code, int *offsets, bool *isLong) {
+    int offset = 0;
+    for (int i = 0; i < code->count; i++) {
+        offsets[i] = offset;
+        if (!at(code, i)->isRemoved) offset += encodedLength(at(code, i), isLong[i]);
+    }
+    offsets[code->count] = offset;
+}
+
+static int switchDistance(int start, int end, int target) {
+    return target == end ? 0 : start - target;
+}
+
+void encodeChunk(Code *code) {
+    Chunk *chunk = code->chunk;
+    int *offsets = ALLOCATE(int, code->count + 1);
+    bool *isLong = ALLOCATE(bool, code->count + 1);
+    for (int i = 0; i <= code->count; i++) {
+        isLong[i] = false;
+    }
+
+    // Widening a jump only ever pushes other targets further away, so repeat
+    // until every short jump still reaches.
+    bool isSettled = false;
+    while (!isSettled) {
+        layoutCode(code, offsets, isLong);
+        isSettled = true;
+        for (int i = 0; i < code->count; i++) {
+            Instruction *instruction = at(code, i);
+            if (instruction->isRemoved || !isJump(instruction->op) || isLong[i]) continue;
+
+            int distance = offsets[instruction->target] - (offsets[i] + 3);
+            if (distance > UINT16_MAX || -distance > UINT16_MAX) {
+                isLong[i] = true;
+                isSettled = false;
+            }
+        }
+    }
+
+    truncateChunk(chunk, 0);
+    for (int i = 0; i < code->count; i++) {
+        Instruction *instruction = at(code, i);
+        if (instruction->isRemoved) continue;
+
+        int line = instruction->line;
+        int start = offsets[i];
+        int end = start + encodedLength(instruction, isLong[i]);
+        int target = instruction->target != NO_TARGET ? offsets[instruction->target] : 0;
+
+        switch (instruction->op) {
+            case OP_JUMP:
+            case OP_LOOP:
+                if (isLong[i]) {
+                    writeChunk(chunk, target >= end ? OP_JUMP_LONG : OP_LOOP_LONG, line);
+                    writeLong(chunk, target >= end ? target - end : end - target, line);
+                } else {
+                    writeChunk(chunk, target >= end ? OP_JUMP : OP_LOOP, line);
+                    writeShort(chunk, target >= end ? target - end : end - target, line);
+                }
+                break;
+            case OP_JUMP_IF_FALSE:
+                if (isLong[i]) {
+                    writeChunk(chunk, OP_JUMP_IF_FALSE_LONG, line);
+                    writeLong(chunk, target - end, line);
+                } else {
+                    writeChunk(chunk, instruction->op, line);
+                    writeShort(chunk, target - end, line);
+                }
+                break;
+            case OP_FOR_PREP:
+                writeChunk(chunk, instruction->op, line);
+                for (int j = 0; j < instruction->operandCount; j++) {
+                    writeChunk(chunk, instructionOperand(code, instruction, j), line);
+                }
+                writeShort(chunk, target - end, line);
+                break;
+            case OP_FOR_LOOP:
+                writeChunk(chunk, instruction->op, line);
+                for (int j = 0; j < instruction->operandCount; j++) {
+                    writeChunk(chunk, instructionOperand(code, instruction, j), line);
+                }
+                writeShort(chunk, end - target, line);
+                break;
+            case OP_SWITCH_TABLE:
+            case OP_SWITCH_HASH: {
+                int *targets = &code->targets[instruction->targetStart];
+                int fallback = switchDistance(start, end, offsets[targets[0]]);
+
+                writeChunk(chunk, instruction->op, line);
+                writeChunk(chunk, instructionOperand(code, instruction, 0), line);
+                writeChunk(chunk, instructionOperand(code, instruction, 1), line);
+                if (instruction->op == OP_SWITCH_TABLE) writeChunk(chunk, instructionOperand(code, instruction, 2), line);
+                writeShort(chunk, fallback, line);
+
+                for (int j = 1; j < instruction->targetCount; j++) {
+                    int distance = targets[j] == EMPTY_ENTRY ? 0 : switchDistance(start, end, offsets[targets[j]]);
+                    if (instruction->op == OP_SWITCH_HASH) writeChunk(chunk, instructionOperand(code, instruction, j + 1), line);
+                    writeShort(chunk, distance, line);
+                }
+                break;
+            }
+            default:
+                writeChunk(chunk, instruction->op, line);
+                for (int j = 0; j < instruction->operandCount; j++) {
+                    writeChunk(chunk, instructionOperand(code, instruction, j), line);
+                }
+                break;
+        }
+    }
+
+    FREE_ARRAY(int, offsets, code->count + 1);
+    FREE_ARRAY(bool, isLong, code->count + 1);
+}
+
+void relaxChunk(Chunk *chunk, int *farJumps, int count) {
+    Code code;
+    initCode(&code, chunk);
+    int *indexOf = indexInstructions(chunk, true);
+    decodeChunk(&code);
+
+    // The recorded jumps hold a placeholder distance, so point them at their real targets.
+    bool *isFar = ALLOCATE(bool, code.count);
+    for (int i = 0; i < code.count; i++) {
+        isFar[i] = false;
+    }
+    for (int i = 0; i < count; i += 2) {
+        int index = indexOf[farJumps[i]];
+        at(&code, index)->target = indexOf[farJumps[i + 1]];
+        isFar[index] = true;
+    }
+    FREE_ARRAY(int, indexOf, chunk->count + 1);
+
+    // OP_FOR_PREP can't be widened, so a far one leaves through a jump that can.
+    int originalCount = code.count;
+    for (int i = originalCount - 1; i >= 0; i--) {
+        if (!isFar[i] || at(&code, i)->op != OP_FOR_PREP) continue;
+
+        int line = at(&code, i)->line;
+        Instruction *exit = insertInstruction(&code, i + 1, OP_JUMP, line, true);
+        exit->target = at(&code, i)->target;
+        Instruction *body = insertInstruction(&code, i + 1, OP_JUMP, line, true);
+        body->target = i + 3;
+        at(&code, i)->target = i + 2;
+    }
+    FREE_ARRAY(bool, isFar, originalCount);
+
+    encodeChunk(&code);
+    freeCode(&code);
+}
+
+static bool simplify(Code *code) {
+    bool changed = false;
+
+    for (int pass = 0; pass < MAX_PASSES; pass++) {
+        bool passChanged = false;
+
+        findJumpTargets(code);
+        passChanged |= foldConstants(code);
+        findJumpTargets(code);
+        passChanged |= foldJoins(code);
+        findJumpTargets(code);
+        passChanged |= simplifyNegations(code);
+        passChanged |= threadJumps(code);
+        passChanged |= removeDeadCode(code);
+
+        if (!passChanged) break;
+        changed = true;
+    }
+
+    return changed;
+}
+
+void optimizeFunction(ObjFunction *function, int level) {
+    if (level < 1) return;
+
+    Code code;
+    initCode(&code, &function->chunk);
+    decodeChunk(&code);
+
+    simplify(&code);
+    if (level >= 2) {
+        for (int round = 0; round < MAX_SSA_ROUNDS; round++) {
+            if (!optimizeSsa(&code, function->arity)) break;
+            simplify(&code);
+        }
+    }
+
+    encodeChunk(&code);
+    freeCode(&code);
+}
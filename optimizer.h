@@ -0,0 +1,75 @@
+//
+// Created by Mic Pringle on 19/10/2026.
+//
+
+#ifndef CLOX_OPTIMIZER_H
+#define CLOX_OPTIMIZER_H
+
+#include "chunk.h"
+#include "object.h"
+
+#define NO_TARGET (-1)
+#define EMPTY_ENTRY (-2)
+
+typedef struct {
+    uint8_t op;
+    int line;
+    int operandStart;
+    int operandCount;
+    int target;
+    int targetStart;
+    int targetCount;
+    bool isRemoved;
+} Instruction;
+
+typedef struct {
+    Chunk *chunk;
+    Instruction *instructions;
+    int count;
+    int capacity;
+    uint8_t *operands;
+    int operandCount;
+    int operandCapacity;
+    int *targets;
+    int targetCount;
+    int targetCapacity;
+    bool *isTarget;
+} Code;
+
+void initCode(Code *code, Chunk *chunk);
+
+void freeCode(Code *code);
+
+void decodeChunk(Code *code);
+
+void encodeChunk(Code *code);
+
+void relaxChunk(Chunk *chunk, int *farJumps, int count);
+
+int addCodeOperand(Code *code, uint8_t operand);
+
+uint8_t instructionOperand(Code *code, Instruction *instruction, int index);
+
+int resolveInstruction(Code *code, int index);
+
+int nextInstruction(Code *code, int index);
+
+bool instructionEndsBlock(uint8_t op);
+
+bool instructionFallsThrough(uint8_t op);
+
+void findJumpTargets(Code *code);
+
+void removeInstruction(Code *code, int index);
+
+Instruction *insertInstruction(Code *code, int index, uint8_t op, int line, bool isJumpedOver);
+
+bool instructionStackEffect(Code *code, Instruction *instruction, int *pops, int *pushes);
+
+bool evaluateConstant(Chunk *chunk, int start, int end, Value *result);
+
+bool evaluateCall(ObjFunction *function, Chunk *chunk, int start, int end, Value *result);
+
+void optimizeFunction(ObjFunction *function, int level);
+
+#endif
@@ -0,0 +1,83 @@
+//
+// Created by Mic Pringle on 19/10/2026.
+//
+
+#ifndef CLOX_RUNTIME_H
+#define CLOX_RUNTIME_H
+
+#include <stdio.h>
+
+#include "vm.h"
+
+// What the C written by --emit-c is built from. Stack, local and number operations are spelled out in place, and
+// everything else calls the same operations the interpreter runs.
+
+#define PUSH(value) (*vm.stackTop++ = (value))
+#define POP() (*--vm.stackTop)
+#define PEEK(distance) (vm.stackTop[-1 - (distance)])
+#define IS_FALSEY(value) (IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)))
+
+// Points the frame just past the instruction being run, as the interpreter would, for runtime errors and stack traces.
+#define AT(offset) (frame->ip = code + (offset))
+
+#define NUMBER_OP(valueType, op)                                                    \
+do {                                                                                \
+    double b = AS_NUMBER(POP());                                                    \
+    PEEK(0) = valueType(AS_NUMBER(PEEK(0)) op b);                                   \
+} while (false)
+
+#define CHECKED_OP(valueType, op)                                                   \
+do {                                                                                \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {                               \
+        return opError("Operands must be numbers.");                                \
+    }                                                                               \
+    NUMBER_OP(valueType, op);                                                       \
+} while (false)
+
+#define NOT_BOOL_VAL(b) BOOL_VAL(!(b))
+
+bool opError(const char *message);
+
+bool opGetGlobal(ObjString *name);
+
+void opDefineGlobal(ObjString *name);
+
+bool opSetGlobal(ObjString *name);
+
+bool opGetProperty(ObjString *name);
+
+bool opSetProperty(ObjString *name);
+
+bool opGetSuper(ObjString *name);
+
+bool opAdd();
+
+bool opConcat(int count);
+
+void opInterpolate(int count);
+
+bool opCheckType(TypeKind kind);
+
+bool opInherit();
+
+void opMethod(ObjString *name);
+
+void opClosure(ObjFunction *function, const uint8_t *captures);
+
+void opCloseUpvalue();
+
+bool opCall(int argCount);
+
+bool opCallDirect(int argCount);
+
+bool opInvoke(ObjString *name, int argCount);
+
+bool opInvokeDirect(ObjFunction *method, int argCount);
+
+bool opSuperInvoke(ObjString *name, int argCount);
+
+bool opImport(ObjString *path);
+
+bool opReturn();
+
+#endif
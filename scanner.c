@@ -5,21 +5,21 @@
 #include <stdio.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "common.h"
 #include "scanner.h"
 
-typedef struct {
-    const char *start;
-    const char *current;
-    int line;
-} Scanner;
-
-Scanner scanner;
-
-void initScanner(const char *source) {
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+void initScanner(Scanner *scanner, const char *source) {
+    scanner->start = source;
+    scanner->current = source;
+    scanner->limit = source;
+    scanner->line = 1;
+    scanner->interpolationDepth = 0;
 }
 
 static bool isAlpha(char c) {
@@ -30,65 +30,191 @@ static bool isDigit(char c) {
     return c >= '0' && c <= '9';
 }
 
-static bool isAtEnd() {
-    return *scanner.current == '\0';
+static bool isAtEnd(Scanner *scanner) {
+    return *scanner->current == '\0';
 }
 
-static char advance() {
-    scanner.current++;
-    return scanner.current[-1];
+static char advance(Scanner *scanner) {
+    scanner->current++;
+    return scanner->current[-1];
 }
 
-static char peek() {
-    return *scanner.current;
+static char peek(Scanner *scanner) {
+    return *scanner->current;
 }
 
-static char peekNext() {
-    if (isAtEnd()) return '\0';
-    return scanner.current[1];
+static char peekNext(Scanner *scanner) {
+    if (isAtEnd(scanner)) return '\0';
+    return scanner->current[1];
 }
 
-static bool match(char expected) {
-    if (isAtEnd()) return false;
-    if (*scanner.current != expected) return false;
-    scanner.current++;
+static bool match(Scanner *scanner, char expected) {
+    if (isAtEnd(scanner)) return false;
+    if (*scanner->current != expected) return false;
+    scanner->current++;
     return true;
 }
 
-static Token makeToken(TokenType type) {
+// Runs of whitespace, comments, string contents, identifiers and digits are skipped a block of 16 bytes at a time
+// where the target has vector instructions. Each run then carries on in the scalar loop that scans it, which finishes
+// whatever is left, so both paths produce the same tokens and lines.
+typedef enum {
+    RUN_BLANKS,
+    RUN_COMMENT,
+    RUN_STRING,
+    RUN_IDENTIFIER,
+    RUN_DIGITS
+} RunKind;
+
+#if defined(__SSE2__) || defined(__ARM_NEON)
+
+#define BLOCK_SIZE 16
+#define SCAN_AHEAD 4096
+
+#if defined(__SSE2__)
+typedef __m128i Block;
+
+// One bit per byte.
+#define MASK_BITS 1
+#define FULL_MASK ((uint64_t) 0xFFFF)
+
+static inline Block loadBlock(const char *bytes) {
+    return _mm_loadu_si128((const __m128i *) bytes);
+}
+
+static inline Block matchByte(Block block, char c) {
+    return _mm_cmpeq_epi8(block, _mm_set1_epi8(c));
+}
+
+static inline Block matchRange(Block block, char low, char high) {
+    Block offset = _mm_sub_epi8(block, _mm_set1_epi8(low));
+    return _mm_cmpeq_epi8(_mm_subs_epu8(offset, _mm_set1_epi8((char) (high - low))), _mm_setzero_si128());
+}
+
+static inline Block either(Block a, Block b) {
+    return _mm_or_si128(a, b);
+}
+
+static inline uint64_t blockMask(Block block) {
+    return (uint64_t) _mm_movemask_epi8(block);
+}
+#else
+typedef uint8x16_t Block;
+
+// Four bits per byte, which is what narrowing a comparison leaves.
+#define MASK_BITS 4
+#define FULL_MASK (~(uint64_t) 0)
+
+static inline Block loadBlock(const char *bytes) {
+    return vld1q_u8((const uint8_t *) bytes);
+}
+
+static inline Block matchByte(Block block, char c) {
+    return vceqq_u8(block, vdupq_n_u8((uint8_t) c));
+}
+
+static inline Block matchRange(Block block, char low, char high) {
+    return vcleq_u8(vsubq_u8(block, vdupq_n_u8((uint8_t) low)), vdupq_n_u8((uint8_t) (high - low)));
+}
+
+static inline Block either(Block a, Block b) {
+    return vorrq_u8(a, b);
+}
+
+static inline uint64_t blockMask(Block block) {
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(block), 4)), 0);
+}
+#endif
+
+// The source is only known as a NUL-terminated string, so its end is looked for a stretch at a time.
+static bool hasBlock(Scanner *scanner) {
+    if (scanner->limit - scanner->current >= BLOCK_SIZE) return true;
+    const char *end = memchr(scanner->current, '\0', SCAN_AHEAD);
+    scanner->limit = end != NULL ? end : scanner->current + SCAN_AHEAD;
+    return scanner->limit - scanner->current >= BLOCK_SIZE;
+}
+
+static inline int countBefore(uint64_t mask, int length) {
+    if (length < BLOCK_SIZE) mask &= ((uint64_t) 1 << (length * MASK_BITS)) - 1;
+    return __builtin_popcountll(mask) / MASK_BITS;
+}
+
+static inline void skipRun(Scanner *scanner, RunKind kind) {
+    while (hasBlock(scanner)) {
+        Block block = loadBlock(scanner->current);
+        Block newlines = matchByte(block, '\n');
+        uint64_t stops;
+        switch (kind) {
+            case RUN_BLANKS:
+                stops = ~blockMask(either(either(matchByte(block, ' '), matchByte(block, '\t')),
+                                          either(matchByte(block, '\r'), newlines))) & FULL_MASK;
+                break;
+            case RUN_COMMENT:
+                stops = blockMask(newlines);
+                break;
+            case RUN_STRING:
+                stops = blockMask(either(matchByte(block, '"'), matchByte(block, '$')));
+                break;
+            case RUN_IDENTIFIER:
+                stops = ~blockMask(either(either(matchRange(block, 'a', 'z'), matchRange(block, 'A', 'Z')),
+                                          either(matchRange(block, '0', '9'), matchByte(block, '_')))) & FULL_MASK;
+                break;
+            case RUN_DIGITS:
+                stops = ~blockMask(matchRange(block, '0', '9')) & FULL_MASK;
+                break;
+        }
+
+        int length = stops == 0 ? BLOCK_SIZE : __builtin_ctzll(stops) / MASK_BITS;
+        if (kind == RUN_BLANKS || kind == RUN_STRING) scanner->line += countBefore(blockMask(newlines), length);
+        scanner->current += length;
+        if (stops != 0) return;
+    }
+}
+
+#else
+
+static inline void skipRun(Scanner *scanner, RunKind kind) {
+}
+
+#endif
+
+static Token makeToken(Scanner *scanner, TokenType type) {
     Token token;
     token.type = type;
-    token.start = scanner.start;
-    token.length = (int) (scanner.current - scanner.start);
-    token.line = scanner.line;
+    token.start = scanner->start;
+    token.length = (int) (scanner->current - scanner->start);
+    token.line = scanner->line;
     return token;
 }
 
-static Token errorToken(const char *message) {
+static Token errorToken(Scanner *scanner, const char *message) {
     Token token;
     token.type = TOKEN_ERROR;
     token.start = message;
     token.length = (int) strlen(message);
-    token.line = scanner.line;
+    token.line = scanner->line;
     return token;
 }
 
-static void skipWhitespace() {
+static void skipWhitespace(Scanner *scanner) {
     for (;;) {
-        char c = peek();
+        char c = peek(scanner);
         switch (c) {
             case ' ':
             case '\r':
             case '\t':
-                advance();
+                advance(scanner);
+                skipRun(scanner, RUN_BLANKS);
                 break;
             case '\n':
-                scanner.line++;
-                advance();
+                scanner->line++;
+                advance(scanner);
+                skipRun(scanner, RUN_BLANKS);
                 break;
             case '/':
-                if (peekNext() == '/') {
-                    while (peek() != '\n' && !isAtEnd()) advance();
+                if (peekNext(scanner) == '/') {
+                    skipRun(scanner, RUN_COMMENT);
+                    while (peek(scanner) != '\n' && !isAtEnd(scanner)) advance(scanner);
                 } else {
                     return;
                 }
@@ -99,138 +225,188 @@ static void skipWhitespace() {
     }
 }
 
-static TokenType checkKeyword(int start, int length, const char *rest, TokenType type) {
-    if (scanner.current - scanner.start == start + length &&
-        memcmp(scanner.start + start, rest, length) == 0) {
+static TokenType checkKeyword(Scanner *scanner, int start, int length, const char *rest, TokenType type) {
+    if (scanner->current - scanner->start == start + length &&
+        memcmp(scanner->start + start, rest, length) == 0) {
         return type;
     }
 
     return TOKEN_IDENTIFIER;
 }
 
-static TokenType identifierType() {
-    switch (scanner.start[0]) {
+static TokenType identifierType(Scanner *scanner) {
+    switch (scanner->start[0]) {
         case 'a':
-            return checkKeyword(1, 2, "nd", TOKEN_AND);
+            return checkKeyword(scanner, 1, 2, "nd", TOKEN_AND);
         case 'c':
-            return checkKeyword(1, 4, "lass", TOKEN_CLASS);
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
+                    case 'a':
+                        return checkKeyword(scanner, 2, 2, "se", TOKEN_CASE);
+                    case 'l':
+                        return checkKeyword(scanner, 2, 3, "ass", TOKEN_CLASS);
+                    case 'o':
+                        return checkKeyword(scanner, 2, 3, "nst", TOKEN_CONST);
+                }
+            }
+            break;
+        case 'd':
+            return checkKeyword(scanner, 1, 6, "efault", TOKEN_DEFAULT);
         case 'e':
-            return checkKeyword(1, 3, "lse", TOKEN_ELSE);
+            return checkKeyword(scanner, 1, 3, "lse", TOKEN_ELSE);
         case 'f':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
                     case 'a':
-                        return checkKeyword(2, 3, "lse", TOKEN_FALSE);
+                        return checkKeyword(scanner, 2, 3, "lse", TOKEN_FALSE);
                     case 'o':
-                        return checkKeyword(2, 1, "r", TOKEN_FOR);
+                        return checkKeyword(scanner, 2, 1, "r", TOKEN_FOR);
                     case 'u':
-                        return checkKeyword(2, 1, "n", TOKEN_FUN);
+                        return checkKeyword(scanner, 2, 1, "n", TOKEN_FUN);
                 }
             }
             break;
         case 'i':
-            return checkKeyword(1, 1, "f", TOKEN_IF);
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
+                    case 'f':
+                        return checkKeyword(scanner, 2, 0, "", TOKEN_IF);
+                    case 'm':
+                        return checkKeyword(scanner, 2, 4, "port", TOKEN_IMPORT);
+                }
+            }
+            break;
         case 'n':
-            return checkKeyword(1, 2, "il", TOKEN_NIL);
+            return checkKeyword(scanner, 1, 2, "il", TOKEN_NIL);
         case 'o':
-            return checkKeyword(1, 1, "r", TOKEN_OR);
+            return checkKeyword(scanner, 1, 1, "r", TOKEN_OR);
         case 'p':
-            return checkKeyword(1, 4, "rint", TOKEN_PRINT);
+            return checkKeyword(scanner, 1, 4, "rint", TOKEN_PRINT);
         case 'r':
-            return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
+            return checkKeyword(scanner, 1, 5, "eturn", TOKEN_RETURN);
         case 's':
-            return checkKeyword(1, 4, "uper", TOKEN_SUPER);
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
+                    case 'u':
+                        return checkKeyword(scanner, 2, 3, "per", TOKEN_SUPER);
+                    case 'w':
+                        return checkKeyword(scanner, 2, 4, "itch", TOKEN_SWITCH);
+                }
+            }
+            break;
         case 't':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
                     case 'h':
-                        return checkKeyword(2, 2, "is", TOKEN_THIS);
+                        return checkKeyword(scanner, 2, 2, "is", TOKEN_THIS);
                     case 'r':
-                        return checkKeyword(2, 2, "ue", TOKEN_TRUE);
+                        return checkKeyword(scanner, 2, 2, "ue", TOKEN_TRUE);
                 }
             }
             break;
         case 'v':
-            return checkKeyword(1, 2, "ar", TOKEN_VAR);
+            return checkKeyword(scanner, 1, 2, "ar", TOKEN_VAR);
         case 'w':
-            return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+            return checkKeyword(scanner, 1, 4, "hile", TOKEN_WHILE);
     }
 
     return TOKEN_IDENTIFIER;
 }
 
-static Token identifier() {
-    while (isAlpha(peek()) || isDigit(peek())) advance();
-    return makeToken(identifierType());
+static Token identifier(Scanner *scanner) {
+    skipRun(scanner, RUN_IDENTIFIER);
+    while (isAlpha(peek(scanner)) || isDigit(peek(scanner))) advance(scanner);
+    return makeToken(scanner, identifierType(scanner));
 }
 
-static Token number() {
-    while (isDigit(peek())) advance();
+static Token number(Scanner *scanner) {
+    skipRun(scanner, RUN_DIGITS);
+    while (isDigit(peek(scanner))) advance(scanner);
 
-    if (peek() == '.' && isDigit(peekNext())) {
-        advance();
-        while (isDigit(peek())) advance();
+    if (peek(scanner) == '.' && isDigit(peekNext(scanner))) {
+        advance(scanner);
+        skipRun(scanner, RUN_DIGITS);
+        while (isDigit(peek(scanner))) advance(scanner);
     }
 
-    return makeToken(TOKEN_NUMBER);
+    return makeToken(scanner, TOKEN_NUMBER);
 }
 
-static Token string() {
-    while (peek() != '"' && !isAtEnd()) {
-        if (peek() == '\n') scanner.line++;
-        advance();
+// Scans up to the end of a string, or up to the start of an interpolated expression, which the scanner returns to
+// once the brace closing it is reached.
+static Token string(Scanner *scanner) {
+    skipRun(scanner, RUN_STRING);
+    while (peek(scanner) != '"' && !isAtEnd(scanner)) {
+        if (peek(scanner) == '$' && peekNext(scanner) == '{') {
+            // Too deep a nesting is still counted, so its closing braces end the strings they belong to.
+            advance(scanner);
+            advance(scanner);
+            if (++scanner->interpolationDepth > MAX_INTERPOLATION_DEPTH) {
+                return errorToken(scanner, "Can't nest interpolations more than 8 deep.");
+            }
+            return makeToken(scanner, TOKEN_INTERPOLATION);
+        }
+        if (peek(scanner) == '\n') scanner->line++;
+        advance(scanner);
+        skipRun(scanner, RUN_STRING);
     }
 
-    if (isAtEnd()) return errorToken("Unterminated string.");
+    if (isAtEnd(scanner)) return errorToken(scanner, "Unterminated string.");
 
-    advance();
-    return makeToken(TOKEN_STRING);
+    advance(scanner);
+    return makeToken(scanner, TOKEN_STRING);
 }
 
-Token scanToken() {
-    skipWhitespace();
-    scanner.start = scanner.current;
+Token scanToken(Scanner *scanner) {
+    skipWhitespace(scanner);
+    scanner->start = scanner->current;
 
-    if (isAtEnd()) return makeToken(TOKEN_EOF);
+    if (isAtEnd(scanner)) return makeToken(scanner, TOKEN_EOF);
 
-    char c = advance();
-    if (isAlpha(c)) return identifier();
-    if (isDigit(c)) return number();
+    char c = advance(scanner);
+    if (isAlpha(c)) return identifier(scanner);
+    if (isDigit(c)) return number(scanner);
 
     switch (c) {
         case '(':
-            return makeToken(TOKEN_LEFT_PAREN);
+            return makeToken(scanner, TOKEN_LEFT_PAREN);
         case ')':
-            return makeToken(TOKEN_RIGHT_PAREN);
+            return makeToken(scanner, TOKEN_RIGHT_PAREN);
         case '{':
-            return makeToken(TOKEN_LEFT_BRACE);
+            return makeToken(scanner, TOKEN_LEFT_BRACE);
         case '}':
-            return makeToken(TOKEN_RIGHT_BRACE);
+            if (scanner->interpolationDepth > 0) {
+                scanner->interpolationDepth--;
+                return string(scanner);
+            }
+            return makeToken(scanner, TOKEN_RIGHT_BRACE);
         case ';':
-            return makeToken(TOKEN_SEMICOLON);
+            return makeToken(scanner, TOKEN_SEMICOLON);
+        case ':':
+            return makeToken(scanner, TOKEN_COLON);
         case ',':
-            return makeToken(TOKEN_COMMA);
+            return makeToken(scanner, TOKEN_COMMA);
         case '.':
-            return makeToken(TOKEN_DOT);
+            return makeToken(scanner, TOKEN_DOT);
         case '-':
-            return makeToken(TOKEN_MINUS);
+            return makeToken(scanner, TOKEN_MINUS);
         case '+':
-            return makeToken(TOKEN_PLUS);
+            return makeToken(scanner, TOKEN_PLUS);
         case '/':
-            return makeToken(TOKEN_SLASH);
+            return makeToken(scanner, TOKEN_SLASH);
         case '*':
-            return makeToken(TOKEN_STAR);
+            return makeToken(scanner, TOKEN_STAR);
         case '!':
-            return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
         case '=':
-            return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
         case '<':
-            return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
         case '>':
-            return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+            return makeToken(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
         case '"':
-            return string();
+            return string(scanner);
     }
 
-    return errorToken("Unexpected character.");
+    return errorToken(scanner, "Unexpected character.");
 }
@@ -5,10 +5,12 @@
 #ifndef CLOX_SCANNER_H
 #define CLOX_SCANNER_H
 
+#define MAX_INTERPOLATION_DEPTH 8
+
 typedef enum {
     TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
     TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
-    TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
+    TOKEN_COLON, TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
     TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
 
     TOKEN_BANG, TOKEN_BANG_EQUAL,
@@ -16,11 +18,11 @@ typedef enum {
     TOKEN_GREATER, TOKEN_GREATER_EQUAL,
     TOKEN_LESS, TOKEN_LESS_EQUAL,
 
-    TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
+    TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_INTERPOLATION, TOKEN_NUMBER,
 
-    TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE,
-    TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
-    TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS,
+    TOKEN_AND, TOKEN_CASE, TOKEN_CLASS, TOKEN_CONST, TOKEN_DEFAULT, TOKEN_ELSE,
+    TOKEN_FALSE, TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_IMPORT, TOKEN_NIL, TOKEN_OR,
+    TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_SWITCH, TOKEN_THIS,
     TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE,
 
     TOKEN_ERROR, TOKEN_EOF
@@ -33,8 +35,19 @@ typedef struct {
     int line;
 } Token;
 
-void initScanner(const char *source);
+typedef struct {
+    const char *start;
+    const char *current;
+    // How far the source is known to go on past current, so whole blocks can be read without passing its end.
+    const char *limit;
+    int line;
+    // How many strings the scanner is inside an interpolated expression of. No expression contains braces, so the
+    // next '}' always ends the innermost one.
+    int interpolationDepth;
+} Scanner;
+
+void initScanner(Scanner *scanner, const char *source);
 
-Token scanToken();
+Token scanToken(Scanner *scanner);
 
 #endif
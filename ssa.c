@@ -0,0 +1,994 @@
+//
+// Created by Mic Pringle on 19/10/2026.
+//
+
+#include "memory.h"
+#include "ssa.h"
+
+#define NO_VALUE (-1)
+#define NO_ORIGIN (-1)
+
+#define TREE_READS_ONLY 0x1
+#define TREE_SAFE 0x2
+
+// Every stack slot is an SSA variable. Reading a local pushes the value the
+// slot holds rather than a new one, so copies are resolved as the IR is built.
+typedef enum {
+    VALUE_ENTRY,
+    VALUE_PHI,
+    VALUE_RESULT,
+    VALUE_COPY,
+} ValueKind;
+
+typedef struct {
+    ValueKind kind;
+    int instruction;
+    int source;
+    int forward;
+    int operandStart;
+    int operandCount;
+    int number;
+    int uses;
+    bool isLive;
+} SsaValue;
+
+typedef struct {
+    int start;
+    int last;
+    int successorStart;
+    int successorCount;
+    int predecessorStart;
+    int predecessorCount;
+    int depth;
+    int entry;
+    int exit;
+    int exitDepth;
+    int exitMemory;
+    int rank;
+} Block;
+
+typedef struct {
+    int *values;
+    int count;
+    int capacity;
+} IntArray;
+
+typedef struct {
+    int op;
+    int operand;
+    int left;
+    int right;
+    int memory;
+    int number;
+} NumberEntry;
+
+typedef struct {
+    Code *code;
+    int arity;
+    SsaValue *values;
+    int valueCount;
+    int valueCapacity;
+    Block *blocks;
+    int blockCount;
+    int blockCapacity;
+    int *blockOf;
+    int *results;
+    bool isEscaped[UINT8_COUNT];
+    IntArray successors;
+    IntArray predecessors;
+    IntArray order;
+    IntArray states;
+    IntArray operands;
+    IntArray stack;
+    IntArray origins;
+    IntArray flags;
+    NumberEntry *numbers;
+    int numberCount;
+    int numberCapacity;
+    int nextNumber;
+    int memory;
+    int nextMemory;
+} Ssa;
+
+static void initIntArray(IntArray *array) {
+    array->values = NULL;
+    array->count = 0;
+    array->capacity = 0;
+}
+
+static void freeIntArray(IntArray *array) {
+    FREE_ARRAY(int, array->values, array->capacity);
+    initIntArray(array);
+}
+
+static int appendInt(IntArray *array, int value) {
+    if (array->capacity < array->count + 1) {
+        int oldCapacity = array->capacity;
+        array->capacity = GROW_CAPACITY(oldCapacity);
+        array->values = GROW_ARRAY(int, array->values, oldCapacity, array->capacity);
+    }
+
+    array->values[array->count] = value;
+    return array->count++;
+}
+
+static void initSsa(Ssa *ssa, Code *code, int arity) {
+    ssa->code = code;
+    ssa->arity = arity;
+    ssa->values = NULL;
+    ssa->valueCount = 0;
+    ssa->valueCapacity = 0;
+    ssa->blocks = NULL;
+    ssa->blockCount = 0;
+    ssa->blockCapacity = 0;
+    ssa->blockOf = ALLOCATE(int, code->count + 1);
+    ssa->results = ALLOCATE(int, code->count + 1);
+    for (int i = 0; i <= code->count; i++) {
+        ssa->blockOf[i] = -1;
+        ssa->results[i] = NO_VALUE;
+    }
+    for (int i = 0; i < UINT8_COUNT; i++) {
+        ssa->isEscaped[i] = false;
+    }
+    initIntArray(&ssa->successors);
+    initIntArray(&ssa->predecessors);
+    initIntArray(&ssa->order);
+    initIntArray(&ssa->states);
+    initIntArray(&ssa->operands);
+    initIntArray(&ssa->stack);
+    initIntArray(&ssa->origins);
+    initIntArray(&ssa->flags);
+    ssa->numbers = NULL;
+    ssa->numberCount = 0;
+    ssa->numberCapacity = 0;
+    ssa->nextNumber = 0;
+    ssa->memory = 0;
+    ssa->nextMemory = 0;
+}
+
+static void freeSsa(Ssa *ssa) {
+    FREE_ARRAY(SsaValue, ssa->values, ssa->valueCapacity);
+    FREE_ARRAY(Block, ssa->blocks, ssa->blockCapacity);
+    FREE_ARRAY(int, ssa->blockOf, ssa->code->count + 1);
+    FREE_ARRAY(int, ssa->results, ssa->code->count + 1);
+    freeIntArray(&ssa->successors);
+    freeIntArray(&ssa->predecessors);
+    freeIntArray(&ssa->order);
+    freeIntArray(&ssa->states);
+    freeIntArray(&ssa->operands);
+    freeIntArray(&ssa->stack);
+    freeIntArray(&ssa->origins);
+    freeIntArray(&ssa->flags);
+    FREE_ARRAY(NumberEntry, ssa->numbers, ssa->numberCapacity);
+}
+
+static Instruction *at(Ssa *ssa, int index) {
+    return &ssa->code->instructions[index];
+}
+
+static int newValue(Ssa *ssa, ValueKind kind, int instruction) {
+    if (ssa->valueCapacity < ssa->valueCount + 1) {
+        int oldCapacity = ssa->valueCapacity;
+        ssa->valueCapacity = GROW_CAPACITY(oldCapacity);
+        ssa->values = GROW_ARRAY(SsaValue, ssa->values, oldCapacity, ssa->valueCapacity);
+    }
+
+    SsaValue *value = &ssa->values[ssa->valueCount];
+    value->kind = kind;
+    value->instruction = instruction;
+    value->source = NO_VALUE;
+    value->forward = NO_VALUE;
+    value->operandStart = 0;
+    value->operandCount = 0;
+    value->number = -1;
+    value->uses = 0;
+    value->isLive = false;
+    return ssa->valueCount++;
+}
+
+static int resolveValue(Ssa *ssa, int value) {
+    while (ssa->values[value].forward != NO_VALUE) value = ssa->values[value].forward;
+    return value;
+}
+
+static int rootValue(Ssa *ssa, int value) {
+    value = resolveValue(ssa, value);
+    while (ssa->values[value].kind == VALUE_COPY) value = resolveValue(ssa, ssa->values[value].source);
+    return value;
+}
+
+static bool isLiveValue(Ssa *ssa, int value) {
+    return ssa->values[resolveValue(ssa, value)].isLive;
+}
+
+// Instructions that may change a global, an upvalue, a field or a captured local.
+static bool clobbersMemory(Ssa *ssa, Instruction *instruction) {
+    switch (instruction->op) {
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:
+        case OP_SET_UPVALUE:
+        case OP_SET_PROPERTY:
+        case OP_SET_PROPERTY_LONG:
+        case OP_CALL:
+        case OP_CALL_DIRECT:
+        case OP_INVOKE:
+        case OP_INVOKE_LONG:
+        case OP_INVOKE_DIRECT:
+        case OP_SUPER_INVOKE:
+        case OP_SUPER_INVOKE_LONG:
+        case OP_CLOSE_UPVALUE:
+        case OP_IMPORT:
+        case OP_IMPORT_LONG:
+            return true;
+        case OP_SET_LOCAL:
+        case OP_FOR_LOOP:
+            return ssa->isEscaped[instructionOperand(ssa->code, instruction, 0)];
+        default:
+            return false;
+    }
+}
+
+static int treeFlags(Instruction *instruction) {
+    switch (instruction->op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_NOT:
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER_NUMBER:
+        case OP_GREATER_EQUAL_NUMBER:
+        case OP_LESS_NUMBER:
+        case OP_LESS_EQUAL_NUMBER:
+        case OP_ADD_NUMBER:
+        case OP_SUBTRACT_NUMBER:
+        case OP_MULTIPLY_NUMBER:
+        case OP_DIVIDE_NUMBER:
+        case OP_INTERPOLATE:
+            return TREE_READS_ONLY | TREE_SAFE;
+        case OP_GET_GLOBAL:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NEGATE:
+        case OP_CONCAT:
+            return TREE_READS_ONLY;
+        default:
+            return 0;
+    }
+}
+
+static void findEscapes(Ssa *ssa) {
+    Code *code = ssa->code;
+    for (int i = resolveInstruction(code, 0); i < code->count; i = nextInstruction(code, i)) {
+        Instruction *instruction = at(ssa, i);
+        if (instruction->op != OP_CLOSURE && instruction->op != OP_CLOSURE_LONG) continue;
+
+        int first = instruction->op == OP_CLOSURE ? 1 : 3;
+        for (int j = first; j + 1 < instruction->operandCount; j += 2) {
+            if (instructionOperand(code, instruction, j)) {
+                ssa->isEscaped[instructionOperand(code, instruction, j + 1)] = true;
+            }
+        }
+    }
+}
+
+static void addBlock(Ssa *ssa, int start) {
+    if (ssa->blockCapacity < ssa->blockCount + 1) {
+        int oldCapacity = ssa->blockCapacity;
+        ssa->blockCapacity = GROW_CAPACITY(oldCapacity);
+        ssa->blocks = GROW_ARRAY(Block, ssa->blocks, oldCapacity, ssa->blockCapacity);
+    }
+
+    Block *block = &ssa->blocks[ssa->blockCount++];
+    block->start = start;
+    block->last = start;
+    block->successorStart = 0;
+    block->successorCount = 0;
+    block->predecessorStart = 0;
+    block->predecessorCount = 0;
+    block->depth = 0;
+    block->entry = 0;
+    block->exit = 0;
+    block->exitDepth = 0;
+    block->exitMemory = 0;
+    block->rank = -1;
+}
+
+static bool addSuccessor(Ssa *ssa, Block *block, int target) {
+    Code *code = ssa->code;
+    target = resolveInstruction(code, target);
+    if (target >= code->count) return false;
+
+    int successor = ssa->blockOf[target];
+    for (int i = 0; i < block->successorCount; i++) {
+        if (ssa->successors.values[block->successorStart + i] == successor) return true;
+    }
+
+    appendInt(&ssa->successors, successor);
+    block->successorCount++;
+    return true;
+}
+
+static bool buildBlocks(Ssa *ssa) {
+    Code *code = ssa->code;
+
+    int previous = -1;
+    for (int i = resolveInstruction(code, 0); i < code->count; i = nextInstruction(code, i)) {
+        if (previous == -1 || code->isTarget[i] || instructionEndsBlock(at(ssa, previous)->op)) {
+            addBlock(ssa, i);
+        }
+        ssa->blockOf[i] = ssa->blockCount - 1;
+        ssa->blocks[ssa->blockCount - 1].last = i;
+        previous = i;
+    }
+    if (ssa->blockCount == 0) return false;
+
+    for (int b = 0; b < ssa->blockCount; b++) {
+        Block *block = &ssa->blocks[b];
+        Instruction *last = at(ssa, block->last);
+        block->successorStart = ssa->successors.count;
+
+        if (instructionFallsThrough(last->op) && !addSuccessor(ssa, block, block->last + 1)) return false;
+        if (last->target != NO_TARGET && !addSuccessor(ssa, block, last->target)) return false;
+        for (int i = 0; i < last->targetCount; i++) {
+            int target = code->targets[last->targetStart + i];
+            if (target != EMPTY_ENTRY && !addSuccessor(ssa, block, target)) return false;
+        }
+    }
+
+    // Lay the predecessor lists out contiguously, one block after another.
+    for (int i = 0; i < ssa->successors.count; i++) {
+        ssa->blocks[ssa->successors.values[i]].predecessorCount++;
+    }
+    int start = 0;
+    for (int b = 0; b < ssa->blockCount; b++) {
+        ssa->blocks[b].predecessorStart = start;
+        start += ssa->blocks[b].predecessorCount;
+        ssa->blocks[b].predecessorCount = 0;
+    }
+    for (int i = 0; i < start; i++) {
+        appendInt(&ssa->predecessors, 0);
+    }
+    for (int b = 0; b < ssa->blockCount; b++) {
+        Block *block = &ssa->blocks[b];
+        for (int i = 0; i < block->successorCount; i++) {
+            Block *successor = &ssa->blocks[ssa->successors.values[block->successorStart + i]];
+            ssa->predecessors.values[successor->predecessorStart + successor->predecessorCount++] = b;
+        }
+    }
+
+    return true;
+}
+
+static void orderBlocks(Ssa *ssa) {
+    int *pending = ALLOCATE(int, ssa->blockCount);
+    int *nextEdge = ALLOCATE(int, ssa->blockCount);
+    bool *isVisited = ALLOCATE(bool, ssa->blockCount);
+    for (int b = 0; b < ssa->blockCount; b++) {
+        nextEdge[b] = 0;
+        isVisited[b] = false;
+    }
+
+    int depth = 0;
+    pending[depth++] = 0;
+    isVisited[0] = true;
+    while (depth > 0) {
+        int b = pending[depth - 1];
+        Block *block = &ssa->blocks[b];
+        if (nextEdge[b] < block->successorCount) {
+            int successor = ssa->successors.values[block->successorStart + nextEdge[b]++];
+            if (!isVisited[successor]) {
+                isVisited[successor] = true;
+                pending[depth++] = successor;
+            }
+        } else {
+            appendInt(&ssa->order, b);
+            depth--;
+        }
+    }
+
+    // Reverse the postorder.
+    for (int i = 0, j = ssa->order.count - 1; i < j; i++, j--) {
+        int swap = ssa->order.values[i];
+        ssa->order.values[i] = ssa->order.values[j];
+        ssa->order.values[j] = swap;
+    }
+    for (int rank = 0; rank < ssa->order.count; rank++) {
+        ssa->blocks[ssa->order.values[rank]].rank = rank;
+    }
+
+    FREE_ARRAY(int, pending, ssa->blockCount);
+    FREE_ARRAY(int, nextEdge, ssa->blockCount);
+    FREE_ARRAY(bool, isVisited, ssa->blockCount);
+}
+
+static int saveStack(Ssa *ssa) {
+    int start = ssa->states.count;
+    for (int i = 0; i < ssa->stack.count; i++) {
+        appendInt(&ssa->states, ssa->stack.values[i]);
+    }
+    return start;
+}
+
+static void use(Ssa *ssa, int value) {
+    ssa->values[value].uses++;
+}
+
+static int popUse(Ssa *ssa) {
+    int value = ssa->stack.values[--ssa->stack.count];
+    use(ssa, value);
+    return value;
+}
+
+static void pushValue(Ssa *ssa, int value) {
+    // A closure may read a captured slot at any time.
+    if (ssa->stack.count < UINT8_COUNT && ssa->isEscaped[ssa->stack.count]) use(ssa, value);
+    appendInt(&ssa->stack, value);
+}
+
+static bool buildInstruction(Ssa *ssa, int index) {
+    Instruction *instruction = at(ssa, index);
+    IntArray *stack = &ssa->stack;
+
+    int pops, pushes;
+    if (!instructionStackEffect(ssa->code, instruction, &pops, &pushes) || pops > stack->count) return false;
+
+    switch (instruction->op) {
+        case OP_GET_LOCAL: {
+            int slot = instructionOperand(ssa->code, instruction, 0);
+            if (slot >= stack->count) return false;
+
+            int value = ssa->isEscaped[slot] ? newValue(ssa, VALUE_RESULT, index) : stack->values[slot];
+            pushValue(ssa, value);
+            ssa->results[index] = value;
+            return true;
+        }
+        case OP_SET_LOCAL: {
+            int slot = instructionOperand(ssa->code, instruction, 0);
+            if (slot >= stack->count) return false;
+
+            int source = stack->values[stack->count - 1];
+            use(ssa, source);
+            int copy = newValue(ssa, VALUE_COPY, index);
+            ssa->values[copy].source = source;
+            if (ssa->isEscaped[slot]) use(ssa, copy);
+            stack->values[slot] = copy;
+            ssa->results[index] = copy;
+            return true;
+        }
+        case OP_SET_GLOBAL:
+        case OP_SET_UPVALUE:
+        case OP_JUMP_IF_FALSE:
+            use(ssa, stack->values[stack->count - 1]);
+            return true;
+        case OP_SET_PROPERTY: {
+            int value = popUse(ssa);
+            popUse(ssa);
+            pushValue(ssa, value);
+            return true;
+        }
+        case OP_POP:
+            stack->count--;
+            return true;
+        case OP_INHERIT:
+            if (stack->count < 2) return false;
+            use(ssa, stack->values[stack->count - 2]);
+            popUse(ssa);
+            return true;
+        case OP_FOR_PREP:
+        case OP_FOR_LOOP: {
+            int slot = instructionOperand(ssa->code, instruction, 0);
+            int limit = instructionOperand(ssa->code, instruction, 1);
+            if (slot >= stack->count || limit >= stack->count) return false;
+
+            use(ssa, stack->values[slot]);
+            use(ssa, stack->values[limit]);
+            if (instruction->op == OP_FOR_LOOP) {
+                int counter = newValue(ssa, VALUE_RESULT, index);
+                if (ssa->isEscaped[slot]) use(ssa, counter);
+                stack->values[slot] = counter;
+                ssa->results[index] = counter;
+            }
+            return true;
+        }
+        default:
+            for (int i = 0; i < pops; i++) {
+                popUse(ssa);
+            }
+            if (pushes > 0) {
+                int value = newValue(ssa, VALUE_RESULT, index);
+                pushValue(ssa, value);
+                ssa->results[index] = value;
+            }
+            return true;
+    }
+}
+
+static bool buildBlock(Ssa *ssa, int rank) {
+    Code *code = ssa->code;
+    int b = ssa->order.values[rank];
+    Block *block = &ssa->blocks[b];
+    IntArray *stack = &ssa->stack;
+    stack->count = 0;
+
+    if (b == 0 && block->predecessorCount == 0) {
+        for (int slot = 0; slot <= ssa->arity; slot++) {
+            appendInt(stack, slot);
+        }
+    } else if (b != 0 && block->predecessorCount == 1) {
+        Block *predecessor = &ssa->blocks[ssa->predecessors.values[block->predecessorStart]];
+        if (predecessor->rank >= rank) return false;
+        for (int i = 0; i < predecessor->exitDepth; i++) {
+            appendInt(stack, ssa->states.values[predecessor->exit + i]);
+        }
+    } else {
+        int depth = -1;
+        if (b == 0) depth = ssa->arity + 1;
+        for (int i = 0; depth == -1 && i < block->predecessorCount; i++) {
+            Block *predecessor = &ssa->blocks[ssa->predecessors.values[block->predecessorStart + i]];
+            if (predecessor->rank < rank) depth = predecessor->exitDepth;
+        }
+        if (depth == -1) return false;
+
+        for (int slot = 0; slot < depth; slot++) {
+            appendInt(stack, newValue(ssa, VALUE_PHI, block->start));
+        }
+    }
+
+    block->depth = stack->count;
+    block->entry = saveStack(ssa);
+
+    for (int i = block->start; i <= block->last; i = nextInstruction(code, i)) {
+        if (!buildInstruction(ssa, i)) return false;
+    }
+
+    block->exitDepth = stack->count;
+    block->exit = saveStack(ssa);
+    return true;
+}
+
+static bool fillPhis(Ssa *ssa) {
+    for (int b = 0; b < ssa->blockCount; b++) {
+        Block *block = &ssa->blocks[b];
+        bool hasPhis = (b == 0 && block->predecessorCount > 0) || (b != 0 && block->predecessorCount > 1);
+        if (!hasPhis) continue;
+
+        for (int slot = 0; slot < block->depth; slot++) {
+            SsaValue *phi = &ssa->values[ssa->states.values[block->entry + slot]];
+            phi->operandStart = ssa->operands.count;
+            if (b == 0) appendInt(&ssa->operands, slot);
+
+            for (int i = 0; i < block->predecessorCount; i++) {
+                Block *predecessor = &ssa->blocks[ssa->predecessors.values[block->predecessorStart + i]];
+                if (predecessor->exitDepth != block->depth) return false;
+                appendInt(&ssa->operands, ssa->states.values[predecessor->exit + slot]);
+            }
+            phi->operandCount = ssa->operands.count - phi->operandStart;
+        }
+    }
+
+    return true;
+}
+
+// Forwards every phi whose operands are all the same value, or itself, to
+// that value.
+static void removeTrivialPhis(Ssa *ssa) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        for (int v = 0; v < ssa->valueCount; v++) {
+            SsaValue *phi = &ssa->values[v];
+            if (phi->kind != VALUE_PHI || phi->forward != NO_VALUE) continue;
+
+            int same = NO_VALUE;
+            bool isTrivial = true;
+            for (int i = 0; i < phi->operandCount; i++) {
+                int operand = resolveValue(ssa, ssa->operands.values[phi->operandStart + i]);
+                if (operand == v || operand == same) continue;
+                if (same != NO_VALUE) {
+                    isTrivial = false;
+                    break;
+                }
+                same = operand;
+            }
+
+            if (isTrivial && same != NO_VALUE) {
+                phi->forward = same;
+                changed = true;
+            }
+        }
+    }
+}
+
+static void markLive(Ssa *ssa, IntArray *worklist, int value) {
+    value = resolveValue(ssa, value);
+    if (ssa->values[value].isLive) return;
+
+    ssa->values[value].isLive = true;
+    if (ssa->values[value].kind == VALUE_PHI) appendInt(worklist, value);
+}
+
+static void findLiveValues(Ssa *ssa) {
+    IntArray worklist;
+    initIntArray(&worklist);
+
+    for (int v = 0; v < ssa->valueCount; v++) {
+        if (ssa->values[v].uses > 0) markLive(ssa, &worklist, v);
+    }
+
+    while (worklist.count > 0) {
+        SsaValue *phi = &ssa->values[worklist.values[--worklist.count]];
+        for (int i = 0; i < phi->operandCount; i++) {
+            markLive(ssa, &worklist, ssa->operands.values[phi->operandStart + i]);
+        }
+    }
+
+    freeIntArray(&worklist);
+}
+
+static uint32_t hashNumberEntry(NumberEntry *entry) {
+    uint32_t hash = 2166136261u;
+    int fields[] = {entry->op, entry->operand, entry->left, entry->right, entry->memory};
+    for (int i = 0; i < 5; i++) {
+        hash ^= (uint32_t) fields[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static bool sameNumberKey(NumberEntry *a, NumberEntry *b) {
+    return a->op == b->op && a->operand == b->operand && a->left == b->left && a->right == b->right &&
+           a->memory == b->memory;
+}
+
+static void insertNumber(NumberEntry *entries, int capacity, NumberEntry *key) {
+    uint32_t index = hashNumberEntry(key) & (capacity - 1);
+    while (entries[index].number != -1) {
+        index = (index + 1) & (capacity - 1);
+    }
+    entries[index] = *key;
+}
+
+static int lookupNumber(Ssa *ssa, NumberEntry *key) {
+    if (ssa->numberCount + 1 > ssa->numberCapacity * 3 / 4) {
+        int capacity = GROW_CAPACITY(ssa->numberCapacity);
+        NumberEntry *entries = ALLOCATE(NumberEntry, capacity);
+        for (int i = 0; i < capacity; i++) {
+            entries[i].number = -1;
+        }
+        for (int i = 0; i < ssa->numberCapacity; i++) {
+            if (ssa->numbers[i].number != -1) insertNumber(entries, capacity, &ssa->numbers[i]);
+        }
+        FREE_ARRAY(NumberEntry, ssa->numbers, ssa->numberCapacity);
+        ssa->numbers = entries;
+        ssa->numberCapacity = capacity;
+    }
+
+    uint32_t index = hashNumberEntry(key) & (ssa->numberCapacity - 1);
+    for (;;) {
+        NumberEntry *entry = &ssa->numbers[index];
+        if (entry->number == -1) {
+            key->number = ssa->nextNumber++;
+            *entry = *key;
+            ssa->numberCount++;
+            return key->number;
+        }
+        if (sameNumberKey(entry, key)) return entry->number;
+        index = (index + 1) & (ssa->numberCapacity - 1);
+    }
+}
+
+static int numberOf(Ssa *ssa, int value) {
+    SsaValue *root = &ssa->values[rootValue(ssa, value)];
+    if (root->number == -1) root->number = ssa->nextNumber++;
+    return root->number;
+}
+
+// Gives the value pushed by an instruction the same number as every other
+// value computed by the same operation on the same operands.
+static void numberResult(Ssa *ssa, int index, int value) {
+    Instruction *instruction = at(ssa, index);
+    IntArray *stack = &ssa->stack;
+    NumberEntry key = {instruction->op, -1, -1, -1, -1, -1};
+
+    switch (instruction->op) {
+        case OP_CONSTANT:
+            key.operand = instructionOperand(ssa->code, instruction, 0);
+            break;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            break;
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+            key.operand = instructionOperand(ssa->code, instruction, 0);
+            key.memory = ssa->memory;
+            break;
+        case OP_NOT:
+        case OP_NEGATE:
+            key.left = numberOf(ssa, stack->values[stack->count - 1]);
+            break;
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_MULTIPLY:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_DIVIDE:
+        case OP_GREATER_NUMBER:
+        case OP_GREATER_EQUAL_NUMBER:
+        case OP_LESS_NUMBER:
+        case OP_LESS_EQUAL_NUMBER:
+        case OP_ADD_NUMBER:
+        case OP_SUBTRACT_NUMBER:
+        case OP_MULTIPLY_NUMBER:
+        case OP_DIVIDE_NUMBER:
+            key.left = numberOf(ssa, stack->values[stack->count - 2]);
+            key.right = numberOf(ssa, stack->values[stack->count - 1]);
+            bool isCommutative = instruction->op == OP_EQUAL || instruction->op == OP_NOT_EQUAL ||
+                                 instruction->op == OP_MULTIPLY || instruction->op == OP_MULTIPLY_NUMBER;
+            if (isCommutative && key.left > key.right) {
+                int swap = key.left;
+                key.left = key.right;
+                key.right = swap;
+            }
+            break;
+        default:
+            return;
+    }
+
+    ssa->values[value].number = lookupNumber(ssa, &key);
+}
+
+static void pushTree(Ssa *ssa, int value, int origin, int flags) {
+    appendInt(&ssa->stack, value);
+    appendInt(&ssa->origins, origin);
+    appendInt(&ssa->flags, flags);
+}
+
+static void popTree(Ssa *ssa, int count) {
+    ssa->stack.count -= count;
+    ssa->origins.count -= count;
+    ssa->flags.count -= count;
+}
+
+static bool hasTargetWithin(Ssa *ssa, int start, int end) {
+    for (int i = start + 1; i <= end; i++) {
+        if (ssa->code->isTarget[i]) return true;
+    }
+    return false;
+}
+
+static void replaceTree(Ssa *ssa, int start, int end, uint8_t op, int operand) {
+    Code *code = ssa->code;
+    Instruction *instruction = at(ssa, start);
+    instruction->op = op;
+    instruction->operandCount = 0;
+    if (operand != -1) {
+        instruction->operandStart = addCodeOperand(code, (uint8_t) operand);
+        instruction->operandCount = 1;
+    }
+
+    for (int i = nextInstruction(code, start); i <= end; i = nextInstruction(code, i)) {
+        removeInstruction(code, i);
+    }
+}
+
+// Copy propagation: a local that holds a literal is read as the literal.
+static bool propagateCopy(Ssa *ssa, int index) {
+    Instruction *instruction = at(ssa, index);
+    int slot = instructionOperand(ssa->code, instruction, 0);
+    if (ssa->isEscaped[slot]) return false;
+
+    SsaValue *root = &ssa->values[rootValue(ssa, ssa->stack.values[slot])];
+    if (root->kind != VALUE_RESULT) return false;
+
+    Instruction *definition = at(ssa, root->instruction);
+    if (definition->isRemoved) return false;
+
+    switch (definition->op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            instruction->op = definition->op;
+            instruction->operandStart = definition->operandStart;
+            instruction->operandCount = definition->operandCount;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Common-subexpression elimination and global value numbering: an expression
+// whose value number matches a value already sitting in a stack slot is
+// replaced by a read of that slot.
+static bool reuseValue(Ssa *ssa, int index) {
+    int top = ssa->stack.count - 1;
+    int origin = ssa->origins.values[top];
+    if (origin == NO_ORIGIN || !(ssa->flags.values[top] & TREE_READS_ONLY)) return false;
+
+    uint8_t op = at(ssa, origin)->op;
+    if (origin == index && op != OP_GET_GLOBAL && op != OP_GET_UPVALUE) return false;
+    if (hasTargetWithin(ssa, origin, index)) return false;
+
+    int number = numberOf(ssa, ssa->stack.values[top]);
+    for (int slot = 0; slot < top && slot < UINT8_COUNT; slot++) {
+        int value = ssa->stack.values[slot];
+        if (ssa->isEscaped[slot] || !isLiveValue(ssa, value) || numberOf(ssa, value) != number) continue;
+
+        replaceTree(ssa, origin, index, OP_GET_LOCAL, slot);
+        ssa->origins.values[top] = origin;
+        ssa->flags.values[top] = TREE_READS_ONLY | TREE_SAFE;
+        return true;
+    }
+
+    return false;
+}
+
+// Removes an expression that can't fail when its value is discarded straight
+// away, and replaces one whose value is never used with nil. Returns the
+// index of the last instruction it consumed.
+static int removeDeadTree(Ssa *ssa, int index, bool *changed) {
+    Code *code = ssa->code;
+    int top = ssa->stack.count - 1;
+    int origin = ssa->origins.values[top];
+    if (origin == NO_ORIGIN || !(ssa->flags.values[top] & TREE_SAFE)) return index;
+    if (hasTargetWithin(ssa, origin, index)) return index;
+
+    int next = nextInstruction(code, index);
+    if (next < code->count && !code->isTarget[next] && at(ssa, next)->op == OP_POP) {
+        for (int i = origin; i <= next; i = nextInstruction(code, i)) {
+            removeInstruction(code, i);
+        }
+        popTree(ssa, 1);
+        *changed = true;
+        return next;
+    }
+
+    if (origin != index && nextInstruction(code, origin) <= index && !isLiveValue(ssa, ssa->stack.values[top])) {
+        replaceTree(ssa, origin, index, OP_NIL, -1);
+        *changed = true;
+    }
+    return index;
+}
+
+static bool rewriteBlock(Ssa *ssa, int rank) {
+    Code *code = ssa->code;
+    int b = ssa->order.values[rank];
+    Block *block = &ssa->blocks[b];
+    bool changed = false;
+
+    ssa->stack.count = 0;
+    ssa->origins.count = 0;
+    ssa->flags.count = 0;
+    for (int slot = 0; slot < block->depth; slot++) {
+        pushTree(ssa, resolveValue(ssa, ssa->states.values[block->entry + slot]), NO_ORIGIN, 0);
+    }
+
+    if (b != 0 && block->predecessorCount == 1) {
+        ssa->memory = ssa->blocks[ssa->predecessors.values[block->predecessorStart]].exitMemory;
+    } else {
+        ssa->memory = ssa->nextMemory++;
+    }
+
+    for (int i = block->start; i <= block->last; i = nextInstruction(code, i)) {
+        Instruction *instruction = at(ssa, i);
+        if (instruction->op == OP_GET_LOCAL && propagateCopy(ssa, i)) changed = true;
+
+        int pops, pushes;
+        instructionStackEffect(ssa->code, instruction, &pops, &pushes);
+        int top = ssa->stack.count - 1;
+
+        switch (instruction->op) {
+            case OP_SET_LOCAL: {
+                int slot = instructionOperand(code, instruction, 0);
+                ssa->stack.values[slot] = ssa->results[i];
+                ssa->origins.values[slot] = NO_ORIGIN;
+                if (!ssa->isEscaped[slot] && !isLiveValue(ssa, ssa->results[i])) {
+                    // Dead-store elimination.
+                    removeInstruction(code, i);
+                    changed = true;
+                    i = removeDeadTree(ssa, i, &changed);
+                } else {
+                    ssa->flags.values[top] = 0;
+                }
+                break;
+            }
+            case OP_FOR_LOOP: {
+                int slot = instructionOperand(code, instruction, 0);
+                ssa->stack.values[slot] = ssa->results[i];
+                ssa->origins.values[slot] = NO_ORIGIN;
+                break;
+            }
+            case OP_SET_GLOBAL:
+            case OP_SET_UPVALUE:
+                ssa->flags.values[top] = 0;
+                break;
+            case OP_JUMP_IF_FALSE:
+                break;
+            case OP_SET_PROPERTY: {
+                int value = ssa->stack.values[top];
+                popTree(ssa, 2);
+                pushTree(ssa, value, NO_ORIGIN, 0);
+                break;
+            }
+            default: {
+                int origin = i;
+                int flags = treeFlags(instruction);
+                if (pops > 0) origin = ssa->origins.values[ssa->stack.count - pops];
+                for (int j = ssa->stack.count - pops; j < ssa->stack.count; j++) {
+                    if (ssa->origins.values[j] == NO_ORIGIN) origin = NO_ORIGIN;
+                    flags &= ssa->flags.values[j];
+                }
+
+                if (pushes > 0 && ssa->values[ssa->results[i]].kind == VALUE_RESULT &&
+                    ssa->values[ssa->results[i]].instruction == i) {
+                    numberResult(ssa, i, ssa->results[i]);
+                }
+
+                popTree(ssa, pops);
+                if (pushes > 0) {
+                    pushTree(ssa, ssa->results[i], origin, flags);
+                    if (reuseValue(ssa, i)) changed = true;
+                    i = removeDeadTree(ssa, i, &changed);
+                }
+                break;
+            }
+        }
+
+        if (clobbersMemory(ssa, instruction)) ssa->memory = ssa->nextMemory++;
+    }
+
+    block->exitMemory = ssa->memory;
+    return changed;
+}
+
+bool optimizeSsa(Code *code, int arity) {
+    Ssa ssa;
+    initSsa(&ssa, code, arity);
+    findJumpTargets(code);
+    findEscapes(&ssa);
+
+    for (int slot = 0; slot <= arity; slot++) {
+        newValue(&ssa, VALUE_ENTRY, -1);
+    }
+
+    bool changed = false;
+    bool isBuilt = buildBlocks(&ssa);
+    if (isBuilt) {
+        orderBlocks(&ssa);
+        isBuilt = ssa.order.count == ssa.blockCount;
+    }
+    for (int rank = 0; isBuilt && rank < ssa.order.count; rank++) {
+        isBuilt = buildBlock(&ssa, rank);
+    }
+
+    if (isBuilt && fillPhis(&ssa)) {
+        removeTrivialPhis(&ssa);
+        findLiveValues(&ssa);
+        for (int rank = 0; rank < ssa.order.count; rank++) {
+            changed |= rewriteBlock(&ssa, rank);
+        }
+    }
+
+    freeSsa(&ssa);
+    return changed;
+}
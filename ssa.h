@@ -0,0 +1,12 @@
+//
+// Created by Mic Pringle on 19/10/2026.
+//
+
+#ifndef CLOX_SSA_H
+#define CLOX_SSA_H
+
+#include "optimizer.h"
+
+bool optimizeSsa(Code *code, int arity);
+
+#endif
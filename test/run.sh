@@ -0,0 +1,118 @@
+#!/bin/bash
+#
+# Runs each test/<suite>/*.lox script under every compiler mode and checks what it prints against
+# the comments in the script:
+#
+#   // expect: <line>                 a line the script prints
+#   // expect runtime error: <message> the script stops with this runtime error
+#   // expect trace: <line>            a line of the stack trace that follows it
+#   // Error at '<token>': <message>   compiling fails with this error on the comment's line
+#   // run with: <path>...             scripts run after this one in the same VM
+#
+# Scripts in deeper directories are only imported or run with a test, never on their own.
+#
+# usage: run.sh clox [loxrt cc definitions]
+#
+# When the runtime library and a C compiler are given, each script is also built with --emit-c.
+
+clox=$1
+loxrt=$2
+cc=$3
+IFS=';' read -r -a definitions <<< "$4"
+
+root=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+# Scripts run from a copy so the caches they write stay out of the tree, and apart from the scratch files.
+mkdir "$work/test"
+cp -R "$root"/. "$work/test"
+
+modes=("-O0" "-O1" "-O2" "--closed-world" "-O2 --closed-world" "--lazy" "--cache")
+passed=0
+failed=0
+
+expectations() {
+    local test=$1
+    expectedOutput=$(sed -nE 's|.*// expect: ?||p' "$test")
+    expectedRuntimeError=$(sed -n 's|.*// expect runtime error: ||p' "$test")
+    expectedTrace=$(sed -n 's|.*// expect trace: ||p' "$test")
+    expectedCompileErrors=$(awk '
+        match($0, /\/\/ \[line [0-9]+\] Error.*/) { print substr($0, RSTART + 3); next }
+        match($0, /\/\/ Error.*/) { print "[line " NR "] " substr($0, RSTART + 3) }' "$test")
+
+    expectedStatus=0
+    if [ -n "$expectedCompileErrors" ]; then
+        expectedStatus=65
+    elif [ -n "$expectedRuntimeError" ]; then
+        expectedStatus=70
+    fi
+}
+
+check() {
+    local test=$1 mode=$2 status=$3 output=$4 errors=$5
+    local problem=""
+    if [ "$status" != "$expectedStatus" ]; then
+        problem="exited with $status, expected $expectedStatus"
+    elif [ "$output" != "$expectedOutput" ]; then
+        problem="printed"$'\n'"$output"$'\n'"expected"$'\n'"$expectedOutput"
+    elif [ -n "$expectedCompileErrors" ] && [ "$errors" != "$expectedCompileErrors" ]; then
+        problem="reported"$'\n'"$errors"$'\n'"expected"$'\n'"$expectedCompileErrors"
+    elif [ -n "$expectedRuntimeError" ] && [ "$(head -n 1 <<< "$errors")" != "$expectedRuntimeError" ]; then
+        problem="reported"$'\n'"$errors"$'\n'"expected"$'\n'"$expectedRuntimeError"
+    elif [ -n "$expectedTrace" ] && [ "$(tail -n +2 <<< "$errors")" != "$expectedTrace" ]; then
+        problem="traced"$'\n'"$(tail -n +2 <<< "$errors")"$'\n'"expected"$'\n'"$expectedTrace"
+    fi
+
+    if [ -z "$problem" ]; then
+        passed=$((passed + 1))
+    else
+        failed=$((failed + 1))
+        echo "FAIL ${test#"$work/test"/} [$mode]: $problem"
+    fi
+}
+
+for test in "$work"/test/*/*.lox; do
+    expectations "$test"
+
+    scripts=("$test")
+    for script in $(sed -n 's|.*// run with: ||p' "$test"); do
+        scripts+=("$(dirname "$test")/$script")
+        output=$(sed -nE 's|.*// expect: ?||p' "${scripts[-1]}")
+        if [ -z "$expectedOutput" ]; then
+            expectedOutput=$output
+        elif [ -n "$output" ]; then
+            expectedOutput+=$'\n'$output
+        fi
+    done
+
+    for mode in "${modes[@]}"; do
+        read -r -a flags <<< "$mode"
+        runs=1
+        # The first run writes the cache and the second loads from it.
+        [ "$mode" == "--cache" ] && runs=2
+        for ((run = 0; run < runs; run++)); do
+            output=$("$clox" "${flags[@]}" "${scripts[@]}" 2> "$work/stderr")
+            check "$test" "$mode" $? "$output" "$(cat "$work/stderr")"
+        done
+    done
+
+    if [ -n "$cc" ] && [ ${#scripts[@]} == 1 ]; then
+        "$clox" --emit-c "$work/native.c" "$test" 2> "$work/stderr"
+        status=$?
+        if [ $status == 0 ]; then
+            if "$cc" -std=c17 "${definitions[@]/#/-D}" -I"$root/.." "$work/native.c" "$loxrt" -lpthread -lm \
+                    -o "$work/native" 2> "$work/cc"; then
+                output=$("$work/native" 2> "$work/stderr")
+                check "$test" "--emit-c" $? "$output" "$(cat "$work/stderr")"
+            else
+                failed=$((failed + 1))
+                echo "FAIL ${test#"$work/test"/} [--emit-c]: $(head -n 5 "$work/cc")"
+            fi
+        else
+            check "$test" "--emit-c" $status "" "$(cat "$work/stderr")"
+        fi
+    fi
+done
+
+echo "$passed passed, $failed failed"
+[ $failed == 0 ]
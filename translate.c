@@ -0,0 +1,418 @@
+//
+// Created by Mic Pringle on 19/10/2026.
+//
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "memory.h"
+#include "optimizer.h"
+#include "translate.h"
+
+typedef struct {
+    char *text;
+    int length;
+    int capacity;
+    bool usesFrame;
+    bool usesSlots;
+    bool usesConstants;
+    bool usesCode;
+} Translation;
+
+static void emit(Translation *translation, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    if (translation->capacity < translation->length + length + 1) {
+        int oldCapacity = translation->capacity;
+        while (translation->capacity < translation->length + length + 1) {
+            translation->capacity = GROW_CAPACITY(translation->capacity);
+        }
+        translation->text = GROW_ARRAY(char, translation->text, oldCapacity, translation->capacity);
+    }
+
+    va_start(args, format);
+    vsnprintf(translation->text + translation->length, length + 1, format, args);
+    va_end(args);
+    translation->length += length;
+}
+
+static int shortOperand(Code *code, Instruction *instruction, int index) {
+    return (instructionOperand(code, instruction, index) << 8) | instructionOperand(code, instruction, index + 1);
+}
+
+// The constant operand of an instruction with a long form, which widens it to three bytes.
+static int constantOperand(Code *code, Instruction *instruction, bool isLong) {
+    if (!isLong) return instructionOperand(code, instruction, 0);
+    return (instructionOperand(code, instruction, 0) << 16) | shortOperand(code, instruction, 1);
+}
+
+static int targetOf(Code *code, Instruction *instruction, int index) {
+    return code->targets[instruction->targetStart + index];
+}
+
+// Finite numbers are written out in full, so they need no load from the constant pool.
+static void emitNumber(Translation *translation, Chunk *chunk, int constant) {
+    double number = AS_NUMBER(chunk->constants.values[constant]);
+    if (isfinite(number)) {
+        emit(translation, "%a", number);
+    } else {
+        emit(translation, "AS_NUMBER(constants[%d])", constant);
+        translation->usesConstants = true;
+    }
+}
+
+static void emitConstant(Translation *translation, Chunk *chunk, int constant) {
+    if (IS_NUMBER(chunk->constants.values[constant])) {
+        emit(translation, "NUMBER_VAL(");
+        emitNumber(translation, chunk, constant);
+        emit(translation, ")");
+    } else {
+        emit(translation, "constants[%d]", constant);
+        translation->usesConstants = true;
+    }
+}
+
+static void emitAt(Translation *translation, int offset) {
+    emit(translation, "    AT(%d);\n", offset + 1);
+    translation->usesCode = true;
+}
+
+// Instructions that can fail, or call, first record where they are, then stop the body as soon as they fail.
+static void emitChecked(Translation *translation, int offset, const char *call, int operand) {
+    emitAt(translation, offset);
+    emit(translation, "    if (!%s(%d)) return false;\n", call, operand);
+}
+
+static void emitNamed(Translation *translation, int offset, const char *call, int constant) {
+    emitAt(translation, offset);
+    emit(translation, "    if (!%s(AS_STRING(constants[%d]))) return false;\n", call, constant);
+    translation->usesConstants = true;
+}
+
+static void emitInvoke(Translation *translation, int offset, const char *call, int constant, int argCount) {
+    emitAt(translation, offset);
+    emit(translation, "    if (!%s(AS_STRING(constants[%d]), %d)) return false;\n", call, constant, argCount);
+    translation->usesConstants = true;
+}
+
+static void emitSwitchTable(Translation *translation, Chunk *chunk, Code *code, Instruction *instruction) {
+    int count = shortOperand(code, instruction, 1);
+    int defaultTarget = targetOf(code, instruction, 0);
+
+    emit(translation, "    {\n        Value value = POP();\n");
+    emit(translation, "        double index = IS_NUMBER(value) ? AS_NUMBER(value) - ");
+    emitNumber(translation, chunk, instructionOperand(code, instruction, 0));
+    emit(translation, " : -1;\n");
+    emit(translation, "        if (index >= 0 && index < %d && index == (int) index) {\n", count);
+    emit(translation, "            switch ((int) index) {\n");
+    for (int i = 0; i < count; i++) {
+        int target = targetOf(code, instruction, i + 1);
+        if (target != defaultTarget) emit(translation, "                case %d: goto L%d;\n", i, target);
+    }
+    emit(translation, "            }\n        }\n        goto L%d;\n    }\n", defaultTarget);
+}
+
+// Entries are tried in table order. The keys are distinct constants, so at most one of them can match.
+static void emitSwitchHash(Translation *translation, Code *code, Instruction *instruction) {
+    int capacity = shortOperand(code, instruction, 0);
+    int entryCount = 0;
+    for (int i = 0; i < capacity; i++) {
+        if (targetOf(code, instruction, i + 1) != EMPTY_ENTRY) entryCount++;
+    }
+    if (entryCount == 0) {
+        emit(translation, "    vm.stackTop--;\n    goto L%d;\n", targetOf(code, instruction, 0));
+        return;
+    }
+
+    emit(translation, "    {\n        Value value = POP();\n");
+    for (int i = 0; i < capacity; i++) {
+        int target = targetOf(code, instruction, i + 1);
+        if (target == EMPTY_ENTRY) continue;
+
+        int constant = instructionOperand(code, instruction, 2 + i);
+        emit(translation, "        if (valuesEqual(value, constants[%d])) goto L%d;\n", constant, target);
+        translation->usesConstants = true;
+    }
+    emit(translation, "        goto L%d;\n    }\n", targetOf(code, instruction, 0));
+}
+
+static void translateInstruction(Translation *translation, Chunk *chunk, Code *code, Instruction *instruction,
+                                 int offset) {
+    uint8_t op = instruction->op;
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+            emit(translation, "    PUSH(");
+            emitConstant(translation, chunk, constantOperand(code, instruction, op == OP_CONSTANT_LONG));
+            emit(translation, ");\n");
+            break;
+        case OP_NIL:
+            emit(translation, "    PUSH(NIL_VAL);\n");
+            break;
+        case OP_TRUE:
+            emit(translation, "    PUSH(BOOL_VAL(true));\n");
+            break;
+        case OP_FALSE:
+            emit(translation, "    PUSH(BOOL_VAL(false));\n");
+            break;
+        case OP_POP:
+            emit(translation, "    vm.stackTop--;\n");
+            break;
+        case OP_GET_LOCAL:
+            emit(translation, "    PUSH(slots[%d]);\n", instructionOperand(code, instruction, 0));
+            translation->usesSlots = true;
+            break;
+        case OP_GET_LOCAL_LONG:
+            emit(translation, "    PUSH(slots[%d]);\n", shortOperand(code, instruction, 0));
+            translation->usesSlots = true;
+            break;
+        case OP_SET_LOCAL:
+            emit(translation, "    slots[%d] = PEEK(0);\n", instructionOperand(code, instruction, 0));
+            translation->usesSlots = true;
+            break;
+        case OP_SET_LOCAL_LONG:
+            emit(translation, "    slots[%d] = PEEK(0);\n", shortOperand(code, instruction, 0));
+            translation->usesSlots = true;
+            break;
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+            emitNamed(translation, offset, "opGetGlobal", constantOperand(code, instruction, op == OP_GET_GLOBAL_LONG));
+            break;
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:
+            emit(translation, "    opDefineGlobal(AS_STRING(constants[%d]));\n",
+                 constantOperand(code, instruction, op == OP_DEFINE_GLOBAL_LONG));
+            translation->usesConstants = true;
+            break;
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:
+            emitNamed(translation, offset, "opSetGlobal", constantOperand(code, instruction, op == OP_SET_GLOBAL_LONG));
+            break;
+        case OP_GET_UPVALUE:
+            emit(translation, "    PUSH(*frame->closure->upvalues[%d]->location);\n",
+                 instructionOperand(code, instruction, 0));
+            translation->usesFrame = true;
+            break;
+        case OP_SET_UPVALUE:
+            emit(translation, "    *frame->closure->upvalues[%d]->location = PEEK(0);\n",
+                 instructionOperand(code, instruction, 0));
+            translation->usesFrame = true;
+            break;
+        case OP_GET_PROPERTY:
+        case OP_GET_PROPERTY_LONG:
+            emitNamed(translation, offset, "opGetProperty",
+                      constantOperand(code, instruction, op == OP_GET_PROPERTY_LONG));
+            break;
+        case OP_SET_PROPERTY:
+        case OP_SET_PROPERTY_LONG:
+            emitNamed(translation, offset, "opSetProperty",
+                      constantOperand(code, instruction, op == OP_SET_PROPERTY_LONG));
+            break;
+        case OP_GET_SUPER:
+        case OP_GET_SUPER_LONG:
+            emitNamed(translation, offset, "opGetSuper", constantOperand(code, instruction, op == OP_GET_SUPER_LONG));
+            break;
+        case OP_EQUAL:
+            emit(translation, "    {\n        Value b = POP();\n        PEEK(0) = BOOL_VAL(valuesEqual(PEEK(0), b));\n    }\n");
+            break;
+        case OP_NOT_EQUAL:
+            emit(translation, "    {\n        Value b = POP();\n        PEEK(0) = BOOL_VAL(!valuesEqual(PEEK(0), b));\n    }\n");
+            break;
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE: {
+            // The or-equal forms are negations, like the interpreter's, so NaN behaves the same.
+            const char *operation = op == OP_GREATER ? "BOOL_VAL, >" : op == OP_GREATER_EQUAL ? "NOT_BOOL_VAL, <" :
+                                    op == OP_LESS ? "BOOL_VAL, <" : op == OP_LESS_EQUAL ? "NOT_BOOL_VAL, >" :
+                                    op == OP_SUBTRACT ? "NUMBER_VAL, -" : op == OP_MULTIPLY ? "NUMBER_VAL, *" :
+                                    "NUMBER_VAL, /";
+            emitAt(translation, offset);
+            emit(translation, "    CHECKED_OP(%s);\n", operation);
+            break;
+        }
+        case OP_GREATER_NUMBER:
+            emit(translation, "    NUMBER_OP(BOOL_VAL, >);\n");
+            break;
+        case OP_GREATER_EQUAL_NUMBER:
+            emit(translation, "    NUMBER_OP(NOT_BOOL_VAL, <);\n");
+            break;
+        case OP_LESS_NUMBER:
+            emit(translation, "    NUMBER_OP(BOOL_VAL, <);\n");
+            break;
+        case OP_LESS_EQUAL_NUMBER:
+            emit(translation, "    NUMBER_OP(NOT_BOOL_VAL, >);\n");
+            break;
+        case OP_ADD_NUMBER:
+            emit(translation, "    NUMBER_OP(NUMBER_VAL, +);\n");
+            break;
+        case OP_SUBTRACT_NUMBER:
+            emit(translation, "    NUMBER_OP(NUMBER_VAL, -);\n");
+            break;
+        case OP_MULTIPLY_NUMBER:
+            emit(translation, "    NUMBER_OP(NUMBER_VAL, *);\n");
+            break;
+        case OP_DIVIDE_NUMBER:
+            emit(translation, "    NUMBER_OP(NUMBER_VAL, /);\n");
+            break;
+        case OP_ADD:
+            emit(translation, "    if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {\n        NUMBER_OP(NUMBER_VAL, +);\n    } else {\n");
+            emitAt(translation, offset);
+            emit(translation, "    if (!opAdd()) return false;\n    }\n");
+            break;
+        case OP_CONCAT:
+            emitChecked(translation, offset, "opConcat", instructionOperand(code, instruction, 0));
+            break;
+        case OP_INTERPOLATE:
+            emit(translation, "    opInterpolate(%d);\n", instructionOperand(code, instruction, 0));
+            break;
+        case OP_CHECK_TYPE:
+            emitChecked(translation, offset, "opCheckType", instructionOperand(code, instruction, 0));
+            break;
+        case OP_NOT:
+            emit(translation, "    PEEK(0) = BOOL_VAL(IS_FALSEY(PEEK(0)));\n");
+            break;
+        case OP_NEGATE:
+            emitAt(translation, offset);
+            emit(translation, "    if (!IS_NUMBER(PEEK(0))) return opError(\"Operand must be a number.\");\n");
+            emit(translation, "    PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));\n");
+            break;
+        case OP_PRINT:
+            emit(translation, "    printValue(POP());\n    printf(\"\\n\");\n");
+            break;
+        case OP_JUMP:
+        case OP_LOOP:
+            emit(translation, "    goto L%d;\n", instruction->target);
+            break;
+        case OP_JUMP_IF_FALSE:
+            emit(translation, "    if (IS_FALSEY(PEEK(0))) goto L%d;\n", instruction->target);
+            break;
+        case OP_FOR_PREP: {
+            int slot = instructionOperand(code, instruction, 0);
+            int limit = instructionOperand(code, instruction, 1);
+            emitAt(translation, offset);
+            emit(translation, "    if (!IS_NUMBER(slots[%d]) || !IS_NUMBER(slots[%d])) return opError(\"Operands must be numbers.\");\n",
+                 slot, limit);
+            emit(translation, "    if (!(AS_NUMBER(slots[%d]) < AS_NUMBER(slots[%d]))) goto L%d;\n", slot, limit,
+                 instruction->target);
+            translation->usesSlots = true;
+            break;
+        }
+        case OP_FOR_LOOP: {
+            int slot = instructionOperand(code, instruction, 0);
+            int limit = instructionOperand(code, instruction, 1);
+            emit(translation, "    {\n        double counter = AS_NUMBER(slots[%d]) + ", slot);
+            emitNumber(translation, chunk, instructionOperand(code, instruction, 2));
+            emit(translation, ";\n        slots[%d] = NUMBER_VAL(counter);\n", slot);
+            emit(translation, "        if (counter < AS_NUMBER(slots[%d])) goto L%d;\n    }\n", limit, instruction->target);
+            translation->usesSlots = true;
+            break;
+        }
+        case OP_SWITCH_TABLE:
+            emitSwitchTable(translation, chunk, code, instruction);
+            break;
+        case OP_SWITCH_HASH:
+            emitSwitchHash(translation, code, instruction);
+            break;
+        case OP_IMPORT:
+        case OP_IMPORT_LONG:
+            emitNamed(translation, offset, "opImport", constantOperand(code, instruction, op == OP_IMPORT_LONG));
+            break;
+        case OP_CALL:
+            emitChecked(translation, offset, "opCall", instructionOperand(code, instruction, 0));
+            break;
+        case OP_CALL_DIRECT:
+            emitChecked(translation, offset, "opCallDirect", instructionOperand(code, instruction, 0));
+            break;
+        case OP_INVOKE:
+        case OP_INVOKE_LONG:
+        case OP_SUPER_INVOKE:
+        case OP_SUPER_INVOKE_LONG: {
+            bool isLong = op == OP_INVOKE_LONG || op == OP_SUPER_INVOKE_LONG;
+            const char *call = op == OP_INVOKE || op == OP_INVOKE_LONG ? "opInvoke" : "opSuperInvoke";
+            emitInvoke(translation, offset, call, constantOperand(code, instruction, isLong),
+                       instructionOperand(code, instruction, isLong ? 3 : 1));
+            break;
+        }
+        case OP_INVOKE_DIRECT:
+            emitAt(translation, offset);
+            emit(translation, "    if (!opInvokeDirect(AS_FUNCTION(constants[%d]), %d)) return false;\n",
+                 instructionOperand(code, instruction, 0), instructionOperand(code, instruction, 1));
+            translation->usesConstants = true;
+            break;
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG: {
+            bool isLong = op == OP_CLOSURE_LONG;
+            emit(translation, "    opClosure(AS_FUNCTION(constants[%d]), code + %d);\n",
+                 constantOperand(code, instruction, isLong), offset + (isLong ? 4 : 2));
+            translation->usesConstants = true;
+            translation->usesCode = true;
+            break;
+        }
+        case OP_CLOSE_UPVALUE:
+            emit(translation, "    opCloseUpvalue();\n");
+            break;
+        case OP_RETURN:
+            emit(translation, "    return opReturn();\n");
+            break;
+        case OP_CLASS:
+        case OP_CLASS_LONG:
+            emit(translation, "    PUSH(OBJ_VAL(newClass(AS_STRING(constants[%d]))));\n",
+                 constantOperand(code, instruction, op == OP_CLASS_LONG));
+            translation->usesConstants = true;
+            break;
+        case OP_INHERIT:
+            emitAt(translation, offset);
+            emit(translation, "    if (!opInherit()) return false;\n");
+            break;
+        case OP_METHOD:
+        case OP_METHOD_LONG:
+            emit(translation, "    opMethod(AS_STRING(constants[%d]));\n",
+                 constantOperand(code, instruction, op == OP_METHOD_LONG));
+            translation->usesConstants = true;
+            break;
+    }
+}
+
+// Each instruction becomes a few lines of C, and every jump target gets a label named after its instruction.
+void translateFunction(FILE *file, ObjFunction *function, int index) {
+    Chunk *chunk = &function->chunk;
+    Code code;
+    initCode(&code, chunk);
+    decodeChunk(&code);
+    findJumpTargets(&code);
+
+    Translation translation = {NULL, 0, 0, false, false, false, false};
+    int offset = 0;
+    for (int i = 0; i < code.count; i++) {
+        if (code.isTarget[i]) emit(&translation, "L%d:\n", i);
+        translateInstruction(&translation, chunk, &code, &code.instructions[i], offset);
+        offset += instructionLength(chunk, offset);
+    }
+    // Nothing runs past the end of a chunk, but a body that ends in a loop still needs a return for the C compiler.
+    if (code.isTarget[code.count]) emit(&translation, "L%d:\n", code.count);
+    if (code.isTarget[code.count] || code.instructions[code.count - 1].op != OP_RETURN) {
+        emit(&translation, "    return false;\n");
+    }
+
+    fprintf(file, "static bool function%d() {\n", index);
+    if (translation.usesFrame || translation.usesSlots || translation.usesConstants || translation.usesCode) {
+        fprintf(file, "    CallFrame *frame = &vm.frames[vm.frameCount - 1];\n");
+    }
+    if (translation.usesSlots) fprintf(file, "    Value *slots = frame->slots;\n");
+    if (translation.usesConstants) {
+        fprintf(file, "    Value *constants = frame->closure->function->chunk.constants.values;\n");
+    }
+    if (translation.usesCode) fprintf(file, "    uint8_t *code = frame->closure->function->chunk.code;\n");
+    fprintf(file, "\n%.*s}\n\n", translation.length, translation.text);
+
+    FREE_ARRAY(char, translation.text, translation.capacity);
+    freeCode(&code);
+}
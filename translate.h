@@ -0,0 +1,14 @@
+//
+// Created by Mic Pringle on 19/10/2026.
+//
+
+#ifndef CLOX_TRANSLATE_H
+#define CLOX_TRANSLATE_H
+
+#include <stdio.h>
+
+#include "object.h"
+
+void translateFunction(FILE *file, ObjFunction *function, int index);
+
+#endif
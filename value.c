@@ -60,6 +60,32 @@ void printValue(Value value) {
 #endif
 }
 
+// Writes a value the way printValue shows it, returning the length it needs the way snprintf does.
+int formatValue(char *buffer, size_t size, Value value) {
+#ifdef NAN_BOXING
+    if (IS_BOOL(value)) {
+        return snprintf(buffer, size, "%s", AS_BOOL(value) ? "true" : "false");
+    } else if (IS_NIL(value)) {
+        return snprintf(buffer, size, "nil");
+    } else if (IS_NUMBER(value)) {
+        return snprintf(buffer, size, "%g", AS_NUMBER(value));
+    }
+    return formatObject(buffer, size, value);
+#else
+    switch (value.type) {
+        case VAL_BOOL:
+            return snprintf(buffer, size, "%s", AS_BOOL(value) ? "true" : "false");
+        case VAL_NIL:
+            return snprintf(buffer, size, "nil");
+        case VAL_NUMBER:
+            return snprintf(buffer, size, "%g", AS_NUMBER(value));
+        case VAL_OBJ:
+            return formatObject(buffer, size, value);
+    }
+    return 0;
+#endif
+}
+
 bool valuesEqual(Value a, Value b) {
 #ifdef NAN_BOXING
     if (IS_NUMBER(a) && IS_NUMBER(b)) {
@@ -82,3 +108,28 @@ bool valuesEqual(Value a, Value b) {
     }
 #endif
 }
+
+static uint32_t hashBits(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    return (uint32_t) bits;
+}
+
+uint32_t hashValue(Value value) {
+    if (IS_OBJ(value)) {
+        if (IS_STRING(value)) return AS_STRING(value)->hash;
+        return hashBits((uint64_t) (uintptr_t) AS_OBJ(value));
+    }
+
+    if (IS_NUMBER(value)) {
+        // 0 and -0 are equal, so they must hash the same.
+        double number = AS_NUMBER(value) == 0 ? 0 : AS_NUMBER(value);
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(double));
+        return hashBits(bits);
+    }
+
+    if (IS_BOOL(value)) return AS_BOOL(value) ? 3 : 2;
+    return 1;
+}
@@ -96,6 +96,8 @@ typedef struct {
 
 bool valuesEqual(Value a, Value b);
 
+uint32_t hashValue(Value value);
+
 void initValueArray(ValueArray *array);
 
 void writeValueArray(ValueArray *array, Value value);
@@ -104,4 +106,6 @@ void freeValueArray(ValueArray *array);
 
 void printValue(Value value);
 
+int formatValue(char *buffer, size_t size, Value value);
+
 #endif
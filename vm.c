@@ -2,16 +2,20 @@
 // Created by Mic Pringle on 03/12/2022.
 //
 
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include "cache.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
 #include "object.h"
 #include "memory.h"
+#include "runtime.h"
 #include "vm.h"
 
 VM vm;
@@ -37,7 +41,7 @@ static void runtimeError(const char *format, ...) {
         CallFrame *frame = &vm.frames[i];
         ObjFunction *function = frame->closure->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+        fprintf(stderr, "[line %d] in ", getLine(&function->chunk, instruction));
         if (function->name == NULL) {
             fprintf(stderr, "script\n");
         } else {
@@ -68,6 +72,10 @@ void initVM() {
 
     initTable(&vm.globals);
     initTable(&vm.strings);
+    initTable(&vm.modules);
+    vm.scriptCount = 0;
+    vm.scriptBytes = 0;
+    vm.scriptClock = 0;
 
     vm.initString = NULL;
     vm.initString = copyString("init", 4);
@@ -78,7 +86,12 @@ void initVM() {
 void freeVM() {
     freeTable(&vm.globals);
     freeTable(&vm.strings);
+    freeTable(&vm.modules);
+    for (int i = 0; i < vm.scriptCount; i++) {
+        FREE_ARRAY(char, vm.scripts[i].source, vm.scripts[i].length + 1);
+    }
     freeObjects();
+    freeFrozen();
 }
 
 void push(Value value) {
@@ -95,13 +108,8 @@ static Value peek(int distance) {
     return vm.stackTop[-1 - distance];
 }
 
-static bool call(ObjClosure *closure, int argCount) {
-    if (argCount != closure->function->arity) {
-        runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
-        return false;
-    }
-
-    if (vm.frameCount == FRAMES_MAX) {
+static bool pushFrame(ObjClosure *closure, int argCount) {
+    if (vm.frameCount == FRAMES_MAX || vm.stackTop + closure->function->slotCount > vm.stack + STACK_MAX) {
         runtimeError("Stack overflow.");
         return false;
     }
@@ -113,6 +121,20 @@ static bool call(ObjClosure *closure, int argCount) {
     return true;
 }
 
+static bool call(ObjClosure *closure, int argCount) {
+    if (closure->function->lazy != NULL && !compileLazy(closure->function)) {
+        runtimeError("Couldn't compile %s().", closure->function->name->chars);
+        return false;
+    }
+
+    if (argCount != closure->function->arity) {
+        runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
+        return false;
+    }
+
+    return pushFrame(closure, argCount);
+}
+
 static bool callValue(Value callee, int argCount) {
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee)) {
@@ -228,6 +250,7 @@ static void closeUpvalues(Value *last) {
 static void defineMethod(ObjString *name) {
     Value method = peek(0);
     ObjClass *klass = AS_CLASS(peek(1));
+    AS_CLOSURE(method)->function->klass = klass;
     tableSet(&klass->methods, name, method);
     pop();
 }
@@ -252,13 +275,249 @@ static void concatenate() {
     push(OBJ_VAL(result));
 }
 
-static InterpretResult run() {
+// Adds a chain of + in one step. All strings are joined with a single allocation. Otherwise the chain has to be all
+// numbers, since any other mix would fail at one of the pairs along the way.
+static bool addAll(int count) {
+    Value *pieces = vm.stackTop - count;
+    bool isStrings = true;
+    bool isNumbers = true;
+    for (int i = 0; i < count; i++) {
+        isStrings = isStrings && IS_STRING(pieces[i]);
+        isNumbers = isNumbers && IS_NUMBER(pieces[i]);
+    }
+
+    if (isStrings) {
+        ObjString *result = joinValues(pieces, count);
+        vm.stackTop = pieces;
+        push(OBJ_VAL(result));
+        return true;
+    }
+    if (!isNumbers) return false;
+
+    double sum = AS_NUMBER(pieces[0]);
+    for (int i = 1; i < count; i++) {
+        sum += AS_NUMBER(pieces[i]);
+    }
+    vm.stackTop = pieces;
+    push(NUMBER_VAL(sum));
+    return true;
+}
+
+static bool checkKind(Value value, TypeKind kind) {
+    switch (kind) {
+        case KIND_NUMBER:
+            if (IS_NUMBER(value)) return true;
+            runtimeError("Value must be a number.");
+            return false;
+        case KIND_STRING:
+            if (IS_STRING(value)) return true;
+            runtimeError("Value must be a string.");
+            return false;
+        case KIND_BOOL:
+            if (IS_BOOL(value)) return true;
+            runtimeError("Value must be a Boolean.");
+            return false;
+        default:
+            return true;
+    }
+}
+
+// Modules are keyed by both the path they were imported with and their canonical path, so repeat imports are a single
+// lookup. A module is registered before it runs, which turns a cyclic import into a no-op.
+static bool importModule(ObjString *path) {
+    char canonical[PATH_MAX];
+    if (realpath(path->chars, canonical) == NULL) {
+        runtimeError("Couldn't open module \"%s\".", path->chars);
+        return false;
+    }
+
+    ObjString *key = copyString(canonical, (int) strlen(canonical));
+    push(OBJ_VAL(key));
+    Value module;
+    if (tableGet(&vm.modules, key, &module)) {
+        tableSet(&vm.modules, path, module);
+        pop();
+        push(NIL_VAL);
+        return true;
+    }
+
+    const char *source = mapSource(canonical);
+    if (source == NULL) {
+        runtimeError("Couldn't open module \"%s\".", path->chars);
+        return false;
+    }
+
+    // The importer can still redefine anything the module binds to.
+    compilerOptions.isClosedWorld = false;
+    ObjFunction *function = compilerOptions.isCaching ? loadCache(canonical, source) : NULL;
+    if (function == NULL) {
+        function = compile(canonical, source);
+        if (function == NULL) {
+            runtimeError("Couldn't compile module \"%s\".", path->chars);
+            return false;
+        }
+        if (compilerOptions.isCaching) {
+            push(OBJ_VAL(function));
+            writeCache(canonical, source, function);
+            pop();
+        }
+    }
+
+    push(OBJ_VAL(function));
+    ObjClosure *closure = newClosure(function);
+    pop();
+    pop();
+    push(OBJ_VAL(closure));
+    tableSet(&vm.modules, key, OBJ_VAL(closure));
+    tableSet(&vm.modules, path, OBJ_VAL(closure));
+    return call(closure, 0);
+}
+
+// The operations below are shared by run() and the C that --emit-c writes, so both behave the same.
+bool opError(const char *message) {
+    runtimeError("%s", message);
+    return false;
+}
+
+bool opGetGlobal(ObjString *name) {
+    Value value;
+    if (!tableGet(&vm.globals, name, &value)) {
+        runtimeError("Undefined variable '%s'.", name->chars);
+        return false;
+    }
+    push(value);
+    return true;
+}
+
+void opDefineGlobal(ObjString *name) {
+    tableSet(&vm.globals, name, peek(0));
+    pop();
+}
+
+bool opSetGlobal(ObjString *name) {
+    if (tableSet(&vm.globals, name, peek(0))) {
+        tableDelete(&vm.globals, name);
+        runtimeError("Undefined variable '%s'.", name->chars);
+        return false;
+    }
+    return true;
+}
+
+bool opGetProperty(ObjString *name) {
+    if (!IS_INSTANCE(peek(0))) {
+        runtimeError("Only instances have properties.");
+        return false;
+    }
+
+    ObjInstance *instance = AS_INSTANCE(peek(0));
+    Value value;
+    if (tableGet(&instance->fields, name, &value)) {
+        pop();
+        push(value);
+        return true;
+    }
+    return bindMethod(instance->klass, name);
+}
+
+bool opSetProperty(ObjString *name) {
+    if (!IS_INSTANCE(peek(1))) {
+        runtimeError("Only instances have fields.");
+        return false;
+    }
+
+    ObjInstance *instance = AS_INSTANCE(peek(1));
+    tableSet(&instance->fields, name, peek(0));
+    Value value = pop();
+    pop();
+    push(value);
+    return true;
+}
+
+bool opGetSuper(ObjString *name) {
+    ObjClass *superclass = AS_CLASS(pop());
+    return bindMethod(superclass, name);
+}
+
+bool opAdd() {
+    if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+        concatenate();
+    } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+        double b = AS_NUMBER(pop());
+        double a = AS_NUMBER(pop());
+        push(NUMBER_VAL(a + b));
+    } else {
+        runtimeError("Operands must be two numbers or two strings.");
+        return false;
+    }
+    return true;
+}
+
+bool opConcat(int count) {
+    if (!addAll(count)) {
+        runtimeError("Operands must be two numbers or two strings.");
+        return false;
+    }
+    return true;
+}
+
+void opInterpolate(int count) {
+    ObjString *result = joinValues(vm.stackTop - count, count);
+    vm.stackTop -= count;
+    push(OBJ_VAL(result));
+}
+
+bool opCheckType(TypeKind kind) {
+    return checkKind(peek(0), kind);
+}
+
+bool opInherit() {
+    Value superclass = peek(1);
+    if (!IS_CLASS(superclass)) {
+        runtimeError("Superclass must be a class.");
+        return false;
+    }
+    ObjClass *subclass = AS_CLASS(peek(0));
+    tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+    pop();
+    return true;
+}
+
+void opMethod(ObjString *name) {
+    defineMethod(name);
+}
+
+// The captures are the instruction's pairs of local flag and index.
+void opClosure(ObjFunction *function, const uint8_t *captures) {
+    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    ObjClosure *closure = newClosure(function);
+    push(OBJ_VAL(closure));
+    if (function->upvalueCount == 0) function->closure = closure;
+    for (int i = 0; i < closure->upvalueCount; i++) {
+        uint8_t isLocal = captures[i * 2];
+        uint8_t index = captures[i * 2 + 1];
+        if (isLocal) {
+            closure->upvalues[i] = captureUpvalue(frame->slots + index);
+        } else {
+            closure->upvalues[i] = frame->closure->upvalues[index];
+        }
+    }
+}
+
+void opCloseUpvalue() {
+    closeUpvalues(vm.stackTop - 1);
+    pop();
+}
+
+static InterpretResult run(int baseFrame) {
     CallFrame *frame = &vm.frames[vm.frameCount - 1];
 
 #define READ_BYTE() (*frame->ip++)
 #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
 #define READ_SHORT() (frame->ip += 2, (uint16_t) ((frame->ip[-2] << 8) | frame->ip[-1]))
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_LONG() (frame->ip += 3, (uint32_t) ((frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_CONSTANT_LONG() (frame->closure->function->chunk.constants.values[READ_LONG()])
+#define READ_NAME(op) AS_STRING(instruction == (op) ? READ_CONSTANT() : READ_CONSTANT_LONG())
 #define BINARY_OP(valueType, op)                        \
 do {                                                    \
     if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {   \
@@ -269,6 +528,17 @@ do {                                                    \
     double a = AS_NUMBER(pop());                        \
     push(valueType(a op b));                            \
 } while (false)
+// NUMBER_OP and NOT_BOOL_VAL come from runtime.h. The compiler only emits the _NUMBER instructions for operands it has
+// proven are numbers.
+// A function translated to C by --emit-c runs to completion as soon as it's called.
+#define ENTER_FRAME()                                                               \
+do {                                                                                \
+    frame = &vm.frames[vm.frameCount - 1];                                          \
+    if (frame->closure->function->compiled != NULL) {                               \
+        if (!frame->closure->function->compiled()) return INTERPRET_RUNTIME_ERROR;  \
+        frame = &vm.frames[vm.frameCount - 1];                                      \
+    }                                                                               \
+} while (false)
 
     for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
@@ -289,6 +559,11 @@ do {                                                    \
                 push(constant);
                 break;
             }
+            case OP_CONSTANT_LONG: {
+                Value constant = READ_CONSTANT_LONG();
+                push(constant);
+                break;
+            }
             case OP_NIL:
                 push(NIL_VAL);
                 break;
@@ -311,31 +586,28 @@ do {                                                    \
                 frame->slots[slot] = peek(0);
                 break;
             }
-            case OP_GET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(value);
+            case OP_GET_LOCAL_LONG: {
+                uint16_t slot = READ_SHORT();
+                push(frame->slots[slot]);
                 break;
             }
-            case OP_DEFINE_GLOBAL: {
-                ObjString *name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
+            case OP_SET_LOCAL_LONG: {
+                uint16_t slot = READ_SHORT();
+                frame->slots[slot] = peek(0);
                 break;
             }
-            case OP_SET_GLOBAL: {
-                ObjString *name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+            case OP_GET_GLOBAL:
+            case OP_GET_GLOBAL_LONG:
+                if (!opGetGlobal(READ_NAME(OP_GET_GLOBAL))) return INTERPRET_RUNTIME_ERROR;
+                break;
+            case OP_DEFINE_GLOBAL:
+            case OP_DEFINE_GLOBAL_LONG:
+                opDefineGlobal(READ_NAME(OP_DEFINE_GLOBAL));
+                break;
+            case OP_SET_GLOBAL:
+            case OP_SET_GLOBAL_LONG:
+                if (!opSetGlobal(READ_NAME(OP_SET_GLOBAL))) return INTERPRET_RUNTIME_ERROR;
                 break;
-            }
             case OP_GET_UPVALUE: {
                 uint8_t slot = READ_BYTE();
                 push(*frame->closure->upvalues[slot]->location);
@@ -346,72 +618,56 @@ do {                                                    \
                 *frame->closure->upvalues[slot]->location = peek(0);
                 break;
             }
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(0))) {
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-
-                ObjInstance *instance = AS_INSTANCE(peek(0));
-                ObjString *name = READ_STRING();
-
-                Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop();
-                    push(value);
-                    break;
-                }
-
-                if (!bindMethod(instance->klass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+            case OP_GET_PROPERTY:
+            case OP_GET_PROPERTY_LONG:
+                if (!opGetProperty(READ_NAME(OP_GET_PROPERTY))) return INTERPRET_RUNTIME_ERROR;
                 break;
-            }
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) {
-                    runtimeError("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-
-                ObjInstance *instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
-                Value value = pop();
-                pop();
-                push(value);
+            case OP_SET_PROPERTY:
+            case OP_SET_PROPERTY_LONG:
+                if (!opSetProperty(READ_NAME(OP_SET_PROPERTY))) return INTERPRET_RUNTIME_ERROR;
                 break;
-            }
-            case OP_GET_SUPER: {
-                ObjString *name = READ_STRING();
-                ObjClass *superclass = AS_CLASS(pop());
-                if (!bindMethod(superclass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+            case OP_GET_SUPER:
+            case OP_GET_SUPER_LONG:
+                if (!opGetSuper(READ_NAME(OP_GET_SUPER))) return INTERPRET_RUNTIME_ERROR;
                 break;
-            }
             case OP_EQUAL: {
                 Value b = pop();
                 Value a = pop();
                 push(BOOL_VAL(valuesEqual(a, b)));
                 break;
             }
+            case OP_NOT_EQUAL: {
+                Value b = pop();
+                Value a = pop();
+                push(BOOL_VAL(!valuesEqual(a, b)));
+                break;
+            }
             case OP_GREATER:
                 BINARY_OP(BOOL_VAL, >);
                 break;
+            case OP_GREATER_EQUAL:
+                // Defined as !(a < b), like the OP_LESS OP_NOT pair it replaces, so NaN behaves the same.
+                BINARY_OP(NOT_BOOL_VAL, <);
+                break;
             case OP_LESS:
                 BINARY_OP(BOOL_VAL, <);
                 break;
+            case OP_LESS_EQUAL:
+                BINARY_OP(NOT_BOOL_VAL, >);
+                break;
             case OP_ADD:
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                } else {
-                    runtimeError("Operands must be two numbers or two strings.");
+                if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+                    NUMBER_OP(NUMBER_VAL, +);
+                } else if (!opAdd()) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 break;
+            case OP_CONCAT:
+                if (!opConcat(READ_BYTE())) return INTERPRET_RUNTIME_ERROR;
+                break;
+            case OP_INTERPOLATE:
+                opInterpolate(READ_BYTE());
+                break;
             case OP_SUBTRACT:
                 BINARY_OP(NUMBER_VAL, -);
                 break;
@@ -421,6 +677,33 @@ do {                                                    \
             case OP_DIVIDE:
                 BINARY_OP(NUMBER_VAL, /);
                 break;
+            case OP_GREATER_NUMBER:
+                NUMBER_OP(BOOL_VAL, >);
+                break;
+            case OP_GREATER_EQUAL_NUMBER:
+                NUMBER_OP(NOT_BOOL_VAL, <);
+                break;
+            case OP_LESS_NUMBER:
+                NUMBER_OP(BOOL_VAL, <);
+                break;
+            case OP_LESS_EQUAL_NUMBER:
+                NUMBER_OP(NOT_BOOL_VAL, >);
+                break;
+            case OP_ADD_NUMBER:
+                NUMBER_OP(NUMBER_VAL, +);
+                break;
+            case OP_SUBTRACT_NUMBER:
+                NUMBER_OP(NUMBER_VAL, -);
+                break;
+            case OP_MULTIPLY_NUMBER:
+                NUMBER_OP(NUMBER_VAL, *);
+                break;
+            case OP_DIVIDE_NUMBER:
+                NUMBER_OP(NUMBER_VAL, /);
+                break;
+            case OP_CHECK_TYPE:
+                if (!opCheckType(READ_BYTE())) return INTERPRET_RUNTIME_ERROR;
+                break;
             case OP_NOT:
                 push(BOOL_VAL(isFalsey(pop())));
                 break;
@@ -451,51 +734,156 @@ do {                                                    \
                 frame->ip -= offset;
                 break;
             }
+            case OP_JUMP_LONG: {
+                uint32_t offset = READ_LONG();
+                frame->ip += offset;
+                break;
+            }
+            case OP_JUMP_IF_FALSE_LONG: {
+                uint32_t offset = READ_LONG();
+                if (isFalsey(peek(0))) frame->ip += offset;
+                break;
+            }
+            case OP_LOOP_LONG: {
+                uint32_t offset = READ_LONG();
+                frame->ip -= offset;
+                break;
+            }
+            case OP_FOR_PREP: {
+                uint8_t slot = READ_BYTE();
+                uint8_t limit = READ_BYTE();
+                uint16_t offset = READ_SHORT();
+                if (!IS_NUMBER(frame->slots[slot]) || !IS_NUMBER(frame->slots[limit])) {
+                    runtimeError("Operands must be numbers.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (!(AS_NUMBER(frame->slots[slot]) < AS_NUMBER(frame->slots[limit]))) frame->ip += offset;
+                break;
+            }
+            case OP_FOR_LOOP: {
+                uint8_t slot = READ_BYTE();
+                uint8_t limit = READ_BYTE();
+                double step = AS_NUMBER(READ_CONSTANT());
+                uint16_t offset = READ_SHORT();
+
+                // OP_FOR_PREP already checked the operand types and the body never writes them.
+                double counter = AS_NUMBER(frame->slots[slot]) + step;
+                frame->slots[slot] = NUMBER_VAL(counter);
+                if (counter < AS_NUMBER(frame->slots[limit])) frame->ip -= offset;
+                break;
+            }
+            case OP_SWITCH_TABLE: {
+                uint8_t *dispatch = frame->ip - 1;
+                double min = AS_NUMBER(READ_CONSTANT());
+                uint16_t count = READ_SHORT();
+                uint16_t distance = READ_SHORT();
+                uint8_t *targets = frame->ip;
+                Value value = pop();
+
+                if (IS_NUMBER(value)) {
+                    double index = AS_NUMBER(value) - min;
+                    if (index >= 0 && index < count && index == (int) index) {
+                        uint8_t *target = targets + (int) index * 2;
+                        distance = (uint16_t) ((target[0] << 8) | target[1]);
+                    }
+                }
+
+                frame->ip = distance == 0 ? targets + count * 2 : dispatch - distance;
+                break;
+            }
+            case OP_SWITCH_HASH: {
+                uint8_t *dispatch = frame->ip - 1;
+                uint16_t capacity = READ_SHORT();
+                uint16_t distance = READ_SHORT();
+                uint8_t *entries = frame->ip;
+                Value value = pop();
+
+                uint32_t index = hashValue(value) & (capacity - 1);
+                for (;;) {
+                    uint8_t *entry = entries + index * 3;
+                    uint16_t target = (uint16_t) ((entry[1] << 8) | entry[2]);
+                    if (target == 0) break;
+                    if (valuesEqual(frame->closure->function->chunk.constants.values[entry[0]], value)) {
+                        distance = target;
+                        break;
+                    }
+                    index = (index + 1) & (capacity - 1);
+                }
+
+                frame->ip = distance == 0 ? entries + capacity * 3 : dispatch - distance;
+                break;
+            }
+            case OP_IMPORT:
+            case OP_IMPORT_LONG: {
+                ObjString *path = READ_NAME(OP_IMPORT);
+                Value module;
+                if (tableGet(&vm.modules, path, &module)) {
+                    push(NIL_VAL);
+                    break;
+                }
+                if (!importModule(path)) return INTERPRET_RUNTIME_ERROR;
+                ENTER_FRAME();
+                break;
+            }
+            case OP_CALL_DIRECT: {
+                // The compiler checked the arity of this top-level function, whose declaration has always run by now.
+                int argCount = READ_BYTE();
+                ObjClosure *closure = AS_FUNCTION(peek(argCount))->closure;
+                vm.stackTop[-argCount - 1] = OBJ_VAL(closure);
+                if (!pushFrame(closure, argCount)) return INTERPRET_RUNTIME_ERROR;
+                ENTER_FRAME();
+                break;
+            }
+            case OP_INVOKE_DIRECT: {
+                // Only an instance of the class the method was defined on is sure to reach it.
+                ObjFunction *method = AS_FUNCTION(READ_CONSTANT());
+                int argCount = READ_BYTE();
+                Value receiver = peek(argCount);
+                bool isHit = IS_INSTANCE(receiver) && AS_INSTANCE(receiver)->klass == method->klass;
+                if (!(isHit ? pushFrame(method->closure, argCount) : invoke(method->name, argCount))) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                ENTER_FRAME();
+                break;
+            }
             case OP_CALL: {
                 int argCount = READ_BYTE();
                 if (!callValue(peek(argCount), argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
+                ENTER_FRAME();
                 break;
             }
-            case OP_INVOKE: {
-                ObjString *method = READ_STRING();
+            case OP_INVOKE:
+            case OP_INVOKE_LONG: {
+                ObjString *method = READ_NAME(OP_INVOKE);
                 int argCount = READ_BYTE();
                 if (!invoke(method, argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
+                ENTER_FRAME();
                 break;
             }
-            case OP_SUPER_INVOKE: {
-                ObjString *method = READ_STRING();
+            case OP_SUPER_INVOKE:
+            case OP_SUPER_INVOKE_LONG: {
+                ObjString *method = READ_NAME(OP_SUPER_INVOKE);
                 int argCount = READ_BYTE();
                 ObjClass *superclass = AS_CLASS(pop());
                 if (!invokeFromClass(superclass, method, argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
+                ENTER_FRAME();
                 break;
             }
-            case OP_CLOSURE: {
-                ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure *closure = newClosure(function);
-                push(OBJ_VAL(closure));
-                for (int i = 0; i < closure->upvalueCount; i++) {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (isLocal) {
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
-                    } else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
-                }
+            case OP_CLOSURE:
+            case OP_CLOSURE_LONG: {
+                ObjFunction *function = AS_FUNCTION(instruction == OP_CLOSURE ? READ_CONSTANT() : READ_CONSTANT_LONG());
+                opClosure(function, frame->ip);
+                frame->ip += function->upvalueCount * 2;
                 break;
             }
             case OP_CLOSE_UPVALUE:
-                closeUpvalues(vm.stackTop - 1);
-                pop();
+                opCloseUpvalue();
                 break;
             case OP_RETURN: {
                 Value result = pop();
@@ -508,25 +896,20 @@ do {                                                    \
 
                 vm.stackTop = frame->slots;
                 push(result);
+                if (vm.frameCount == baseFrame) return INTERPRET_OK;
                 frame = &vm.frames[vm.frameCount - 1];
                 break;
             }
             case OP_CLASS:
-                push(OBJ_VAL(newClass(READ_STRING())));
+            case OP_CLASS_LONG:
+                push(OBJ_VAL(newClass(READ_NAME(OP_CLASS))));
                 break;
-            case OP_INHERIT: {
-                Value superclass = peek(1);
-                if (!IS_CLASS(superclass)) {
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                ObjClass *subclass = AS_CLASS(peek(0));
-                tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop();
+            case OP_INHERIT:
+                if (!opInherit()) return INTERPRET_RUNTIME_ERROR;
                 break;
-            }
             case OP_METHOD:
-                defineMethod(READ_STRING());
+            case OP_METHOD_LONG:
+                opMethod(READ_NAME(OP_METHOD));
                 break;
         }
     }
@@ -535,11 +918,80 @@ do {                                                    \
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_LONG
+#undef READ_CONSTANT_LONG
+#undef READ_NAME
 #undef BINARY_OP
+#undef ENTER_FRAME
 }
 
-InterpretResult interpret(const char *source) {
-    ObjFunction *function = compile(source);
+// Compiled code waits on each call, so the frame the call pushed runs here until it returns. A native, or a class
+// without an initializer, pushes no frame and has already finished.
+static bool completeCall(int frameCount) {
+    if (vm.frameCount == frameCount) return true;
+
+    ObjFunction *function = vm.frames[vm.frameCount - 1].closure->function;
+    if (function->compiled != NULL) return function->compiled();
+    return run(frameCount) == INTERPRET_OK;
+}
+
+bool opCall(int argCount) {
+    int frameCount = vm.frameCount;
+    return callValue(peek(argCount), argCount) && completeCall(frameCount);
+}
+
+bool opCallDirect(int argCount) {
+    int frameCount = vm.frameCount;
+    ObjClosure *closure = AS_FUNCTION(peek(argCount))->closure;
+    vm.stackTop[-argCount - 1] = OBJ_VAL(closure);
+    return pushFrame(closure, argCount) && completeCall(frameCount);
+}
+
+bool opInvoke(ObjString *name, int argCount) {
+    int frameCount = vm.frameCount;
+    return invoke(name, argCount) && completeCall(frameCount);
+}
+
+bool opInvokeDirect(ObjFunction *method, int argCount) {
+    int frameCount = vm.frameCount;
+    Value receiver = peek(argCount);
+    bool isHit = IS_INSTANCE(receiver) && AS_INSTANCE(receiver)->klass == method->klass;
+    return (isHit ? pushFrame(method->closure, argCount) : invoke(method->name, argCount)) && completeCall(frameCount);
+}
+
+bool opSuperInvoke(ObjString *name, int argCount) {
+    int frameCount = vm.frameCount;
+    ObjClass *superclass = AS_CLASS(pop());
+    return invokeFromClass(superclass, name, argCount) && completeCall(frameCount);
+}
+
+bool opImport(ObjString *path) {
+    Value module;
+    if (tableGet(&vm.modules, path, &module)) {
+        push(NIL_VAL);
+        return true;
+    }
+
+    int frameCount = vm.frameCount;
+    return importModule(path) && completeCall(frameCount);
+}
+
+bool opReturn() {
+    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    Value result = pop();
+    closeUpvalues(frame->slots);
+    vm.frameCount--;
+    if (vm.frameCount == 0) {
+        pop();
+        return true;
+    }
+
+    vm.stackTop = frame->slots;
+    push(result);
+    return true;
+}
+
+static InterpretResult runFunction(ObjFunction *function) {
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
     push(OBJ_VAL(function));
@@ -548,5 +1000,143 @@ InterpretResult interpret(const char *source) {
     push(OBJ_VAL(closure));
     call(closure, 0);
 
-    return run();
+    if (function->compiled != NULL) return function->compiled() ? INTERPRET_OK : INTERPRET_RUNTIME_ERROR;
+    return run(0);
+}
+
+static uint32_t hashScript(const char *source, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t) source[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static void evictScript() {
+    int oldest = 0;
+    for (int i = 1; i < vm.scriptCount; i++) {
+        if (vm.scripts[i].lastUse < vm.scripts[oldest].lastUse) oldest = i;
+    }
+
+    // Dropping the entry unroots the function, so the next collection frees its frozen code.
+    CachedScript *script = &vm.scripts[oldest];
+    FREE_ARRAY(char, script->source, script->length + 1);
+    vm.scriptBytes -= script->size;
+    *script = vm.scripts[--vm.scriptCount];
+}
+
+// Hosts tend to interpret the same few scripts over and over, so the most recently used compiled scripts are kept and
+// the least recently used ones make way once the cache is full. Its size is bounded by entries and by the bytes of
+// source and frozen code they hold.
+static ObjFunction *compileScript(const char *source) {
+    // Lazily compiled bodies point into the source they came from, which an evicted entry would free.
+    if (compilerOptions.isLazy) return compile(NULL, source);
+
+    size_t length = strlen(source);
+    uint32_t hash = hashScript(source, length);
+    for (int i = 0; i < vm.scriptCount; i++) {
+        CachedScript *script = &vm.scripts[i];
+        if (script->hash == hash && script->length == length && memcmp(script->source, source, length) == 0) {
+            script->lastUse = ++vm.scriptClock;
+            return script->function;
+        }
+    }
+
+    size_t frozen = frozenAllocated();
+    ObjFunction *function = compile(NULL, source);
+    if (function == NULL) return NULL;
+
+    size_t size = length + 1 + frozenAllocated() - frozen;
+    if (size > SCRIPTS_BYTES_MAX) return function;
+    while (vm.scriptCount == SCRIPTS_MAX || vm.scriptBytes + size > SCRIPTS_BYTES_MAX) {
+        evictScript();
+    }
+
+    // The entry roots the function before copying the source can trigger a collection.
+    CachedScript *script = &vm.scripts[vm.scriptCount++];
+    script->hash = hash;
+    script->function = function;
+    script->lastUse = ++vm.scriptClock;
+    script->source = NULL;
+    script->length = length;
+    script->size = size;
+    vm.scriptBytes += size;
+    script->source = ALLOCATE(char, length + 1);
+    memcpy(script->source, source, length + 1);
+    return function;
+}
+
+InterpretResult interpret(const char *source) {
+    // Each source runs against the globals the ones before it left, so none of them is closed.
+    compilerOptions.isClosedWorld = false;
+    return runFunction(compileScript(source));
+}
+
+InterpretResult interpretFile(const char *path, const char *source) {
+    if (!compilerOptions.isCaching) return runFunction(compile(path, source));
+
+    ObjFunction *function = loadCache(path, source);
+    if (function == NULL) {
+        function = compile(path, source);
+        if (function != NULL) {
+            push(OBJ_VAL(function));
+            writeCache(path, source, function);
+            pop();
+        }
+    }
+    return runFunction(function);
+}
+
+// Compiles every script that isn't cached in parallel, then runs them in order against the same globals.
+InterpretResult interpretFiles(const char **paths, const char **sources, int count) {
+    // Any script can redefine what another binds to.
+    compilerOptions.isClosedWorld = false;
+    ObjFunction **functions = ALLOCATE(ObjFunction *, count);
+    const char **missedPaths = ALLOCATE(const char *, count);
+    const char **missedSources = ALLOCATE(const char *, count);
+    int *missed = ALLOCATE(int, count);
+    int missedCount = 0;
+
+    // Compiled scripts wait on the stack until their turn to run.
+    Value *base = vm.stackTop;
+    for (int i = 0; i < count; i++) {
+        functions[i] = compilerOptions.isCaching ? loadCache(paths[i], sources[i]) : NULL;
+        if (functions[i] != NULL) {
+            push(OBJ_VAL(functions[i]));
+        } else {
+            missedPaths[missedCount] = paths[i];
+            missedSources[missedCount] = sources[i];
+            missed[missedCount++] = i;
+        }
+    }
+
+    ObjFunction **compiled = ALLOCATE(ObjFunction *, missedCount);
+    bool isCompiled = compileAll(missedPaths, missedSources, missedCount, compiled);
+    for (int i = 0; i < missedCount; i++) {
+        if (compiled[i] != NULL) push(OBJ_VAL(compiled[i]));
+        functions[missed[i]] = compiled[i];
+    }
+    if (isCompiled && compilerOptions.isCaching) {
+        for (int i = 0; i < missedCount; i++) {
+            writeCache(paths[missed[i]], sources[missed[i]], compiled[i]);
+        }
+    }
+
+    InterpretResult result = isCompiled ? INTERPRET_OK : INTERPRET_COMPILE_ERROR;
+    for (int i = 0; i < count && result == INTERPRET_OK; i++) {
+        result = runFunction(functions[i]);
+    }
+    if (result != INTERPRET_RUNTIME_ERROR) vm.stackTop = base;
+
+    FREE_ARRAY(ObjFunction *, functions, count);
+    FREE_ARRAY(const char *, missedPaths, count);
+    FREE_ARRAY(const char *, missedSources, count);
+    FREE_ARRAY(int, missed, count);
+    FREE_ARRAY(ObjFunction *, compiled, missedCount);
+    return result;
+}
+
+InterpretResult interpretImage(const uint8_t *image, size_t size, const CompiledFn *bodies) {
+    return runFunction(loadImage(image, size, bodies));
 }
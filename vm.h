@@ -11,6 +11,8 @@
 
 #define FRAMES_MAX 64
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+#define SCRIPTS_MAX 16
+#define SCRIPTS_BYTES_MAX (1024 * 1024)
 
 typedef struct {
     ObjClosure *closure;
@@ -18,6 +20,15 @@ typedef struct {
     Value *slots;
 } CallFrame;
 
+typedef struct {
+    uint32_t hash;
+    char *source;
+    size_t length;
+    size_t size;
+    ObjFunction *function;
+    uint64_t lastUse;
+} CachedScript;
+
 typedef struct {
     CallFrame frames[FRAMES_MAX];
     int frameCount;
@@ -26,6 +37,11 @@ typedef struct {
     Value *stackTop;
     Table globals;
     Table strings;
+    Table modules;
+    CachedScript scripts[SCRIPTS_MAX];
+    int scriptCount;
+    size_t scriptBytes;
+    uint64_t scriptClock;
     ObjString *initString;
     ObjUpvalue *openUpvalues;
     size_t bytesAllocated;
@@ -50,6 +66,12 @@ void freeVM();
 
 InterpretResult interpret(const char *source);
 
+InterpretResult interpretFile(const char *path, const char *source);
+
+InterpretResult interpretFiles(const char **paths, const char **sources, int count);
+
+InterpretResult interpretImage(const uint8_t *image, size_t size, const CompiledFn *bodies);
+
 void push(Value value);
 
 Value pop();